@@ -0,0 +1,154 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace underscore{
+	/**
+	 * @short ASCII only, locale independent, byte buffer helpers.
+	 *
+	 * Only bytes in A-Z / a-z are touched. Any other byte, including all bytes >=0x80, pass unchanged,
+	 * so it is safe to use on UTF-8 data.
+	 *
+	 * When SSE2 or AVX2 are available at compile time 16 or 32 bytes are processed at a time.
+	 */
+	namespace ascii{
+		inline char lower(char c){
+			return (c>='A' && c<='Z') ? char(c|0x20) : c;
+		}
+		inline char upper(char c){
+			return (c>='a' && c<='z') ? char(c&~0x20) : c;
+		}
+
+		namespace detail{
+#ifdef __AVX2__
+			/// Mask of the bytes in [first, first+25], using the signed compare trick.
+			inline __m256i range_mask32(__m256i v, char first){
+				__m256i shifted=_mm256_add_epi8(v, _mm256_set1_epi8(char(0x80-first)));
+				return _mm256_cmpgt_epi8(_mm256_set1_epi8(char(0x80+26)), shifted);
+			}
+			inline __m256i lower32(__m256i v){
+				return _mm256_or_si256(v, _mm256_and_si256(range_mask32(v,'A'), _mm256_set1_epi8(0x20)));
+			}
+			inline __m256i upper32(__m256i v){
+				return _mm256_xor_si256(v, _mm256_and_si256(range_mask32(v,'a'), _mm256_set1_epi8(0x20)));
+			}
+#endif
+#ifdef __SSE2__
+			inline __m128i range_mask16(__m128i v, char first){
+				__m128i shifted=_mm_add_epi8(v, _mm_set1_epi8(char(0x80-first)));
+				return _mm_cmplt_epi8(shifted, _mm_set1_epi8(char(0x80+26)));
+			}
+			inline __m128i lower16(__m128i v){
+				return _mm_or_si128(v, _mm_and_si128(range_mask16(v,'A'), _mm_set1_epi8(0x20)));
+			}
+			inline __m128i upper16(__m128i v){
+				return _mm_xor_si128(v, _mm_and_si128(range_mask16(v,'a'), _mm_set1_epi8(0x20)));
+			}
+#endif
+		};
+
+		/**
+		 * @short Lowers n bytes from src into dst. src and dst may be the same buffer.
+		 */
+		inline void lower(const char *src, char *dst, size_t n){
+			size_t i=0;
+#ifdef __AVX2__
+			for (;i+32<=n;i+=32)
+				_mm256_storeu_si256((__m256i*)(dst+i), detail::lower32(_mm256_loadu_si256((const __m256i*)(src+i))));
+#endif
+#ifdef __SSE2__
+			for (;i+16<=n;i+=16)
+				_mm_storeu_si128((__m128i*)(dst+i), detail::lower16(_mm_loadu_si128((const __m128i*)(src+i))));
+#endif
+			for (;i<n;++i)
+				dst[i]=lower(src[i]);
+		}
+		/**
+		 * @short Uppers n bytes from src into dst. src and dst may be the same buffer.
+		 */
+		inline void upper(const char *src, char *dst, size_t n){
+			size_t i=0;
+#ifdef __AVX2__
+			for (;i+32<=n;i+=32)
+				_mm256_storeu_si256((__m256i*)(dst+i), detail::upper32(_mm256_loadu_si256((const __m256i*)(src+i))));
+#endif
+#ifdef __SSE2__
+			for (;i+16<=n;i+=16)
+				_mm_storeu_si128((__m128i*)(dst+i), detail::upper16(_mm_loadu_si128((const __m128i*)(src+i))));
+#endif
+			for (;i<n;++i)
+				dst[i]=upper(src[i]);
+		}
+
+		/**
+		 * @short Compares n bytes of a and b ignoring ASCII case. No copies are made.
+		 */
+		inline bool iequals(const char *a, const char *b, size_t n){
+			size_t i=0;
+#ifdef __AVX2__
+			for (;i+32<=n;i+=32){
+				__m256i la=detail::lower32(_mm256_loadu_si256((const __m256i*)(a+i)));
+				__m256i lb=detail::lower32(_mm256_loadu_si256((const __m256i*)(b+i)));
+				if ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(la,lb))!=0xFFFFFFFFu)
+					return false;
+			}
+#endif
+#ifdef __SSE2__
+			for (;i+16<=n;i+=16){
+				__m128i la=detail::lower16(_mm_loadu_si128((const __m128i*)(a+i)));
+				__m128i lb=detail::lower16(_mm_loadu_si128((const __m128i*)(b+i)));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi8(la,lb))!=0xFFFF)
+					return false;
+			}
+#endif
+			for (;i<n;++i)
+				if (lower(a[i])!=lower(b[i]))
+					return false;
+			return true;
+		}
+
+		/**
+		 * @short Finds needle in haystack ignoring ASCII case.
+		 *
+		 * @returns the position, or -1 if not found.
+		 */
+		inline ssize_t ifind(const char *haystack, size_t hn, const char *needle, size_t nn){
+			if (nn==0)
+				return 0;
+			if (nn>hn)
+				return -1;
+			const char first_l=lower(needle[0]), first_u=upper(needle[0]);
+			const size_t last=hn-nn;
+			for (size_t i=0;i<=last;++i){
+				char c=haystack[i];
+				if ((c==first_l || c==first_u) && iequals(haystack+i+1, needle+1, nn-1))
+					return i;
+			}
+			return -1;
+		}
+	};
+};
@@ -0,0 +1,300 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <limits>
+#include <exception>
+#include "generator.hpp"
+#include "queue.hpp"
+
+namespace underscore{
+	namespace detail{
+		/**
+		 * @short Thread that pulls from the previous stages of a pipeline, and may be left running.
+		 *
+		 * The previous stages may wait for long at next(), as a pipe or follow_file with no more data. So
+		 * stop() only joins the thread if it is not at prev.next(); if it is, the thread is detached and ends
+		 * by itself as soon as next() returns, never calling it again. The shared state keeps prev alive until
+		 * then.
+		 */
+		struct puller{
+			std::atomic<bool> stop, pulling;
+			puller() : stop(false), pulling(false){}
+
+			/// Calls prev.next(v) unless stopped. From the thread.
+			template<typename Prev, typename T>
+			bool next(Prev &prev, T &v){
+				pulling.store(true);
+				bool ret=!stop.load() && prev.next(v);
+				pulling.store(false);
+				return ret;
+			}
+			/// Stops the thread, and joins or detaches it. wake must make it notice stop if it waits for other reasons.
+			template<typename W>
+			void finish(std::thread &t, W wake){
+				stop.store(true);
+				wake();
+				if (!t.joinable())
+					return;
+				if (pulling.load())
+					t.detach();
+				else
+					t.join();
+			}
+		};
+	};
+
+	/**
+	 * @short Runs the previous stages in their own thread. See generator::async.
+	 *
+	 * Elements are passed through a bounded spsc_queue: the thread sleeps when it is full, and continues as
+	 * they are consumed; next() sleeps while it is empty. Exceptions of the previous stages are rethrown at
+	 * next().
+	 */
+	template<typename Prev>
+	class genasync : public generator<genasync<Prev>, typename Prev::value_type>{
+		typedef typename Prev::value_type T;
+		// Shared with the thread, at the heap, so this generator can be moved while it runs, and the thread can
+		// outlive it.
+		struct state{
+			Prev prev;
+			spsc_queue<T> queue;
+			std::atomic<bool> done;
+			detail::puller puller;
+			waiter space, items;
+			detail::thread_error error;
+			state(Prev &&p, size_t capacity) : prev(std::forward<Prev>(p)), queue(capacity), done(false){}
+		};
+		std::shared_ptr<state> _s;
+		std::thread _thread;
+
+		static void _produce(std::shared_ptr<state> s){
+			try{
+				T v;
+				while (s->puller.next(s->prev, v)){
+					bool stopped=false;
+					s->space.wait([&]{ return s->queue.try_push(v) || (stopped=s->puller.stop.load()); });
+					if (stopped)
+						break;
+					s->items.notify();
+				}
+			}
+			catch(...){
+				s->error.set(std::current_exception());
+			}
+			s->done.store(true, std::memory_order_release);
+			s->items.notify();
+		}
+	public:
+		genasync(Prev &&prev, size_t capacity) : _s(std::make_shared<state>(std::forward<Prev>(prev), capacity)){}
+		genasync(genasync &&o) : _s(std::move(o._s)), _thread(std::move(o._thread)){}
+		~genasync(){
+			if (_s)
+				_s->puller.finish(_thread, [this]{ _s->space.notify(); });
+		}
+
+		bool next(T &out){
+			if (!_thread.joinable() && !_s->done)
+				_thread=std::thread(_produce, _s);
+			bool got=false;
+			_s->items.wait([&]{
+				got=_s->queue.try_pop(out) || (_s->done.load(std::memory_order_acquire) && _s->queue.try_pop(out));
+				return got || _s->done.load(std::memory_order_acquire);
+			});
+			if (got){
+				_s->space.notify();
+				return true;
+			}
+			_s->error.rethrow();
+			return false;
+		}
+	};
+
+	/**
+	 * @short Maps the elements with several threads. See generator::parallel_map.
+	 *
+	 * A feeder thread reads the previous stages into an mpmc_queue, and the workers apply f. At most capacity
+	 * elements are in flight. Ordered results are written to a slot per element and generated in input order;
+	 * unordered ones go through another mpmc_queue as they are ready. Threads sleep while they can not go on.
+	 */
+	template<typename Prev, typename S, typename F>
+	class genparallel_map : public generator<genparallel_map<Prev, S, F>, S>{
+		typedef typename Prev::value_type T;
+		/// A slot per element, not a std::vector<S>: with S=bool its elements would share words.
+		struct slot{
+			S value;
+			std::atomic<bool> ready;
+			slot() : ready(false){}
+		};
+		struct state{
+			Prev prev;
+			F f;
+			bool ordered;
+			size_t capacity;
+			mpmc_queue<std::pair<size_t, T>> input;
+			mpmc_queue<S> output;                     // Unordered
+			std::unique_ptr<slot[]> results;          // Ordered, slot seq % capacity
+			std::atomic<size_t> consumed, total;
+			std::atomic<bool> fed;
+			detail::puller puller;                    // Of the feeder, stops the workers too
+			waiter space, work, ready;                // For the feeder, the workers and the consumer
+			detail::thread_error error;
+
+			state(Prev &&p, F &&f, bool ordered, size_t capacity)
+					: prev(std::forward<Prev>(p)), f(std::move(f)), ordered(ordered), capacity(detail::_round_pow2(capacity)),
+					  input(this->capacity), output(ordered ? 2 : this->capacity), consumed(0),
+					  total(std::numeric_limits<size_t>::max()), fed(false){
+				if (ordered)
+					results.reset(new slot[this->capacity]);
+			}
+			bool stopped() const{ return puller.stop.load(std::memory_order_relaxed); }
+		};
+		std::shared_ptr<state> _s;
+		size_t _nthreads;
+		std::thread _feeder;
+		std::vector<std::thread> _workers;
+
+		static void _feed(std::shared_ptr<state> s){
+			size_t seq=0;
+			try{
+				std::pair<size_t, T> item;
+				while (s->puller.next(s->prev, item.second)){
+					item.first=seq;
+					s->space.wait([&]{
+						return s->stopped() || (seq-s->consumed.load(std::memory_order_acquire)<s->capacity && s->input.try_push(item));
+					});
+					if (s->stopped())
+						break;
+					s->work.notify();
+					++seq;
+				}
+			}
+			catch(...){
+				s->error.set(std::current_exception());
+			}
+			s->total.store(seq, std::memory_order_release);
+			s->fed.store(true, std::memory_order_release);
+			s->work.notify();
+			s->ready.notify();
+		}
+		static void _work(state *s){
+			try{
+				std::pair<size_t, T> item;
+				for(;;){
+					bool got=false;
+					s->work.wait([&]{
+						got=s->input.try_pop(item);
+						return got || s->stopped() || s->fed.load(std::memory_order_acquire);
+					});
+					if (!got && !s->stopped())
+						got=s->input.try_pop(item); // All fed, maybe something left
+					if (!got || s->stopped())
+						return;
+					S r=s->f(std::move(item.second));
+					if (s->ordered){
+						slot &sl=s->results[item.first & (s->capacity-1)];
+						sl.value=std::move(r);
+						sl.ready.store(true, std::memory_order_release);
+					}
+					else{
+						s->space.wait([&]{ return s->output.try_push(r) || s->stopped(); });
+						if (s->stopped())
+							return;
+					}
+					s->ready.notify();
+				}
+			}
+			catch(...){
+				s->error.set(std::current_exception());
+				s->puller.stop.store(true);
+				s->ready.notify();
+				s->space.notify();
+				s->work.notify();
+			}
+		}
+		void _start(){
+			_feeder=std::thread(_feed, _s);
+			for (size_t i=0;i<_nthreads;++i)
+				_workers.push_back(std::thread(_work, _s.get()));
+		}
+	public:
+		genparallel_map(Prev &&prev, F &&f, size_t threads, bool ordered, size_t capacity)
+				: _s(std::make_shared<state>(std::forward<Prev>(prev), std::move(f), ordered, std::max<size_t>(capacity, threads))), _nthreads(threads){
+			if (_nthreads==0)
+				_nthreads=std::max<size_t>(std::thread::hardware_concurrency(), 1);
+		}
+		genparallel_map(genparallel_map &&o) : _s(std::move(o._s)), _nthreads(o._nthreads), _feeder(std::move(o._feeder)), _workers(std::move(o._workers)){}
+		~genparallel_map(){
+			if (!_s)
+				return;
+			state *s=_s.get();
+			s->puller.finish(_feeder, [s]{
+				s->space.notify();
+				s->work.notify();
+			});
+			for (auto &t: _workers)
+				t.join();
+		}
+
+		bool next(S &out){
+			if (_workers.empty())
+				_start();
+			state *s=_s.get();
+			size_t c=s->consumed.load(std::memory_order_relaxed);
+			bool got=false;
+			s->ready.wait([&]{
+				if (s->error.failed.load(std::memory_order_acquire) || c==s->total.load(std::memory_order_acquire))
+					return true;
+				if (s->ordered){
+					slot &sl=s->results[c & (s->capacity-1)];
+					if (sl.ready.load(std::memory_order_acquire)){
+						out=std::move(sl.value);
+						sl.ready.store(false, std::memory_order_relaxed);
+						got=true;
+					}
+				}
+				else
+					got=s->output.try_pop(out);
+				return got;
+			});
+			if (!got){
+				s->error.rethrow();
+				return false;
+			}
+			s->consumed.store(c+1, std::memory_order_release);
+			s->space.notify();
+			return true;
+		}
+	};
+
+	template<typename Derived, typename T>
+	genasync<Derived> generator<Derived, T>::async(size_t capacity){
+		return genasync<Derived>(std::move(*self()), capacity);
+	}
+
+	template<typename Derived, typename T>
+	template<typename S, typename F>
+	genparallel_map<Derived, typename detail::map_result<S, T, decltype(std::declval<F&>()(std::declval<T&&>()))>::type, typename std::decay<F>::type>
+	generator<Derived, T>::parallel_map(F &&f, size_t threads, bool ordered, size_t capacity){
+		typedef typename detail::map_result<S, T, decltype(std::declval<F&>()(std::declval<T&&>()))>::type result_type;
+		typename std::decay<F>::type fn(std::forward<F>(f));
+		return genparallel_map<Derived, result_type, typename std::decay<F>::type>(std::move(*self()), std::move(fn), threads, ordered, capacity);
+	}
+};
@@ -0,0 +1,163 @@
+#include <iostream>
+#include <chrono>
+#include <functional>
+
+#include "string.hpp"
+#include "generator.hpp"
+
+using namespace underscore;
+
+typedef std::function<underscore::string (underscore::string &&)> map_f;
+typedef std::function<bool (const underscore::string &)> filter_f;
+
+/**
+ * @short The map and filter stages as they were before they were templated on the callable: a
+ * std::function each, and no batching. Kept here as the baseline.
+ */
+namespace before{
+	template<typename Prev, typename S>
+	class genmap : public generator<genmap<Prev, S>, S>{
+		typedef typename Prev::value_type in_type;
+		Prev _prev;
+		in_type _in;
+	public:
+		std::function<S (in_type &&)> _f;
+		genmap(std::function<S (in_type &&)> &&f, Prev &&prev) : _prev(std::forward<Prev>(prev)), _f(std::move(f)){};
+		genmap(genmap &&o) : _prev(std::move(o._prev)), _f(std::move(o._f)){};
+
+		bool next(S &out){
+			if (!_prev.next(_in))
+				return false;
+			out=_f(std::move(_in));
+			return true;
+		}
+	};
+
+	template<typename Prev>
+	class genfilter : public generator<genfilter<Prev>, typename Prev::value_type>{
+		typedef typename Prev::value_type T;
+		Prev _prev;
+	public:
+		std::function<bool (const T &)> _f;
+		genfilter(std::function<bool (const T &)> &&f, Prev &&prev) : _prev(std::forward<Prev>(prev)), _f(std::move(f)){}
+		genfilter(genfilter &&o) : _prev(std::move(o._prev)), _f(std::move(o._f)){};
+
+		bool next(T &out){
+			while(_prev.next(out)){
+				if (_f(out))
+					return true;
+			}
+			return false;
+		};
+	};
+
+	template<typename Prev>
+	genmap<Prev, typename Prev::value_type> map(Prev &&prev, map_f &&f){
+		return genmap<Prev, typename Prev::value_type>(std::move(f), std::move(prev));
+	}
+	template<typename Prev>
+	genfilter<Prev> filter(Prev &&prev, filter_f &&f){
+		return genfilter<Prev>(std::move(f), std::move(prev));
+	}
+};
+
+static std::vector<underscore::string> input(size_t n){
+	std::vector<underscore::string> v;
+	v.reserve(n);
+	for (size_t i=0;i<n;i++)
+		v.push_back(std::string("e")+std::to_string(i)); // Short strings, so allocation does not hide the stage cost
+
+	return v;
+}
+
+/// Runs f on fresh input, returns the milliseconds it took.
+template<typename F>
+static double run(size_t n, const F &f, size_t &result){
+	auto data=input(n);
+	auto start=std::chrono::steady_clock::now();
+	result=f(std::move(data));
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-start).count()/1000.0;
+}
+
+static void report(const char *name, size_t n, double ms, size_t result){
+	std::cout<<name<<": "<<ms<<" ms, "<<result<<" elements, "<<(ms*1e6/n)<<" ns/element"<<std::endl;
+}
+
+/**
+ * Same five stage pipeline as gentest.cpp: with the stages from before they were templated, with
+ * std::function through the current stages, and with lambdas. Best of several interleaved runs.
+ */
+int main(int argc, char **argv){
+	size_t n=argc>1 ? std::stoul(argv[1]) : 2000000;
+	
+	auto baseline=[](std::vector<underscore::string> &&data){
+		size_t count=0;
+		auto gen=before::filter(
+			before::map(
+				before::filter(
+					before::map(
+						before::filter(vector(std::move(data)), [](const underscore::string &s){ return s.length()>3; }),
+						[](underscore::string &&s){ return std::move(s); }),
+					[](const underscore::string &s){ return s.endswith("7"); }),
+				[](underscore::string &&s){ return std::move(s); }),
+			[](const underscore::string &s){ return !s.empty(); });
+		for (auto &s: gen)
+			count+=(s.size()>0);
+		return count;
+	};
+	
+	auto erased=[](std::vector<underscore::string> &&data){
+		size_t count=0;
+		auto gen=vector(std::move(data))
+			.filter(filter_f([](const underscore::string &s){ return s.length()>3; }))
+			.map(map_f([](underscore::string &&s){ return std::move(s); }))
+			.filter(filter_f([](const underscore::string &s){ return s.endswith("7"); }))
+			.map(map_f([](underscore::string &&s){ return std::move(s); }))
+			.filter(filter_f([](const underscore::string &s){ return !s.empty(); }));
+		for (auto &s: gen)
+			count+=(s.size()>0);
+		return count;
+	};
+	
+	auto inlined=[](std::vector<underscore::string> &&data){
+		size_t count=0;
+		auto gen=vector(std::move(data))
+			.filter([](const underscore::string &s){ return s.length()>3; })
+			.map([](underscore::string &&s){ return std::move(s); })
+			.filter([](const underscore::string &s){ return s.endswith("7"); })
+			.map([](underscore::string &&s){ return std::move(s); })
+			.filter([](const underscore::string &s){ return !s.empty(); });
+		for (auto &s: gen)
+			count+=(s.size()>0);
+		return count;
+	};
+	
+	auto batched=[](std::vector<underscore::string> &&data){
+		size_t count=0;
+		auto gen=vector(std::move(data))
+			.filter([](const underscore::string &s){ return s.length()>3; })
+			.map([](underscore::string &&s){ return std::move(s); })
+			.filter([](const underscore::string &s){ return s.endswith("7"); })
+			.map([](underscore::string &&s){ return std::move(s); })
+			.filter([](const underscore::string &s){ return !s.empty(); });
+		std::vector<underscore::string> batch(256);
+		size_t got;
+		while ((got=gen.next_batch(batch.data(), batch.size())))
+			for (size_t i=0;i<got;++i)
+				count+=(batch[i].size()>0);
+		return count;
+	};
+	
+	double best_baseline=1e30, best_erased=1e30, best_inlined=1e30, best_batched=1e30;
+	size_t r_baseline=0, r_erased=0, r_inlined=0, r_batched=0;
+	for (int i=0;i<5;i++){
+		best_baseline=std::min(best_baseline, run(n, baseline, r_baseline));
+		best_erased=std::min(best_erased, run(n, erased, r_erased));
+		best_inlined=std::min(best_inlined, run(n, inlined, r_inlined));
+		best_batched=std::min(best_batched, run(n, batched, r_batched));
+	}
+	report("before, std::function stages", n, best_baseline, r_baseline);
+	report("std::function", n, best_erased, r_erased);
+	report("lambdas", n, best_inlined, r_inlined);
+	report("lambdas, batched", n, best_batched, r_batched);
+}
@@ -0,0 +1,229 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <sys/stat.h>
+#include "string_ref.hpp"
+#include "mmap_file.hpp"
+#include "packed_string_list.hpp"
+#include "cache_format.hpp"
+#include "file.hpp"
+
+namespace underscore{
+	/**
+	 * @short Read only list of strings memory mapped from a file written by save().
+	 *
+	 * Loading it only checks the header: elements are views straight into the mapping, as with
+	 * packed_string_list but with no copy and no parsing. Copies share the mapping, views are valid while
+	 * any of them is alive.
+	 */
+	class mapped_string_list{
+		std::shared_ptr<const mapped_file> _file;
+		const char *_bytes;
+		const uint32_t *_offsets32;
+		const uint64_t *_offsets64;
+		size_t _size;
+		cache_key _key;
+
+		uint64_t _offset(size_t i) const{
+			if (_offsets32)
+				return _offsets32[i];
+			return _offsets64 ? _offsets64[i] : 0;
+		}
+		[[noreturn]] static void _invalid(const std::string &path, const char *why){
+			throw std::runtime_error("Invalid cache file "+path+": "+why);
+		}
+	public:
+		typedef string_ref value_type;
+
+		class const_iterator : public std::iterator<std::random_access_iterator_tag, string_ref, ssize_t, const string_ref*, string_ref>{
+			const mapped_string_list *_list;
+			size_t _i;
+		public:
+			const_iterator(const mapped_string_list *list, size_t i) : _list(list), _i(i){}
+			const_iterator() : _list(nullptr), _i(0){}
+			string_ref operator*() const{ return (*_list)[_i]; }
+			string_ref operator[](ssize_t n) const{ return (*_list)[_i+n]; }
+			const_iterator &operator++(){ ++_i; return *this; }
+			const_iterator operator++(int){ auto r=*this; ++_i; return r; }
+			const_iterator &operator--(){ --_i; return *this; }
+			const_iterator operator--(int){ auto r=*this; --_i; return r; }
+			const_iterator &operator+=(ssize_t n){ _i+=n; return *this; }
+			const_iterator &operator-=(ssize_t n){ _i-=n; return *this; }
+			const_iterator operator+(ssize_t n) const{ return const_iterator(_list, _i+n); }
+			const_iterator operator-(ssize_t n) const{ return const_iterator(_list, _i-n); }
+			ssize_t operator-(const const_iterator &o) const{ return ssize_t(_i)-ssize_t(o._i); }
+			bool operator==(const const_iterator &o) const{ return _i==o._i; }
+			bool operator!=(const const_iterator &o) const{ return _i!=o._i; }
+			bool operator<(const const_iterator &o) const{ return _i<o._i; }
+		};
+		typedef const_iterator iterator;
+
+		mapped_string_list() : _bytes(""), _offsets32(nullptr), _offsets64(nullptr), _size(0){}
+		/**
+		 * @short Maps a cache file. Throws std::runtime_error if it is missing, or is not a cache of this version.
+		 */
+		explicit mapped_string_list(const std::string &path) : _file(std::make_shared<mapped_file>(path)), _offsets32(nullptr), _offsets64(nullptr){
+			using detail::cache_header;
+			if (!_file->is_open())
+				_invalid(path, "can not open it");
+			const char *data=_file->data();
+			size_t size=_file->size();
+			if (size<sizeof(cache_header))
+				_invalid(path, "too short");
+			const cache_header *h=(const cache_header*)data;
+			if (memcmp(h->magic, detail::cache_magic, sizeof(h->magic))!=0)
+				_invalid(path, "not a cache file");
+			if (h->version!=detail::cache_version || (h->offset_size!=4 && h->offset_size!=8))
+				_invalid(path, "unknown version");
+			size_t at=sizeof(cache_header);
+			if (h->source_path_size>size-at)
+				_invalid(path, "truncated");
+			_key.path.assign(data+at, h->source_path_size);
+			_key.size=h->source_size;
+			_key.mtime=h->source_mtime;
+			at+=detail::_pad8(h->source_path_size);
+			if (at>size || h->bytes>size || h->count>=(size-at)/h->offset_size || at+(h->count+1)*h->offset_size+h->bytes!=size)
+				_invalid(path, "truncated");
+			_size=h->count;
+			if (h->offset_size==4)
+				_offsets32=(const uint32_t*)(data+at);
+			else
+				_offsets64=(const uint64_t*)(data+at);
+			_bytes=data+at+(_size+1)*h->offset_size;
+			if (_offset(0)!=0 || _offset(_size)!=h->bytes)
+				_invalid(path, "corrupted offsets");
+			for (size_t i=0;i<_size;++i)
+				if (_offset(i)>_offset(i+1))
+					_invalid(path, "corrupted offsets");
+		}
+
+		size_t size() const{ return _size; }
+		size_t count() const{ return _size; }
+		bool empty() const{ return _size==0; }
+		/// Total bytes of all the strings.
+		size_t bytes() const{ return _offset(_size); }
+
+		string_ref operator[](size_t p) const{
+			uint64_t b=_offset(p);
+			return string_ref(_bytes+b, _offset(p+1)-b);
+		}
+		string_ref at(size_t p) const{
+			if (p>=size())
+				throw std::out_of_range("mapped_string_list::at");
+			return (*this)[p];
+		}
+		const_iterator begin() const{ return const_iterator(this, 0); }
+		const_iterator end() const{ return const_iterator(this, size()); }
+
+		/// Source file it was made from, as given to save().
+		const cache_key &key() const{ return _key; }
+		/// Copy that can be modified.
+		large_packed_string_list packed() const{
+			large_packed_string_list ret;
+			ret.reserve(size(), bytes());
+			for (auto s: *this)
+				ret.push_back(s);
+			return ret;
+		}
+	};
+
+	/**
+	 * @short Generator of the lines of a file, from a cache of them. See file::cached.
+	 */
+	class cached_file : public generator<cached_file, string_ref>{
+		mapped_string_list _list;
+		size_t _i;
+		bool _hit;
+	public:
+		cached_file(mapped_string_list list, bool hit) : _list(std::move(list)), _i(0), _hit(hit){}
+
+		bool next(string_ref &out){
+			if (_i>=_list.size())
+				return false;
+			out=_list[_i++];
+			return true;
+		}
+		size_t advance(size_t n){
+			n=std::min(n, _list.size()-_i);
+			_i+=n;
+			return n;
+		}
+		size_t next_batch(string_ref *out, size_t n){
+			n=std::min(n, _list.size()-_i);
+			for (size_t j=0;j<n;++j)
+				out[j]=_list[_i+j];
+			_i+=n;
+			return n;
+		}
+
+		const mapped_string_list &list() const{ return _list; }
+		/// The cache was valid; if false, the file was read and the cache written.
+		bool hit() const{ return _hit; }
+	};
+
+	/**
+	 * @short Path of the cache of source at dir: a hash of the source path.
+	 */
+	inline std::string cache_path(const std::string &source, const std::string &dir){
+		uint64_t h=1469598103934665603ULL; // FNV-1a
+		for (char c: source){
+			h^=(unsigned char)c;
+			h*=1099511628211ULL;
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.lines", (unsigned long long)h);
+		return dir+"/"+name;
+	}
+
+	inline cached_file file::cached(const std::string &dir){
+		if (_path.empty())
+			throw std::invalid_argument("file::cached needs a file path");
+		cache_key key=cache_key::of(_path);
+		if (key.path.empty())
+			throw std::runtime_error("Can not open "+_path);
+		std::string path=cache_path(key.path, dir);
+		try{
+			mapped_string_list list(path);
+			if (list.key()==key)
+				return cached_file(std::move(list), true);
+		}
+		catch(const std::runtime_error &){
+		}
+		// Reopened, as lines may have already been read from this one
+		file source(_path);
+		if (!source.is_open())
+			throw std::runtime_error("Can not open "+_path);
+		large_packed_string_list lines;
+		string_ref line;
+		if (source._mmap)
+			while (source._mmap->next(line))
+				lines.push_back(line);
+		else
+			for (underscore::string l; source.next(l);)
+				lines.push_back(l);
+		mkdir(dir.c_str(), 0755);
+		lines.save(path, key);
+		return cached_file(mapped_string_list(path), false);
+	}
+};
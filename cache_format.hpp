@@ -0,0 +1,149 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <iterator>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "string_ref.hpp"
+
+namespace underscore{
+	/**
+	 * @short Identifies the version of a source file a cache was made from.
+	 */
+	struct cache_key{
+		std::string path;
+		uint64_t size;
+		int64_t mtime; ///< Nanoseconds
+		cache_key() : size(0), mtime(0){}
+
+		/// Of the file as it is now. Empty path if it does not exist.
+		static cache_key of(const std::string &path){
+			cache_key k;
+			struct stat st;
+			if (stat(path.c_str(), &st)!=0)
+				return k;
+			char real[PATH_MAX];
+			k.path=realpath(path.c_str(), real) ? std::string(real) : path;
+			k.size=st.st_size;
+			k.mtime=int64_t(st.st_mtim.tv_sec)*1000000000+st.st_mtim.tv_nsec;
+			return k;
+		}
+		bool operator==(const cache_key &o) const{ return path==o.path && size==o.size && mtime==o.mtime; }
+		bool operator!=(const cache_key &o) const{ return !(*this==o); }
+	};
+
+	namespace detail{
+		/**
+		 * @short Layout of a cached string list: this header, the source path, padding to 8 bytes, count+1
+		 * offsets of offset_size bytes, and the bytes of all the strings. In native byte order.
+		 */
+		struct cache_header{
+			char magic[8];
+			uint32_t version;
+			uint32_t offset_size;
+			uint64_t count;
+			uint64_t bytes;
+			uint64_t source_size;
+			int64_t source_mtime;
+			uint64_t source_path_size;
+		};
+		static const char cache_magic[8]={'U', 'S', 'C', 'A', 'C', 'H', 'E', '\0'};
+		static const uint32_t cache_version=1;
+
+		inline size_t _pad8(size_t n){ return (n+7) & ~size_t(7); }
+
+		template<typename Offset, typename I>
+		void _write_offsets(FILE *f, I begin, I end){
+			std::vector<Offset> offsets(1, 0);
+			Offset at=0;
+			for (auto it=begin;it!=end;++it){
+				at+=string_ref(*it).size();
+				offsets.push_back(at);
+			}
+			fwrite(offsets.data(), sizeof(Offset), offsets.size(), f);
+		}
+
+		/**
+		 * @short Writes the strings at [begin, end) as a cache file, atomically: to a temporary file that is
+		 * synced and then renamed.
+		 */
+		template<typename I>
+		void write_string_list(const std::string &path, const cache_key &key, I begin, I end){
+			cache_header h;
+			memset(&h, 0, sizeof(h));
+			memcpy(h.magic, cache_magic, sizeof(h.magic));
+			h.version=cache_version;
+			for (auto it=begin;it!=end;++it){
+				++h.count;
+				h.bytes+=string_ref(*it).size();
+			}
+			h.offset_size=h.bytes>UINT32_MAX ? 8 : 4;
+			h.source_size=key.size;
+			h.source_mtime=key.mtime;
+			h.source_path_size=key.path.size();
+
+			std::string tmp=path+".tmp"+std::to_string(getpid());
+			FILE *f=fopen(tmp.c_str(), "w");
+			if (!f)
+				throw std::runtime_error("Can not write cache "+tmp+": "+strerror(errno));
+			fwrite(&h, sizeof(h), 1, f);
+			fwrite(key.path.data(), 1, key.path.size(), f);
+			static const char zeros[8]={0};
+			fwrite(zeros, 1, _pad8(key.path.size())-key.path.size(), f);
+			if (h.offset_size==8)
+				_write_offsets<uint64_t>(f, begin, end);
+			else
+				_write_offsets<uint32_t>(f, begin, end);
+			for (auto it=begin;it!=end;++it){
+				string_ref s(*it);
+				fwrite(s.data(), 1, s.size(), f);
+			}
+			bool ok=fflush(f)==0 && !ferror(f) && fsync(fileno(f))==0;
+			ok=fclose(f)==0 && ok;
+			if (!ok || rename(tmp.c_str(), path.c_str())!=0){
+				unlink(tmp.c_str());
+				throw std::runtime_error("Can not write cache "+path+": "+strerror(errno));
+			}
+		}
+	};
+
+	/**
+	 * @short Writes the strings at [begin, end) in a binary format that mapped_string_list maps back without
+	 * parsing.
+	 *
+	 * key tells which version of which source file they were made from.
+	 */
+	template<typename I>
+	void save(const std::string &path, I begin, I end, const cache_key &key=cache_key()){
+		detail::write_string_list(path, key, begin, end);
+	}
+	/**
+	 * @short Writes all the strings of a sequence, or any container, as save(path, begin, end, key).
+	 */
+	template<typename Container>
+	void save(const std::string &path, const Container &strings, const cache_key &key=cache_key()){
+		detail::write_string_list(path, key, std::begin(strings), std::end(strings));
+	}
+};
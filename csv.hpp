@@ -0,0 +1,115 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include "generator.hpp"
+#include "fields.hpp"
+#include "mmap_file.hpp"
+
+namespace underscore{
+	/**
+	 * @short Generator of the rows of a memory mapped CSV file, with only the wanted columns.
+	 *
+	 * The file is scanned a block at a time for separators, newlines and quotes, and rows are split using
+	 * those offsets, so columns after the last wanted one cost almost nothing. Quoted fields may contain
+	 * separators, newlines and "" for a quote. Fields are views into the mapped file (into the row if they
+	 * had escaped quotes), valid until the next row.
+	 *
+	 * With header, the first row are the column names, and columns may be wanted by name.
+	 *
+	 * Example:
+	 *
+	 * 	csv("sales.csv", {"region", "amount"}).map([](const row &r){ return std::make_pair(r[0].str(), r[1].to_double()); })
+	 */
+	class csv : public generator<csv, row>{
+	public:
+		static const size_t block_size=64*1024;
+	private:
+		std::shared_ptr<const mapped_file> _file;
+		detail::row_parser _parser;
+		std::vector<size_t> _idx; // Offsets of the scanned structural bytes, from _k on are not used yet
+		size_t _k;
+		size_t _scanned;
+		size_t _pos;
+		std::vector<std::string> _header;
+
+		void _scan_block(){
+			_idx.erase(_idx.begin(), _idx.begin()+_k);
+			_k=0;
+			size_t end=std::min(_scanned+block_size, _file->size());
+			detail::scan_structural(_file->data(), _scanned, end, _parser.sep(), _idx);
+			_scanned=end;
+		}
+		static bool _next(csv &c, detail::row_parser &parser, row &out){
+			size_t size=c._file->size();
+			if (c._pos>=size)
+				return false;
+			for(;;){
+				size_t next;
+				if (parser.parse(c._file->data(), c._pos, c._scanned, c._scanned==size, c._idx, c._k, next, out)){
+					c._pos=next;
+					return true;
+				}
+				c._scan_block();
+			}
+		}
+		void _read_header(){
+			detail::row_parser all(_parser.sep(), std::vector<size_t>());
+			row r;
+			if (_next(*this, all, r))
+				_header=r.strings();
+		}
+		static std::vector<size_t> _columns(const std::string &path, char sep, const std::vector<std::string> &names){
+			csv head(path, sep, std::vector<size_t>(), true);
+			std::vector<size_t> ret;
+			for (auto &n: names){
+				auto it=std::find(head._header.begin(), head._header.end(), n);
+				if (it==head._header.end())
+					throw std::invalid_argument("Unknown column "+n+" at "+path);
+				ret.push_back(it-head._header.begin());
+			}
+			return ret;
+		}
+	public:
+		/**
+		 * @short Columns by index, all of them if none wanted.
+		 */
+		explicit csv(const std::string &path, char sep=',', const std::vector<size_t> &wanted=std::vector<size_t>(), bool header=false)
+				: _file(std::make_shared<mapped_file>(path)), _parser(sep, wanted), _k(0), _scanned(0), _pos(0){
+			if (header)
+				_read_header();
+		}
+		/**
+		 * @short Columns by name, as found at the header. Throws std::invalid_argument if one is missing.
+		 */
+		csv(const std::string &path, const std::vector<std::string> &columns, char sep=',')
+				: csv(path, sep, _columns(path, sep, columns), true){}
+		csv(csv &&o) : _file(std::move(o._file)), _parser(std::move(o._parser)), _idx(std::move(o._idx)), _k(o._k),
+				_scanned(o._scanned), _pos(o._pos), _header(std::move(o._header)){}
+
+		bool next(row &out){
+			return _next(*this, _parser, out);
+		}
+
+		/// All the column names, if read with header.
+		const std::vector<std::string> &header() const{ return _header; }
+	};
+};
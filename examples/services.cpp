@@ -1,4 +1,5 @@
 #include <fstream>
+#include <sstream>
 #include <map>
 #include <iostream>
 #include <fstream>
@@ -33,16 +34,19 @@ void manual(){
 		std::getline(input, str); // Get line
 		
 		str=str.substr(0, str.find_first_of('#')); // Remove comments, and trim
-		auto i=str.find_first_not_of(' '); auto end=str.find_last_not_of(' ');
-		if (i==end) 
+		auto i=str.find_first_not_of(" \t"); auto end=str.find_last_not_of(" \t");
+		if (i==std::string::npos) 
 			str=std::string();
 		else
-			str=str.substr(i,end+1);
+			str=str.substr(i,end-i+1);
 		
 		if (str.empty()) // do not process empty lines
 			continue; 
 		
-		auto t=std::make_tuple<std::string,std::string>(str.substr(0,str.find_first_of(' ')), str.substr(str.find_last_of(' '))); // Create tuples <service, port/prot>
+		std::istringstream fields(str);
+		std::string name, port_prot;
+		fields>>name>>port_prot;
+		auto t=std::make_tuple(name, port_prot); // Create tuples <service, port/prot>
 		
 		if (std::get<0>(t).length()==0 || std::get<1>(t).length()==0) // Only tcp ports
 			continue; 
@@ -64,7 +68,7 @@ void manual(){
 
 void using_underscore(){
 	std::map<std::string, int> services;
-	file(std::ifstream("/etc/services"))
+	file("/etc/services")
 		.map([](const string &s){ // Remove comments, and trim
 			auto r=s.split('#',true);
 			if (r.count()==0)
@@ -75,13 +79,13 @@ void using_underscore(){
 			return s.contains("/tcp"); 
 		})
 		.map<string_list>([](const string &s){  // Prepare pairs, {service, port/type}
-				return s.split(' ');
+				return s.replace("\t"," ").split(' ');
 		})
 		.filter([](const string_list &t){ // Only tcp ports
-			return t[1].endswith("/tcp");
+			return t.count()>=2 && t[1].endswith("/tcp");
 		})
 		.each([&services](const string_list &t){ // Prepare pairs
-			services[t[0]]=t[1].slice(0,-5).to_long();
+			services[t[0]]=t[1].slice(0,-4).to_long();
 		});
 	
 	for(auto &s: {"http","ssh","telnet"} )
@@ -0,0 +1,449 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <memory>
+#include <future>
+#include <deque>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <unistd.h>
+#include "generator.hpp"
+
+namespace underscore{
+	namespace detail{
+		/**
+		 * @short How elements are written to and read from sort runs, and their approximate memory use.
+		 *
+		 * Strings are written as a varint length plus the bytes. Arithmetic types as raw bytes. read() returns
+		 * false at the end of the run, and throws std::runtime_error on read errors or a partial element.
+		 */
+		template<typename T, typename Enable=void>
+		struct run_codec;
+
+		inline void _write_varint(FILE *f, uint64_t n){
+			unsigned char buf[10];
+			int i=0;
+			do{
+				buf[i]=(n & 0x7f) | (n>0x7f ? 0x80 : 0);
+				n>>=7;
+				++i;
+			}while(n);
+			fwrite(buf, 1, i, f);
+		}
+		/// Reads n bytes. False at the end of the run if first and nothing was read; throws if only part was.
+		inline bool _read_bytes(FILE *f, void *data, size_t n, bool first){
+			size_t got=fread(data, 1, n, f);
+			if (got==n)
+				return true;
+			if (ferror(f))
+				throw std::runtime_error("Can not read temporary sort run");
+			if (got==0 && first)
+				return false;
+			throw std::runtime_error("Truncated temporary sort run");
+		}
+		inline bool _read_varint(FILE *f, uint64_t &n){
+			n=0;
+			for (int shift=0;shift<64;shift+=7){
+				int c=getc_unlocked(f);
+				if (c==EOF){
+					if (ferror(f))
+						throw std::runtime_error("Can not read temporary sort run");
+					if (shift==0)
+						return false;
+					throw std::runtime_error("Truncated temporary sort run");
+				}
+				n|=uint64_t(c & 0x7f)<<shift;
+				if (!(c & 0x80))
+					return true;
+			}
+			throw std::runtime_error("Corrupted temporary sort run");
+		}
+
+		template<typename T>
+		struct run_codec<T, typename std::enable_if<std::is_arithmetic<T>::value>::type>{
+			static void write(FILE *f, const T &v){ fwrite(&v, sizeof(T), 1, f); }
+			static bool read(FILE *f, T &v){ return _read_bytes(f, &v, sizeof(T), true); }
+			static size_t memory(const T &){ return sizeof(T); }
+		};
+		template<>
+		struct run_codec<std::string>{
+			static void write(FILE *f, const std::string &v){
+				_write_varint(f, v.size());
+				fwrite(v.data(), 1, v.size(), f);
+			}
+			static bool read(FILE *f, std::string &v){
+				uint64_t n;
+				if (!_read_varint(f, n))
+					return false;
+				v.resize(n);
+				return n==0 || _read_bytes(f, &v[0], n, false);
+			}
+			static size_t memory(const std::string &v){ return sizeof(std::string)+v.capacity(); }
+		};
+		template<>
+		struct run_codec<underscore::string>{
+			static void write(FILE *f, const underscore::string &v){
+				_write_varint(f, v.size());
+				fwrite(v.data(), 1, v.size(), f);
+			}
+			static bool read(FILE *f, underscore::string &v){
+				std::string s;
+				if (!run_codec<std::string>::read(f, s))
+					return false;
+				v=underscore::string(std::move(s));
+				return true;
+			}
+			static size_t memory(const underscore::string &v){ return sizeof(underscore::string)+v.size(); }
+		};
+
+		/**
+		 * @short A sorted run, in memory or spilled to an anonymous temporary file.
+		 */
+		template<typename T>
+		class sort_run{
+			std::vector<T> _mem;
+			size_t _mem_pos;
+			FILE *_file;
+		public:
+			sort_run() : _mem_pos(0), _file(nullptr){}
+			sort_run(const sort_run &)=delete;
+			~sort_run(){
+				if (_file)
+					fclose(_file);
+			}
+
+			/// Keeps the run in memory.
+			void keep(std::vector<T> &&v){
+				_mem=std::move(v);
+			}
+			/**
+			 * @short Writes the elements that next(T&) returns to a temporary file at dir. It is deleted as
+			 * soon as it is closed.
+			 */
+			template<typename Next>
+			void spill(Next next, const std::string &dir, size_t buffer_size){
+				std::string path=dir+"/underscore-sort-XXXXXX";
+				int fd=mkstemp(&path[0]);
+				if (fd<0)
+					throw std::runtime_error("Can not create temporary sort run at "+dir);
+				unlink(path.c_str());
+				_file=fdopen(fd, "w+b");
+				if (!_file){
+					::close(fd);
+					throw std::runtime_error("Can not open temporary sort run");
+				}
+				setvbuf(_file, nullptr, _IOFBF, buffer_size);
+				T v;
+				while (next(v)){
+					run_codec<T>::write(_file, v);
+					if (ferror(_file))
+						break;
+				}
+				if (fflush(_file)!=0 || ferror(_file))
+					throw std::runtime_error("Can not write temporary sort run at "+dir+": "+strerror(errno));
+			}
+			void spill(const std::vector<T> &v, const std::string &dir, size_t buffer_size){
+				auto it=v.begin();
+				spill([&it, &v](T &out){
+					if (it==v.end())
+						return false;
+					out=*it++;
+					return true;
+				}, dir, buffer_size);
+			}
+			/// Reopens the file from its start, with a read buffer of buffer_size: the write one can not be resized.
+			void start_reading(size_t buffer_size){
+				if (!_file)
+					return;
+				int fd=dup(fileno(_file));
+				fclose(_file);
+				_file=(fd<0) ? nullptr : fdopen(fd, "rb");
+				if (!_file){
+					if (fd>=0)
+						::close(fd);
+					throw std::runtime_error("Can not reopen temporary sort run");
+				}
+				setvbuf(_file, nullptr, _IOFBF, buffer_size);
+				fseek(_file, 0, SEEK_SET);
+			}
+
+			bool next(T &out){
+				if (_file)
+					return run_codec<T>::read(_file, out);
+				if (_mem_pos>=_mem.size())
+					return false;
+				out=std::move(_mem[_mem_pos++]);
+				return true;
+			}
+		};
+
+		/**
+		 * @short Merges sorted runs with a loser tree: one comparison per tree level per element. Stable: on
+		 * ties the earlier run goes first.
+		 */
+		template<typename T>
+		class run_merger{
+			std::vector<sort_run<T>*> _runs;
+			std::vector<T> _heads;      // Current value of each run
+			std::vector<bool> _alive;   // Run still has a value at _heads
+			std::vector<size_t> _tree;  // Loser tree. _tree[0] is the winner
+
+			/// True if run a must go before run b. Exhausted runs go last, ties by run order.
+			bool _beats(size_t a, size_t b) const{
+				if (!_alive[b])
+					return _alive[a] || a<b;
+				if (!_alive[a])
+					return false;
+				if (_heads[a]<_heads[b])
+					return true;
+				if (_heads[b]<_heads[a])
+					return false;
+				return a<b;
+			}
+			/// Run s has a new head, replay its matches up to the root.
+			void _adjust(size_t s){
+				size_t k=_runs.size();
+				for (size_t n=(s+k)/2;n>0;n/=2)
+					if (_beats(_tree[n], s))
+						std::swap(s, _tree[n]);
+				_tree[0]=s;
+			}
+		public:
+			run_merger(std::vector<sort_run<T>*> runs, size_t buffer_size) : _runs(std::move(runs)){
+				size_t k=_runs.size();
+				_heads.resize(k);
+				_alive.resize(k);
+				for (size_t i=0;i<k;++i){
+					_runs[i]->start_reading(buffer_size);
+					_alive[i]=_runs[i]->next(_heads[i]);
+				}
+				// Leaves are at k..2k-1, internal nodes keep the loser and pass up the winner.
+				_tree.assign(std::max<size_t>(k, 1), 0);
+				std::vector<size_t> win(2*k);
+				for (size_t i=0;i<k;++i)
+					win[k+i]=i;
+				for (size_t n=k-1;n>=1 && k>1;--n){
+					size_t a=win[2*n], b=win[2*n+1];
+					if (_beats(a, b)){
+						win[n]=a;
+						_tree[n]=b;
+					}
+					else{
+						win[n]=b;
+						_tree[n]=a;
+					}
+				}
+				_tree[0]=(k>1) ? win[1] : 0;
+			}
+
+			bool next(T &out){
+				size_t w=_tree[0];
+				if (_runs.empty() || !_alive[w])
+					return false;
+				out=std::move(_heads[w]);
+				_alive[w]=_runs[w]->next(_heads[w]);
+				_adjust(w);
+				return true;
+			}
+		};
+	};
+
+	/**
+	 * @short Sorts a generator of any size, spilling sorted runs to temporary files. See generator::external_sort.
+	 *
+	 * Elements are read until memory_budget is used, that run is sorted and written to a temporary file, and so
+	 * on. The last run is kept in memory, so inputs that fit in the budget never touch the disk. Runs are merged
+	 * lazily with a loser tree.
+	 *
+	 * At most max_fan_in runs are merged at once, each with a read buffer of memory_budget/max_fan_in bytes: when
+	 * there are more, groups of them are merged into bigger runs first, as they are made. So merge memory and
+	 * open files are bounded whatever the input size.
+	 */
+	template<typename Prev>
+	class genextsort : public generator<genextsort<Prev>, typename Prev::value_type>{
+		typedef typename Prev::value_type T;
+		typedef detail::run_codec<T> codec;
+	public:
+		static const size_t max_fan_in=64;
+	private:
+		Prev _prev;
+		size_t _memory_budget;
+		bool _unique;
+		size_t _threads;
+		std::string _tmpdir;
+		size_t _buffer_size;        // Of each temporary file
+
+		bool _started;
+		std::vector<std::unique_ptr<detail::sort_run<T>>> _runs; // In input order
+		std::vector<size_t> _levels;                             // Times each run was merged
+		std::unique_ptr<detail::run_merger<T>> _merger;
+		bool _has_last;
+		T _last;                    // Last generated, for unique
+
+		static std::vector<T> _sorted(std::vector<T> &&v, bool unique){
+			std::stable_sort(v.begin(), v.end());
+			if (unique)
+				v.erase(std::unique(v.begin(), v.end()), v.end());
+			return std::move(v);
+		}
+		/// Next merged element, skipping repeated ones if unique.
+		bool _next_merged(detail::run_merger<T> &merger, T &out, bool &has_last, T &last){
+			for(;;){
+				if (!merger.next(out))
+					return false;
+				if (_unique){
+					if (has_last && !(last<out) && !(out<last))
+						continue;
+					last=out;
+					has_last=true;
+				}
+				return true;
+			}
+		}
+		/// Merges the runs at [first, end) into one spilled run at first. They are contiguous so it stays stable.
+		void _merge_runs(size_t first){
+			std::vector<detail::sort_run<T>*> group;
+			for (size_t i=first;i<_runs.size();++i)
+				group.push_back(_runs[i].get());
+			detail::run_merger<T> merger(group, _buffer_size);
+			std::unique_ptr<detail::sort_run<T>> merged(new detail::sort_run<T>());
+			bool has_last=false;
+			T last;
+			merged->spill([&](T &out){ return _next_merged(merger, out, has_last, last); }, _tmpdir, _buffer_size);
+			size_t level=_levels.back()+1;
+			_runs.resize(first);
+			_levels.resize(first);
+			_runs.push_back(std::move(merged));
+			_levels.push_back(level);
+		}
+		/// While the last max_fan_in runs have the same level, merges them into one of the next level.
+		void _compact(){
+			while (_runs.size()>=max_fan_in){
+				size_t first=_runs.size()-max_fan_in;
+				if (_levels[first]!=_levels.back())
+					break;
+				_merge_runs(first);
+			}
+		}
+
+		/// Reads all the input into sorted runs.
+		void _make_runs(){
+			std::deque<std::future<void>> pending;
+			auto wait_pending=[&pending]{
+				for (auto &f: pending)
+					f.get();
+				pending.clear();
+			};
+			size_t budget=_memory_budget/std::max<size_t>(_threads, 1);
+			std::vector<T> buffer;
+			size_t used=0;
+			T v;
+			bool more=true;
+			while (more){
+				more=_prev.next(v);
+				if (more){
+					used+=codec::memory(v);
+					buffer.push_back(std::move(v));
+					if (used<budget)
+						continue;
+				}
+				if (!more){ // Last run stays in memory
+					if (!buffer.empty() || _runs.empty()){
+						_runs.emplace_back(new detail::sort_run<T>());
+						_levels.push_back(0);
+						_runs.back()->keep(_sorted(std::move(buffer), _unique));
+					}
+					break;
+				}
+				_runs.emplace_back(new detail::sort_run<T>());
+				_levels.push_back(0);
+				auto run=_runs.back().get();
+				bool unique=_unique;
+				std::string dir=_tmpdir;
+				size_t buffer_size=_buffer_size;
+				auto spill=[run, unique, dir, buffer_size](std::vector<T> &data){
+					run->spill(_sorted(std::move(data), unique), dir, buffer_size);
+				};
+				if (_threads>1){
+					if (pending.size()>=_threads-1){
+						pending.front().get();
+						pending.pop_front();
+					}
+					auto data=std::make_shared<std::vector<T>>(std::move(buffer));
+					pending.push_back(std::async(std::launch::async, [spill, data]{ spill(*data); }));
+				}
+				else
+					spill(buffer);
+				buffer=std::vector<T>();
+				used=0;
+				if (_runs.size()>=max_fan_in){
+					wait_pending();
+					_compact();
+				}
+			}
+			wait_pending();
+			// Smallest runs are last: merge them until max_fan_in are left
+			if (_runs.size()>max_fan_in)
+				_merge_runs(max_fan_in-1);
+		}
+
+		void _start(){
+			_started=true;
+			_make_runs();
+			std::vector<detail::sort_run<T>*> runs;
+			for (auto &r: _runs)
+				runs.push_back(r.get());
+			_merger.reset(new detail::run_merger<T>(runs, _buffer_size));
+		}
+	public:
+		genextsort(Prev &&prev, size_t memory_budget, bool unique, size_t threads, const std::string &tmpdir)
+				: _prev(std::forward<Prev>(prev)), _memory_budget(std::max<size_t>(memory_budget, 1)), _unique(unique),
+				  _threads(std::max<size_t>(threads, 1)), _tmpdir(tmpdir), _started(false), _has_last(false){
+			if (_tmpdir.empty()){
+				const char *env=getenv("TMPDIR");
+				_tmpdir=(env && *env) ? env : "/tmp";
+			}
+			_buffer_size=std::min<size_t>(std::max<size_t>(_memory_budget/max_fan_in, 4096), 1024*1024);
+		}
+		genextsort(genextsort &&o) : _prev(std::move(o._prev)), _memory_budget(o._memory_budget), _unique(o._unique),
+				_threads(o._threads), _tmpdir(std::move(o._tmpdir)), _buffer_size(o._buffer_size), _started(o._started),
+				_runs(std::move(o._runs)), _levels(std::move(o._levels)), _merger(std::move(o._merger)),
+				_has_last(o._has_last), _last(std::move(o._last)){}
+
+		bool next(T &out){
+			if (!_started)
+				_start();
+			return _next_merged(*_merger, out, _has_last, _last);
+		}
+
+		/// Number of runs merged at the end, after the first next(). 1 means it was sorted in memory.
+		size_t runs() const{ return _runs.size(); }
+	};
+
+	template<typename Derived, typename T>
+	genextsort<Derived> generator<Derived, T>::external_sort(size_t memory_budget, bool unique, size_t threads, const std::string &tmpdir){
+		return genextsort<Derived>(std::move(*self()), memory_budget, unique, threads, tmpdir);
+	}
+};
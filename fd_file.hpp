@@ -0,0 +1,175 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include "generator.hpp"
+#include "string_ref.hpp"
+
+namespace underscore{
+	/**
+	 * @short Generator of the lines of a file descriptor, read in big blocks with read().
+	 *
+	 * For inputs that can not be memory mapped: pipes, sockets, stdin, /proc files. Lines are views into
+	 * the internal buffer; only a line that straddles two blocks is moved to the start of the buffer.
+	 * Lines longer than the buffer make it grow.
+	 *
+	 * Each view is valid only until the next call to next(), so convert it if it must be kept.
+	 *
+	 * Nonblocking descriptors are waited with poll(). Read errors throw std::runtime_error.
+	 *
+	 * Example:
+	 *
+	 * 	fd_file(STDIN_FILENO, 4*1024*1024)
+	 * 		.filter([](const string_ref &l){ return l.startswith("GET "); })
+	 */
+	class fd_file : public generator<fd_file, string_ref>{
+	public:
+		static const size_t default_buffer_size=1024*1024;
+	private:
+		int _fd;
+		bool _own_fd;
+		bool _eof;
+		std::vector<char> _buffer;
+		size_t _pos, _end; // Unread data at the buffer is [_pos, _end)
+
+		/// Moves the unread data to the start of the buffer and reads more. Returns false at end of file or error.
+		bool _fill(){
+			if (_pos>0){
+				memmove(_buffer.data(), _buffer.data()+_pos, _end-_pos);
+				_end-=_pos;
+				_pos=0;
+			}
+			if (_end==_buffer.size())
+				_buffer.resize(_buffer.size()*2);
+			for(;;){
+				ssize_t n=::read(_fd, _buffer.data()+_end, _buffer.size()-_end);
+				if (n>0){
+					_end+=n;
+					return true;
+				}
+				if (n==0){
+					_eof=true;
+					return false;
+				}
+				if (errno==EINTR)
+					continue;
+				if (errno==EAGAIN || errno==EWOULDBLOCK){ // Nonblocking fd, wait for data
+					struct pollfd p={_fd, POLLIN, 0};
+					poll(&p, 1, -1);
+					continue;
+				}
+				_eof=true;
+				throw std::runtime_error(std::string("Can not read: ")+strerror(errno));
+			}
+		}
+	public:
+		/**
+		 * @short Reads from an already open file descriptor. If own_fd it is closed at destruction.
+		 */
+		explicit fd_file(int fd, size_t buffer_size=default_buffer_size, bool own_fd=false)
+			: _fd(fd), _own_fd(own_fd), _eof(fd<0), _buffer(std::max<size_t>(buffer_size, 1)), _pos(0), _end(0){}
+		explicit fd_file(const std::string &path, size_t buffer_size=default_buffer_size)
+			: fd_file(::open(path.c_str(), O_RDONLY | O_CLOEXEC), buffer_size, true){}
+		fd_file(fd_file &&o) : _fd(o._fd), _own_fd(o._own_fd), _eof(o._eof), _buffer(std::move(o._buffer)), _pos(o._pos), _end(o._end){
+			o._fd=-1;
+			o._own_fd=false;
+		}
+		fd_file(const fd_file &)=delete;
+		fd_file &operator=(const fd_file &)=delete;
+		~fd_file(){
+			if (_own_fd && _fd>=0)
+				::close(_fd);
+		}
+
+		bool next(string_ref &out){
+			size_t searched=_pos;
+			for(;;){
+				const char *base=_buffer.data();
+				const char *nl=(const char*)memchr(base+searched, '\n', _end-searched);
+				if (nl){
+					out=string_ref(base+_pos, nl);
+					_pos=nl-base+1;
+					return true;
+				}
+				size_t scanned=_end-_pos; // No newline there, do not search it again
+				if (_eof || !_fill()){
+					if (_pos>=_end)
+						return false;
+					out=string_ref(_buffer.data()+_pos, _end-_pos); // Last line, no newline
+					_pos=_end;
+					return true;
+				}
+				searched=_pos+scanned;
+			}
+		}
+
+		/**
+		 * @short Skips n lines. Skipped data is discarded as it is read, so long lines do not grow the buffer.
+		 */
+		size_t advance(size_t n){
+			size_t i=0;
+			bool partial=false; // Part of the current line was discarded
+			while (i<n){
+				const char *base=_buffer.data();
+				const char *nl=(const char*)memchr(base+_pos, '\n', _end-_pos);
+				if (nl){
+					_pos=nl-base+1;
+					partial=false;
+					++i;
+					continue;
+				}
+				partial=partial || _pos<_end;
+				_pos=_end;
+				if (_eof || !_fill()){
+					if (partial) // Last line, no newline
+						++i;
+					break;
+				}
+			}
+			return i;
+		}
+		/**
+		 * @short Lines already at the buffer, so the views stay valid until the next call. At least one
+		 * unless at the end.
+		 */
+		size_t next_batch(string_ref *out, size_t n){
+			if (n==0 || !next(out[0]))
+				return 0;
+			size_t i=1;
+			const char *base=_buffer.data();
+			while (i<n){
+				const char *nl=(const char*)memchr(base+_pos, '\n', _end-_pos);
+				if (!nl)
+					break;
+				out[i++]=string_ref(base+_pos, nl);
+				_pos=nl-base+1;
+			}
+			return i;
+		}
+
+		bool is_open() const{ return _fd>=0; }
+		int fd() const{ return _fd; }
+		size_t buffer_size() const{ return _buffer.size(); }
+	};
+};
@@ -0,0 +1,299 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include "generator.hpp"
+#include "string_ref.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace underscore{
+	namespace detail{
+		class row_parser;
+	};
+
+	/**
+	 * @short Fields of a delimited line, as views.
+	 *
+	 * Views point into the line, or into the row itself for quoted fields with escaped quotes. They are
+	 * valid until the generator that made the row generates the next one. Missing fields are empty.
+	 */
+	class row{
+		friend class detail::row_parser;
+		std::vector<string_ref> _fields;
+		std::string _unescaped;
+
+		/// Points the views into o._unescaped to our copy of it.
+		void _rebase(const char *old_data, size_t old_size){
+			for (auto &f: _fields)
+				if (f.data()>=old_data && f.data()<old_data+old_size)
+					f=string_ref(_unescaped.data()+(f.data()-old_data), f.size());
+		}
+		void _assign(const row &o){
+			_fields=o._fields;
+			_unescaped=o._unescaped;
+			_rebase(o._unescaped.data(), o._unescaped.size());
+		}
+		void _assign(row &&o){
+			const char *old_data=o._unescaped.data();
+			size_t old_size=o._unescaped.size();
+			_fields=std::move(o._fields);
+			_unescaped=std::move(o._unescaped);
+			_rebase(old_data, old_size);
+		}
+	public:
+		typedef std::vector<string_ref>::const_iterator const_iterator;
+
+		row(){}
+		row(const row &o){ _assign(o); }
+		row(row &&o){ _assign(std::move(o)); }
+		row &operator=(const row &o){
+			if (this!=&o)
+				_assign(o);
+			return *this;
+		}
+		row &operator=(row &&o){
+			if (this!=&o)
+				_assign(std::move(o));
+			return *this;
+		}
+
+		size_t size() const{ return _fields.size(); }
+		bool empty() const{ return _fields.empty(); }
+		const string_ref &operator[](size_t i) const{ return _fields[i]; }
+		const_iterator begin() const{ return _fields.begin(); }
+		const_iterator end() const{ return _fields.end(); }
+		/// Owning copy of the fields.
+		std::vector<std::string> strings() const{
+			std::vector<std::string> ret;
+			ret.reserve(size());
+			for (auto &f: _fields)
+				ret.push_back(f.str());
+			return ret;
+		}
+	};
+
+	namespace detail{
+		/**
+		 * @short Appends to out the offsets of all sep, newline and double quote bytes at [begin, end).
+		 *
+		 * 32 or 16 bytes are compared at a time with AVX2 or SSE2.
+		 */
+		inline void scan_structural(const char *data, size_t begin, size_t end, char sep, std::vector<size_t> &out){
+			size_t i=begin;
+#ifdef __AVX2__
+			{
+				__m256i vs=_mm256_set1_epi8(sep), vn=_mm256_set1_epi8('\n'), vq=_mm256_set1_epi8('"');
+				for (;i+32<=end;i+=32){
+					__m256i v=_mm256_loadu_si256((const __m256i*)(data+i));
+					unsigned m=_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, vs), _mm256_cmpeq_epi8(v, vn)), _mm256_cmpeq_epi8(v, vq)));
+					for (;m;m&=m-1)
+						out.push_back(i+__builtin_ctz(m));
+				}
+			}
+#endif
+#ifdef __SSE2__
+			{
+				__m128i vs=_mm_set1_epi8(sep), vn=_mm_set1_epi8('\n'), vq=_mm_set1_epi8('"');
+				for (;i+16<=end;i+=16){
+					__m128i v=_mm_loadu_si128((const __m128i*)(data+i));
+					unsigned m=_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, vs), _mm_cmpeq_epi8(v, vn)), _mm_cmpeq_epi8(v, vq)));
+					for (;m;m&=m-1)
+						out.push_back(i+__builtin_ctz(m));
+				}
+			}
+#endif
+			for (;i<end;++i){
+				char c=data[i];
+				if (c==sep || c=='\n' || c=='"')
+					out.push_back(i);
+			}
+		}
+
+		/**
+		 * @short Splits rows using the offsets from scan_structural, keeping only the wanted fields.
+		 *
+		 * A field that starts with a double quote ends at the next lone quote, and "" inside it is a quote.
+		 * A \r before the newline is removed.
+		 */
+		class row_parser{
+			struct span{
+				size_t begin, end;
+				bool unescape;
+			};
+			char _sep;
+			std::vector<size_t> _wanted;
+			std::vector<ssize_t> _slot; // Output position of each field index, or -1
+			std::vector<span> _spans;
+
+			void _emit(size_t field, size_t begin, size_t end, bool unescape){
+				ssize_t slot;
+				if (_wanted.empty()){
+					slot=field;
+					if (_spans.size()<=field)
+						_spans.resize(field+1, span{0, 0, false});
+				}
+				else
+					slot=field<_slot.size() ? _slot[field] : -1;
+				if (slot>=0)
+					_spans[slot]=span{begin, end, unescape};
+			}
+			void _finish(const char *data, size_t nfields, row &out){
+				size_t n=_wanted.empty() ? nfields : _wanted.size();
+				out._fields.resize(n);
+				size_t unescaped=0;
+				for (size_t i=0;i<n;++i)
+					if (_spans[i].unescape)
+						unescaped+=_spans[i].end-_spans[i].begin;
+				out._unescaped.clear();
+				out._unescaped.reserve(unescaped); // So the views into it do not move
+				for (size_t i=0;i<n;++i){
+					const span &s=_spans[i];
+					if (!s.unescape){
+						out._fields[i]=string_ref(data+s.begin, s.end-s.begin);
+						continue;
+					}
+					size_t start=out._unescaped.size();
+					for (size_t j=s.begin;j<s.end;++j){
+						out._unescaped.push_back(data[j]);
+						if (data[j]=='"' && j+1<s.end && data[j+1]=='"')
+							++j;
+					}
+					out._fields[i]=string_ref(out._unescaped.data()+start, out._unescaped.size()-start);
+				}
+			}
+		public:
+			/// No wanted indexes means all the fields.
+			row_parser(char sep, const std::vector<size_t> &wanted) : _sep(sep), _wanted(wanted){
+				for (size_t i=0;i<_wanted.size();++i){
+					if (_slot.size()<=_wanted[i])
+						_slot.resize(_wanted[i]+1, -1);
+					_slot[_wanted[i]]=i;
+				}
+				_spans.resize(_wanted.size());
+			}
+			char sep() const{ return _sep; }
+
+			/**
+			 * @short Parses the row that starts at begin, with the offsets idx[k...] of the scanned bytes
+			 * up to limit. If at_end, limit is the end of the data, and ends the last row.
+			 *
+			 * Returns false if more data must be scanned to find the end of the row. Else fills out, and
+			 * sets k and next to continue at the next row.
+			 */
+			bool parse(const char *data, size_t begin, size_t limit, bool at_end, const std::vector<size_t> &idx, size_t &k, size_t &next, row &out){
+				for (auto &s: _spans)
+					s=span{0, 0, false};
+				size_t field=0, start=begin, quote_end=0, i=k;
+				bool quoted=false, in_quotes=false, unescape=false;
+				for(;;){
+					size_t pos;
+					char c;
+					if (i<idx.size()){
+						pos=idx[i++];
+						c=data[pos];
+					}
+					else if (at_end){
+						pos=limit;
+						c='\n';
+						if (in_quotes){ // Unterminated, ends at the end of the data
+							in_quotes=false;
+							quote_end=limit;
+						}
+					}
+					else
+						return false;
+
+					if (in_quotes){
+						if (c!='"')
+							continue;
+						if (pos+1>=limit && !at_end)
+							return false; // Can not know yet if it is an escaped quote
+						if (pos+1<limit && data[pos+1]=='"'){
+							unescape=true;
+							++i; // The second quote
+							continue;
+						}
+						in_quotes=false;
+						quote_end=pos;
+						continue;
+					}
+					if (c=='"'){
+						if (pos==start && !quoted){
+							quoted=true;
+							in_quotes=true;
+						}
+						continue;
+					}
+					size_t end=pos;
+					if (c=='\n' && !quoted && end>start && data[end-1]=='\r')
+						--end;
+					if (quoted)
+						_emit(field, start+1, quote_end, unescape);
+					else
+						_emit(field, start, end, false);
+					++field;
+					start=pos+1;
+					quoted=unescape=false;
+					if (c=='\n'){
+						k=i;
+						next=std::min(pos+1, limit);
+						_finish(data, field, out);
+						return true;
+					}
+				}
+			}
+		};
+	};
+
+	/**
+	 * @short Splits each line into a row with only the wanted fields. See generator::fields.
+	 */
+	template<typename Prev>
+	class genfields : public generator<genfields<Prev>, row>{
+		typedef typename Prev::value_type in_type;
+		Prev _prev;
+		in_type _line; // Rows point into it
+		detail::row_parser _parser;
+		std::vector<size_t> _idx;
+	public:
+		genfields(Prev &&prev, char sep, const std::vector<size_t> &wanted) : _prev(std::forward<Prev>(prev)), _parser(sep, wanted){}
+		genfields(genfields &&o) : _prev(std::move(o._prev)), _parser(std::move(o._parser)){}
+
+		bool next(row &out){
+			if (!_prev.next(_line))
+				return false;
+			string_ref line(_line);
+			_idx.clear();
+			detail::scan_structural(line.data(), 0, line.size(), _parser.sep(), _idx);
+			size_t k=0, next;
+			_parser.parse(line.data(), 0, line.size(), true, _idx, k, next, out);
+			return true;
+		}
+	};
+
+	template<typename Derived, typename T>
+	genfields<Derived> generator<Derived, T>::fields(char sep, const std::vector<size_t> &wanted){
+		return genfields<Derived>(std::move(*self()), sep, wanted);
+	}
+};
@@ -15,27 +15,125 @@
  */
 
 #pragma once
-#include <fstream>
 #include <string>
 #include <memory>
+#include <sys/stat.h>
 #include "generator.hpp"
+#include "mmap_file.hpp"
+#include "fd_file.hpp"
+#include "prefetch_file.hpp"
 
 namespace underscore{
+	class cached_file;
+
+	/**
+	 * @short Generator of the lines of a file, as strings.
+	 *
+	 * Regular files are memory mapped (see mmap_file); anything else (pipes, sockets, /proc files, file
+	 * descriptors) is read in big blocks (see fd_file). Each line is copied once, into the returned string.
+	 *
+	 * For cold storage file::prefetched reads ahead with io_uring or a reader thread (see prefetch_file).
+	 *
+	 * If the file can not be opened the generator is empty.
+	 */
 	class file : public generator<file>{
-		std::unique_ptr<std::ifstream> ifs; // Workaround no &&ifstream in gcc 4.8 as in http://stackoverflow.com/questions/12015899/why-are-move-semantics-for-a-class-containing-a-stdstringstream-causing-compil
-		std::string next; // To reuse lines.
+		std::unique_ptr<mmap_file> _mmap;
+		std::unique_ptr<fd_file> _fd;
+		std::unique_ptr<prefetch_file> _prefetch;
+		std::vector<string_ref> _lines; // Batch scratch
+		std::string _path;
+
+		file(){}
+
+		static bool _mappable(const std::string &filename){
+			struct stat st;
+			return stat(filename.c_str(), &st)==0 && S_ISREG(st.st_mode) && st.st_size>0;
+		}
 	public:
-		file(const std::string &filename) : ifs(new std::ifstream(filename, std::ifstream::in)) { 
+		file(const std::string &filename, size_t buffer_size=fd_file::default_buffer_size) : _path(filename){
+			if (_mappable(filename))
+				_mmap.reset(new mmap_file(filename));
+			else
+				_fd.reset(new fd_file(filename, buffer_size));
 		}
-		
-		bool empty(){
-			return !ifs->is_open() || ifs->eof();
+		/**
+		 * @short Reads the lines of an already open file descriptor. It is not closed.
+		 */
+		explicit file(int fd, size_t buffer_size=fd_file::default_buffer_size) : _fd(new fd_file(fd, buffer_size)){
+		}
+		/**
+		 * @short Reads keeping depth blocks in flight. backend selects io_uring, a pread thread, or the best available.
+		 */
+		static file prefetched(const std::string &filename, size_t block_size=prefetch_file::default_block_size, size_t depth=prefetch_file::default_depth,
+								prefetch_file::backend_type backend=prefetch_file::automatic){
+			file f;
+			f._prefetch.reset(new prefetch_file(filename, block_size, depth, backend));
+			f._path=filename;
+			return f;
 		}
-		std::string get_next(){
-			if (empty())
-				throw ::underscore::eog();
-			std::getline(*ifs, next);
-			return next;
+		
+		bool next(underscore::string &out){
+			string_ref line;
+			bool ok;
+			if (_mmap)
+				ok=_mmap->next(line);
+			else if (_fd)
+				ok=_fd->next(line);
+			else
+				ok=_prefetch->next(line);
+			if (!ok)
+				return false;
+			out.assign(line);
+			return true;
 		};
+		/// Skips n lines without copying them.
+		size_t advance(size_t n){
+			if (_mmap)
+				return _mmap->advance(n);
+			if (_fd)
+				return _fd->advance(n);
+			return _prefetch->advance(n);
+		}
+		/**
+		 * @short Lines are copied into the strings already at out, reusing their memory.
+		 */
+		size_t next_batch(underscore::string *out, size_t n){
+			if (_lines.size()<n)
+				_lines.resize(n);
+			size_t got;
+			if (_mmap)
+				got=_mmap->next_batch(_lines.data(), n);
+			else if (_fd)
+				got=_fd->next_batch(_lines.data(), n);
+			else
+				got=_prefetch->next_batch(_lines.data(), n);
+			for (size_t i=0;i<got;++i)
+				out[i].assign(_lines[i]);
+			return got;
+		}
+
+		bool is_open() const{
+			if (_mmap)
+				return _mmap->is_open();
+			if (_fd)
+				return _fd->is_open();
+			return _prefetch->is_open();
+		}
+		bool is_mapped() const{ return _mmap && _mmap->is_mapped(); }
+
+		/**
+		 * @short The lines of the file, from a cache at dir that is written the first time. Defined at cache.hpp.
+		 *
+		 * The cache is valid while the file keeps its size and modification time; then it is mapped, with no
+		 * reading nor splitting. Lines are string_ref views into it. Only for files opened by path.
+		 *
+		 * It is always the whole file, even if some lines were already read from this one, which is left
+		 * as is. Throws std::runtime_error if the file can not be opened.
+		 *
+		 * 	for (auto l: file("/etc/services").cached("/var/cache/app")) ...
+		 */
+		cached_file cached(const std::string &dir);
 	};
 };
+
+#include "cache.hpp"
@@ -0,0 +1,303 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <initializer_list>
+#include <glob.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "generator.hpp"
+#include "file.hpp"
+#include "queue.hpp"
+
+namespace underscore{
+	class files_with_source;
+
+	/**
+	 * @short A line with the file it comes from, as generated by files::with_source().
+	 */
+	struct source_line{
+		std::shared_ptr<const std::string> path; ///< Shared by all the lines of the file
+		size_t line;                             ///< At the file, starting at 1
+		underscore::string text;
+	};
+
+	/**
+	 * @short Generator of the lines of several files, one after the other.
+	 *
+	 * Files are given as a list, as a glob pattern, or as a directory (all its files). Glob results are
+	 * sorted by name.
+	 *
+	 * In ordered mode the files are read in order, and the kernel is asked to read ahead the next file while
+	 * the current one is consumed. In unordered mode up to threads files are read at the same time, and
+	 * lines are generated as they are read: lines of a file keep their order, but files are interleaved.
+	 *
+	 * source() and line() tell where the last generated line comes from. As they are lost once the generator
+	 * is moved into a pipeline, with_source() generates each line with its path and line number instead.
+	 *
+	 * Example:
+	 *
+	 * 	files("/var/log/app.log*", files::unordered).filter(searcher("ERROR")).count()
+	 */
+	class files : public generator<files>{
+		friend class files_with_source;
+	public:
+		enum order_type{
+			ordered=0,
+			unordered
+		};
+		static const size_t default_queue_size=4096;
+	private:
+		struct item{
+			underscore::string text;
+			size_t path;
+			size_t line;
+		};
+		// Unordered mode, shared with the reader threads
+		struct state{
+			std::vector<std::string> paths;
+			mpmc_queue<item> queue;
+			std::atomic<size_t> next_path, active;
+			std::atomic<bool> stop;
+			detail::thread_error error;
+			state(const std::vector<std::string> &paths, size_t nthreads)
+				: paths(paths), queue(default_queue_size), next_path(0), active(nthreads), stop(false){}
+		};
+
+		std::vector<std::string> _paths;
+		order_type _order;
+		size_t _threads;
+		size_t _path;   // Of the last generated line
+		size_t _line;
+		// Ordered
+		size_t _next_path;
+		std::unique_ptr<file> _current;
+		// Unordered
+		std::unique_ptr<state> _state;
+		std::vector<std::thread> _readers;
+		item _item;
+
+		static std::vector<std::string> _expand(const std::string &pattern){
+			struct stat st;
+			if (stat(pattern.c_str(), &st)==0 && S_ISDIR(st.st_mode)){
+				std::vector<std::string> ret;
+				DIR *dir=opendir(pattern.c_str());
+				if (!dir)
+					return ret;
+				while (struct dirent *e=readdir(dir)){
+					std::string p=pattern+"/"+e->d_name;
+					if (e->d_name[0]!='.' && stat(p.c_str(), &st)==0 && S_ISREG(st.st_mode))
+						ret.push_back(p);
+				}
+				closedir(dir);
+				std::sort(ret.begin(), ret.end());
+				return ret;
+			}
+			std::vector<std::string> ret;
+			glob_t g;
+			if (glob(pattern.c_str(), GLOB_TILDE | GLOB_BRACE, nullptr, &g)==0)
+				for (size_t i=0;i<g.gl_pathc;++i)
+					ret.push_back(g.gl_pathv[i]);
+			globfree(&g);
+			return ret;
+		}
+		/// Starts reading path in the background: the kernel reads it ahead as the current file is consumed.
+		static void _willneed(const std::string &path){
+			int fd=::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd<0)
+				return;
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			::close(fd);
+		}
+
+		static void _read(state *s){
+			try{
+				size_t p;
+				while (!s->stop.load(std::memory_order_relaxed) && (p=s->next_path++)<s->paths.size()){
+					file f(s->paths[p]);
+					item it;
+					it.path=p;
+					it.line=0;
+					while (f.next(it.text)){
+						++it.line;
+						backoff wait;
+						while (!s->queue.try_push(it)){
+							if (s->stop.load(std::memory_order_relaxed))
+								return;
+							wait.pause();
+						}
+					}
+				}
+			}
+			catch(...){
+				s->error.set(std::current_exception());
+			}
+			s->active.fetch_sub(1, std::memory_order_release);
+		}
+
+		bool _next_ordered(underscore::string &out){
+			for(;;){
+				if (_current && _current->next(out)){
+					++_line;
+					return true;
+				}
+				if (_next_path>=_paths.size())
+					return false;
+				_path=_next_path++;
+				_line=0;
+				_current.reset(new file(_paths[_path]));
+				if (_next_path<_paths.size())
+					_willneed(_paths[_next_path]);
+			}
+		}
+		bool _next_unordered(underscore::string &out){
+			if (!_state){
+				size_t n=std::max<size_t>(std::min(_threads, _paths.size()), 1);
+				_state.reset(new state(_paths, n));
+				for (size_t i=0;i<n;++i)
+					_readers.push_back(std::thread(_read, _state.get()));
+			}
+			backoff wait;
+			for(;;){
+				// Readers push before they are no longer active: if none was active before the pop, an
+				// empty queue is the end.
+				bool done=_state->active.load(std::memory_order_acquire)==0;
+				if (_state->queue.try_pop(_item)){
+					out=std::move(_item.text);
+					_path=_item.path;
+					_line=_item.line;
+					return true;
+				}
+				if (_state->error.rethrow() || done)
+					return false;
+				wait.pause();
+			}
+		}
+		void _init(){
+			if (_threads==0)
+				_threads=std::max<size_t>(std::thread::hardware_concurrency(), 1);
+		}
+	public:
+		/**
+		 * @short Lines of the files that match a glob pattern, or of all the files of a directory.
+		 */
+		explicit files(const std::string &pattern, order_type order=ordered, size_t threads=0)
+				: _paths(_expand(pattern)), _order(order), _threads(threads), _path(0), _line(0), _next_path(0){
+			_init();
+		}
+		explicit files(const std::vector<std::string> &paths, order_type order=ordered, size_t threads=0)
+				: _paths(paths), _order(order), _threads(threads), _path(0), _line(0), _next_path(0){
+			_init();
+		}
+		files(std::initializer_list<std::string> paths, order_type order=ordered, size_t threads=0)
+				: _paths(paths), _order(order), _threads(threads), _path(0), _line(0), _next_path(0){
+			_init();
+		}
+		files(files &&o) : _paths(std::move(o._paths)), _order(o._order), _threads(o._threads), _path(o._path), _line(o._line),
+				_next_path(o._next_path), _current(std::move(o._current)), _state(std::move(o._state)), _readers(std::move(o._readers)){}
+		~files(){
+			if (_state){
+				_state->stop=true;
+				for (auto &t: _readers)
+					t.join();
+			}
+		}
+
+		bool next(underscore::string &out){
+			if (_order==unordered)
+				return _next_unordered(out);
+			return _next_ordered(out);
+		}
+
+		/// In ordered mode skips lines without copying them, file by file.
+		size_t advance(size_t n){
+			if (_order==unordered)
+				return generator<files>::advance(n);
+			size_t i=0;
+			while (i<n){
+				if (_current){
+					size_t skipped=_current->advance(n-i);
+					_line+=skipped;
+					i+=skipped;
+					if (i==n)
+						break;
+				}
+				if (_next_path>=_paths.size())
+					break;
+				_path=_next_path++;
+				_line=0;
+				_current.reset(new file(_paths[_path]));
+			}
+			return i;
+		}
+
+		const std::vector<std::string> &paths() const{ return _paths; }
+		/// Path of the file of the last generated line, empty if there are no files.
+		const std::string &source() const{
+			static const std::string none;
+			return _path<_paths.size() ? _paths[_path] : none;
+		}
+		/// Line number of the last generated line at its file, starting at 1.
+		size_t line() const{ return _line; }
+
+		/**
+		 * @short Generates each line as a source_line, so its path and line number are kept along a pipeline.
+		 *
+		 * Example:
+		 *
+		 * 	files("/var/log/app.log*").with_source().filter([](const source_line &l){ return l.text.contains("ERROR"); })
+		 */
+		files_with_source with_source();
+	};
+
+	/**
+	 * @short The lines of a files generator with their provenance. See files::with_source().
+	 */
+	class files_with_source : public generator<files_with_source, source_line>{
+		files _files;
+		std::vector<std::shared_ptr<const std::string>> _paths;
+	public:
+		explicit files_with_source(files &&f) : _files(std::move(f)){
+			_paths.reserve(_files._paths.size());
+			for (auto &p: _files._paths)
+				_paths.push_back(std::make_shared<const std::string>(p));
+		}
+		files_with_source(files_with_source &&o) : _files(std::move(o._files)), _paths(std::move(o._paths)){}
+
+		bool next(source_line &out){
+			if (!_files.next(out.text))
+				return false;
+			out.path=_paths[_files._path];
+			out.line=_files._line;
+			return true;
+		}
+		size_t advance(size_t n){
+			return _files.advance(n);
+		}
+	};
+
+	inline files_with_source files::with_source(){
+		return files_with_source(std::move(*this));
+	}
+};
@@ -0,0 +1,301 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include "generator.hpp"
+#include "string.hpp"
+
+namespace underscore{
+	/**
+	 * @short Generator of the lines appended to a file, as tail -F.
+	 *
+	 * It remembers the byte offset after the last generated line and the inode of the file, so only new data
+	 * is read. If the file is replaced (log rotation) the rest of the old one is read, and then the new one
+	 * from its start. If it is truncated, it starts again from the start.
+	 *
+	 * With stop_at_end, next() returns false when there is nothing more to read; a last line without newline
+	 * is left for later, as it may be still being written. With wait, it waits for more data with inotify
+	 * (checking every second too, for filesystems without it) until stop() is called from another thread.
+	 *
+	 * With a checkpoint path, the position is read from it at start, and saved when it reaches the end and
+	 * when destroyed, so the next run continues where this one ended:
+	 *
+	 * 	// Every minute, only the new lines
+	 * 	follow_file("/var/log/app.log", follow_file::stop_at_end, "/var/lib/app/log.offset").filter(searcher("ERROR")).count()
+	 *
+	 * Lines added to a file after the checkpoint was saved are lost if it is rotated before the next run.
+	 */
+	class follow_file : public generator<follow_file>{
+	public:
+		enum mode_type{
+			stop_at_end=0,
+			wait
+		};
+		struct position{
+			dev_t device;
+			ino_t inode;
+			uint64_t offset; ///< After the last generated line
+		};
+		static const size_t default_buffer_size=1024*1024;
+	private:
+		std::string _path;
+		mode_type _mode;
+		std::string _checkpoint;
+		int _fd;
+		dev_t _device;
+		ino_t _inode;
+		uint64_t _offset;          // Of _buffer[0] at the file
+		std::vector<char> _buffer;
+		size_t _begin, _end;       // Not generated yet
+		int _inotify, _file_watch;
+		int _wake;                 // eventfd, for stop()
+		bool _stopped;
+
+		bool _open(uint64_t offset){
+			int fd=::open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd<0)
+				return false;
+			struct stat st;
+			if (fstat(fd, &st)!=0){
+				::close(fd);
+				return false;
+			}
+			_close();
+			_fd=fd;
+			_device=st.st_dev;
+			_inode=st.st_ino;
+			if (offset>uint64_t(st.st_size))
+				offset=0;
+			_offset=offset;
+			_begin=_end=0;
+			if (offset)
+				lseek(_fd, offset, SEEK_SET);
+			posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			if (_inotify>=0){
+				if (_file_watch>=0)
+					inotify_rm_watch(_inotify, _file_watch);
+				_file_watch=inotify_add_watch(_inotify, _path.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+			}
+			return true;
+		}
+		void _close(){
+			if (_fd>=0)
+				::close(_fd);
+			_fd=-1;
+		}
+		/// The file at path is another one: the one being read was rotated.
+		bool _replaced(){
+			struct stat st;
+			if (stat(_path.c_str(), &st)!=0)
+				return false; // Moved, and the new one is not there yet
+			return st.st_ino!=_inode || st.st_dev!=_device;
+		}
+		/// Shorter than what was read, as after copytruncate.
+		bool _truncated(){
+			struct stat st;
+			return fstat(_fd, &st)==0 && uint64_t(st.st_size)<_offset+_end;
+		}
+		void _watch(){
+			if (_inotify>=0)
+				return;
+			_inotify=inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+			_wake=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (_inotify<0)
+				return;
+			// The directory, to know when a rotated file is created again
+			std::string dir=_path.find('/')==std::string::npos ? std::string(".") : _path.substr(0, _path.rfind('/')+1);
+			inotify_add_watch(_inotify, dir.c_str(), IN_CREATE | IN_MOVED_TO);
+			if (_fd>=0)
+				_file_watch=inotify_add_watch(_inotify, _path.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+		}
+		void _wait(){
+			struct pollfd fds[2]={{_inotify, POLLIN, 0}, {_wake, POLLIN, 0}};
+			if (poll(fds, 2, 1000)<=0)
+				return;
+			char events[4096];
+			while (_inotify>=0 && ::read(_inotify, events, sizeof(events))>0){}
+			uint64_t v;
+			if (_wake>=0 && ::read(_wake, &v, sizeof(v))==sizeof(v))
+				_stopped=true;
+		}
+		/// Reads more data after _end. Returns false at the end of the file.
+		bool _read(){
+			if (_begin>0){
+				memmove(_buffer.data(), _buffer.data()+_begin, _end-_begin);
+				_offset+=_begin;
+				_end-=_begin;
+				_begin=0;
+			}
+			if (_end==_buffer.size())
+				_buffer.resize(_buffer.size()*2); // A line longer than the buffer
+			for(;;){
+				ssize_t n=::read(_fd, _buffer.data()+_end, _buffer.size()-_end);
+				if (n>0){
+					_end+=n;
+					return true;
+				}
+				if (n==0)
+					return false;
+				if (errno!=EINTR)
+					throw std::runtime_error("Can not read "+_path+": "+strerror(errno));
+			}
+		}
+		void _load_checkpoint(){
+			FILE *f=fopen(_checkpoint.c_str(), "r");
+			if (!f){
+				_open(0);
+				return;
+			}
+			unsigned long long device=0, inode=0, offset=0;
+			int version=0;
+			bool ok=fscanf(f, "underscore-follow %d\n%llu %llu %llu", &version, &device, &inode, &offset)==4 && version==1;
+			fclose(f);
+			if (!_open(0) || !ok)
+				return;
+			if (_device==dev_t(device) && _inode==ino_t(inode))
+				_open(offset);
+		}
+		void _init(){
+			_buffer.resize(default_buffer_size);
+			if (_checkpoint.empty())
+				_open(0);
+			else
+				_load_checkpoint();
+			if (_mode==wait)
+				_watch();
+		}
+	public:
+		explicit follow_file(const std::string &path, mode_type mode=wait, const std::string &checkpoint=std::string())
+				: _path(path), _mode(mode), _checkpoint(checkpoint), _fd(-1), _device(0), _inode(0), _offset(0), _begin(0), _end(0),
+				  _inotify(-1), _file_watch(-1), _wake(-1), _stopped(false){
+			_init();
+		}
+		/**
+		 * @short Starts at a position returned by get_position(). If the file is another one, from its start.
+		 */
+		follow_file(const std::string &path, const position &from, mode_type mode=wait)
+				: _path(path), _mode(mode), _fd(-1), _device(0), _inode(0), _offset(0), _begin(0), _end(0),
+				  _inotify(-1), _file_watch(-1), _wake(-1), _stopped(false){
+			_buffer.resize(default_buffer_size);
+			if (_open(0) && _device==from.device && _inode==from.inode)
+				_open(from.offset);
+			if (_mode==wait)
+				_watch();
+		}
+		follow_file(follow_file &&o) : _path(std::move(o._path)), _mode(o._mode), _checkpoint(std::move(o._checkpoint)), _fd(o._fd),
+				_device(o._device), _inode(o._inode), _offset(o._offset), _buffer(std::move(o._buffer)), _begin(o._begin), _end(o._end),
+				_inotify(o._inotify), _file_watch(o._file_watch), _wake(o._wake), _stopped(o._stopped){
+			o._checkpoint.clear();
+			o._fd=o._inotify=o._wake=-1;
+		}
+		follow_file(const follow_file &)=delete;
+		~follow_file(){
+			if (!_checkpoint.empty()){
+				try{
+					save_checkpoint();
+				}
+				catch(...){
+				}
+			}
+			_close();
+			if (_inotify>=0)
+				::close(_inotify);
+			if (_wake>=0)
+				::close(_wake);
+		}
+
+		bool next(underscore::string &out){
+			for(;;){
+				if (_fd>=0){
+					const char *nl=(const char*)memchr(_buffer.data()+_begin, '\n', _end-_begin);
+					if (nl){
+						out.assign(string_ref(_buffer.data()+_begin, nl));
+						_begin=nl-_buffer.data()+1;
+						return true;
+					}
+					if (_read())
+						continue;
+					if (_truncated()){
+						_open(0);
+						continue;
+					}
+					if (_replaced()){
+						bool rest=_begin<_end; // The old one will not grow: its last line is complete
+						if (rest)
+							out.assign(string_ref(_buffer.data()+_begin, _end-_begin));
+						_open(0);
+						if (rest)
+							return true;
+						continue;
+					}
+				}
+				else if (_open(0))
+					continue;
+				if (_mode==stop_at_end || _stopped){
+					if (!_checkpoint.empty())
+						save_checkpoint();
+					return false;
+				}
+				_wait();
+			}
+		}
+
+		/// Makes a waiting next() return false. May be called from any thread.
+		void stop(){
+			uint64_t v=1;
+			if (_wake>=0 && ::write(_wake, &v, sizeof(v))<0){}
+		}
+
+		position get_position() const{
+			return position{_device, _inode, _offset+_begin};
+		}
+		/**
+		 * @short Writes the position to path, atomically: to a temporary file that is then renamed.
+		 */
+		void save_checkpoint(const std::string &path) const{
+			std::string tmp=path+".tmp";
+			FILE *f=fopen(tmp.c_str(), "w");
+			if (!f)
+				throw std::runtime_error("Can not write checkpoint "+tmp+": "+strerror(errno));
+			position p=get_position();
+			fprintf(f, "underscore-follow 1\n%llu %llu %llu\n", (unsigned long long)p.device, (unsigned long long)p.inode, (unsigned long long)p.offset);
+			bool ok=fflush(f)==0 && fsync(fileno(f))==0;
+			ok=fclose(f)==0 && ok;
+			if (!ok || rename(tmp.c_str(), path.c_str())!=0)
+				throw std::runtime_error("Can not write checkpoint "+path+": "+strerror(errno));
+		}
+		/// To the checkpoint path given at the constructor.
+		void save_checkpoint() const{
+			if (!_checkpoint.empty())
+				save_checkpoint(_checkpoint);
+		}
+
+		const std::string &path() const{ return _path; }
+	};
+};
@@ -17,43 +17,179 @@
 #pragma once
 #include <algorithm>
 #include <vector>
+#include <functional>
+#include <type_traits>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+#include <deque>
 #include "sequence.hpp"
 #include "string.hpp"
 
 namespace underscore{
+	/**
+	 * @short Thrown by legacy generators at the end of the stream.
+	 *
+	 * New generators implement next() and never throw it. It is kept so generators that only implement
+	 * empty() and get_next() still work, and get_next() still throws it at the end.
+	 */
 	class eog : public std::exception{
 	};
 	
-	template<typename Prev>
+	namespace detail{
+		/// Keeps a template parameter out of deduction, so it takes its default or explicit value.
+		template<typename X>
+		struct nondeduced{ typedef X type; };
+
+		/// Element type after a map: S if given, else the result type R.
+		template<typename S, typename T, typename R>
+		struct map_result{ typedef S type; };
+		template<typename T, typename R>
+		struct map_result<void, T, R>{
+			typedef typename std::decay<R>::type type;
+		};
+
+		/// Element of a bounded_heap: the key, the arrival order n for stable ties, and the value.
+		template<typename K, typename V>
+		struct heap_entry{
+			K key;
+			size_t n;
+			V value;
+			const K &k() const{ return key; }
+		};
+		/// Without key function, values are compared directly.
+		template<typename V>
+		struct heap_entry<void, V>{
+			size_t n;
+			V value;
+			const V &k() const{ return value; }
+		};
+
+		/**
+		 * @short Keeps the best k entries pushed so far, the largest or the smallest keys. O(k) memory.
+		 *
+		 * The worst kept entry is at the top of the heap, so most rejected entries cost one comparison. Equal keys
+		 * keep the arrival order.
+		 */
+		template<typename V, typename K=void>
+		class bounded_heap{
+		public:
+			typedef heap_entry<K, V> entry;
+		private:
+			size_t _k;
+			bool _largest;
+			size_t _count;
+			std::vector<entry> _heap;
+		public:
+			bounded_heap(size_t k, bool largest) : _k(k), _largest(largest), _count(0){
+				_heap.reserve(std::min<size_t>(k, 4096));
+			}
+
+			/// a goes before b in the result.
+			bool operator()(const entry &a, const entry &b) const{
+				if (_largest ? b.k()<a.k() : a.k()<b.k())
+					return true;
+				if (_largest ? a.k()<b.k() : b.k()<a.k())
+					return false;
+				return a.n<b.n;
+			}
+
+			void push(entry &&e){
+				e.n=_count++;
+				if (_heap.size()<_k){
+					_heap.push_back(std::move(e));
+					std::push_heap(_heap.begin(), _heap.end(), std::cref(*this));
+				}
+				else if (_k>0 && (*this)(e, _heap.front())){
+					std::pop_heap(_heap.begin(), _heap.end(), std::cref(*this));
+					_heap.back()=std::move(e);
+					std::push_heap(_heap.begin(), _heap.end(), std::cref(*this));
+				}
+			}
+
+			/// The kept values, best first. Empties the heap.
+			std::vector<V> sorted(){
+				std::sort_heap(_heap.begin(), _heap.end(), std::cref(*this));
+				std::vector<V> ret;
+				ret.reserve(_heap.size());
+				for (auto &e: _heap)
+					ret.push_back(std::move(e.value));
+				_heap.clear();
+				return ret;
+			}
+		};
+	};
+
+	template<typename Prev, typename S, typename F>
 	class genmap;
 
-	template<typename Prev>
+	template<typename Prev, typename F>
 	class genfilter;
 
-	template<typename T>
+	template<typename Prev>
+	class genslice;
+
+	template<typename Prev, typename F>
+	class gentake_while;
+
+	template<typename Prev, typename F>
+	class gendrop_while;
+
+	template<typename Prev>
+	class genextsort;
+
+	template<typename Prev>
+	class genasync;
+
+	template<typename Prev, typename S, typename F>
+	class genparallel_map;
+
+	template<typename Prev>
+	class genfields;
+
+	/**
+	 * @short Base of all generators (CRTP). T is the element type, underscore::string by default.
+	 *
+	 * A generator implements:
+	 *
+	 * 	bool next(T &out);
+	 *
+	 * that fills out with the next element and returns true, or returns false at the end of the stream.
+	 * No exception is involved in normal iteration.
+	 *
+	 * Generators written for the old protocol, empty() plus get_next() throwing eog, still work through
+	 * the default next() here.
+	 *
+	 * map can change the element type:
+	 *
+	 * 	file("/etc/services")
+	 * 		.map<string_list>([](const string &s){ return s.split(' '); })
+	 * 		.map<long>([](const string_list &l){ return l[1].to_long(); })
+	 */
+	template<typename Derived, typename T=underscore::string>
 	class generator{
 	public:
+		typedef T value_type;
+
 		class iterator{
 		public:
-			using generator_type=T;
+			using generator_type=Derived;
 		private:
 			generator_type *parent;
-			underscore::string current;
+			T current;
 		public:
-			iterator(generator_type *_parent) : parent(_parent){}
+			iterator(generator_type *_parent) : parent(_parent){
+				++(*this);
+			}
 			iterator() : parent(nullptr){}
 			
-			const underscore::string &operator*(){
+			T &operator*(){
 				return current;
 			}
 			iterator &operator++(){
-				try{
-					if (parent)
-						current=parent->get_next();
-				}
-				catch(::underscore::eog &g){
-					current="";
-					parent=NULL;
+				if (parent && !parent->next(current)){
+					current=T();
+					parent=nullptr;
 				}
 				return *this;
 			}
@@ -63,152 +199,704 @@ namespace underscore{
 			}
 		};
 
-		using gen_type=T;
-		typedef std::function<underscore::string (const underscore::string &)> map_f;
-		typedef std::function<bool (const underscore::string &)> filter_f;
+		using gen_type=Derived;
+		typedef std::function<T (T &&)> map_f;
+		typedef std::function<bool (const T &)> filter_f;
 		
 		bool empty(){
-			throw std::runtime_error("Need to implement empty in your generator");
+			throw std::runtime_error("Need to implement next, or empty and get_next, in your generator");
 		};
-		underscore::string get_next(){
-			throw std::runtime_error("Need to implement get_next in your generator");
+		/**
+		 * @short Compatibility with the old protocol, in terms of next(). Throws eog at the end.
+		 */
+		T get_next(){
+			T ret;
+			if (!self()->next(ret))
+				throw ::underscore::eog();
+			return ret;
 		};
+		/**
+		 * @short Default next() for old style generators that implement empty() and get_next().
+		 */
+		bool next(T &out){
+			try{
+				if (self()->empty())
+					return false;
+				out=self()->get_next();
+				return true;
+			}
+			catch(::underscore::eog &e){
+				return false;
+			}
+		}
+		
+		/**
+		 * @short Fills out[0..n) with the next elements. Returns how many, 0 only at the end.
+		 *
+		 * This default calls next() up to n times. Sources, map and filter implement it natively, so a batched
+		 * pipeline runs each stage as a tight loop over the batch. The caller owns the buffer and should reuse
+		 * it, so strings keep their memory. Views are valid until the next call to next() or next_batch().
+		 */
+		size_t next_batch(T *out, size_t n){
+			size_t i=0;
+			while (i<n && self()->next(out[i]))
+				++i;
+			return i;
+		}
 		
 		iterator begin(){ 
-			gen_type *self=(gen_type*)this;
-			return iterator(self); 
+			return iterator(self()); 
 		}
 		iterator end(){ return iterator(); }
 		
-		genmap<T> map(map_f &&f);
-		genfilter<T> filter(filter_f &&f);
+		/**
+		 * @short Converts each element with f. The result type is f result type, or S if given, as map<S>(f)
+		 * to keep the input type.
+		 *
+		 * Elements are passed to f as rvalues, so it can take them by value and move from them.
+		 *
+		 * The stage is templated on the callable, so lambdas are inlined and a full pipeline compiles into a
+		 * single loop. std::function (map_f) still works, at the cost of an indirect call per element.
+		 */
+		template<typename S=void, typename F>
+		genmap<Derived, typename detail::map_result<S, T, decltype(std::declval<F&>()(std::declval<T&&>()))>::type, typename std::decay<F>::type>
+		map(F &&f){
+			typedef typename detail::map_result<S, T, decltype(std::declval<F&>()(std::declval<T&&>()))>::type result_type;
+			return genmap<Derived, result_type, typename std::decay<F>::type>(std::forward<F>(f), std::move(*self()));
+		}
+		/**
+		 * @short Keeps only the elements for which f returns true. Templated on the callable, as map.
+		 */
+		template<typename F>
+		genfilter<Derived, typename std::decay<F>::type> filter(F &&f){
+			return genfilter<Derived, typename std::decay<F>::type>(std::forward<F>(f), std::move(*self()));
+		}
 		
+		/**
+		 * @short Runs this generator and all its previous stages in another thread. Defined at async.hpp.
+		 *
+		 * Up to capacity elements are generated ahead, and it waits when they are not consumed. So reading,
+		 * parsing and aggregating can use a core each:
+		 *
+		 * 	file("huge.log").async().map(parse).async().count_by(key)
+		 *
+		 * Elements must stay valid once generated: fd_file views do not, map them to strings before.
+		 */
+		genasync<Derived> async(size_t capacity=1024);
+		/**
+		 * @short As map, but f runs at threads threads (0 is one per core). Defined at async.hpp.
+		 *
+		 * If ordered, results are generated in the input order, else as they are ready. f must be safe to call
+		 * concurrently. Exceptions at f or previous stages are rethrown at next().
+		 */
+		template<typename S=void, typename F>
+		genparallel_map<Derived, typename detail::map_result<S, T, decltype(std::declval<F&>()(std::declval<T&&>()))>::type, typename std::decay<F>::type>
+		parallel_map(F &&f, size_t threads=0, bool ordered=true, size_t capacity=1024);
+		/**
+		 * @short Splits each line at sep, and generates a row with the fields at wanted, in that order.
+		 * Defined at fields.hpp.
+		 *
+		 * Fields are views into the line, so no memory is allocated per line. Fields may be quoted with
+		 * double quotes, and "" inside them is a quote. No wanted indexes means all the fields.
+		 *
+		 * 	file("data.tsv").fields('\t', {0, 3}).map([](const row &r){ return r[1].to_long(); }).sum()
+		 */
+		genfields<Derived> fields(char sep, const std::vector<size_t> &wanted=std::vector<size_t>());
 		
-		/// Going to list world.
-		operator std::vector<underscore::string>(){
-			std::vector<underscore::string> r;
-			gen_type *self=(gen_type*)this;
-			try{
-				while(!self->empty()){
-					r.push_back(self->get_next());
-				}
-			}
-			catch(::underscore::eog &e){
-			}
+		
+		/// Going to list world. Elements are converted to U if needed.
+		template<typename U>
+		operator std::vector<U>(){
+			std::vector<U> r;
+			T v;
+			while(self()->next(v))
+				r.push_back(U(std::move(v)));
 			return r;
 		}
 		
-		sequence<std::vector<::underscore::string>> to_vector(){
-			std::vector<::underscore::string> r;
-			gen_type *self=(gen_type*)this;
-			try{
-				while(!self->empty()){
-					r.push_back(self->get_next());
-				}
-			}
-			catch(::underscore::eog &e){
-			}
-			return r;
+		sequence<std::vector<T>> to_vector(){
+			return sequence<std::vector<T>>(std::vector<T>(*this));
 		}
 
-		
-		sequence<std::vector<underscore::string>> sort(){
-			std::vector<underscore::string> v=*this;
+		/**
+		 * @short All the elements, sorted, as a sequence.
+		 *
+		 * The result is a sequence in memory, so the input must fit in memory too: for larger inputs use
+		 * external_sort(), that generates the result from runs spilled to disk.
+		 */
+		sequence<std::vector<T>> sort(){
+			std::vector<T> v=*this;
 			std::sort(std::begin(v), std::end(v));
 			return v;
 		}
+		/**
+		 * @short Sorts inputs of any size, using at most about memory_budget bytes. Defined at external_sort.hpp.
+		 *
+		 * Sorted runs that do not fit are written to temporary files at tmpdir ($TMPDIR or /tmp by default) and
+		 * merged lazily as the result is generated. With unique, equal elements are generated only once. With
+		 * threads>1, runs are sorted and written in the background while the next one is read.
+		 */
+		genextsort<Derived> external_sort(size_t memory_budget=256*1024*1024, bool unique=false, size_t threads=1,
+		                                  const std::string &tmpdir=std::string());
+		
+		/**
+		 * @short Elements [start, end). Skips to start with advance(), and stops pulling at end, so
+		 * peeking at the head of a huge file costs only the lines read.
+		 *
+		 * Negative positions count from the end, as in sequence::slice: slice(-3) are the last three
+		 * elements and slice(0, -1) all but the last. They buffer up to -start or -end elements, so the
+		 * elements must stay valid after the next read (map fd_file views to std::string first).
+		 */
+		genslice<Derived> slice(ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max());
+		/**
+		 * @short The first n elements.
+		 */
+		genslice<Derived> take(size_t n){
+			return slice(0, n);
+		}
+		/**
+		 * @short All but the first n elements.
+		 */
+		genslice<Derived> skip(size_t n){
+			return slice(n);
+		}
+		/**
+		 * @short Elements while f is true. Stops at the first for which it is false, which is dropped.
+		 */
+		template<typename F>
+		gentake_while<Derived, typename std::decay<F>::type> take_while(F &&f){
+			return gentake_while<Derived, typename std::decay<F>::type>(std::forward<F>(f), std::move(*self()));
+		}
+		/**
+		 * @short Drops elements while f is true, then generates all the rest.
+		 */
+		template<typename F>
+		gendrop_while<Derived, typename std::decay<F>::type> drop_while(F &&f){
+			return gendrop_while<Derived, typename std::decay<F>::type>(std::forward<F>(f), std::move(*self()));
+		}
+		
+		/**
+		 * @short Writes all the elements to the file at path, each followed by sep, using a sink. Returns how many.
+		 * Defined at sink.hpp.
+		 *
+		 * Output is gathered in big batches written with writev(). With background they are written by
+		 * another thread, while the pipeline goes on. Views, as from mmap_file, are copied into a buffer of
+		 * the batch, with no allocation per element.
+		 */
+		size_t write_to(const std::string &path, const std::string &sep="\n", bool background=false);
+		/**
+		 * @short Writes all the elements to an open file descriptor, as write_to(path). It is not closed.
+		 */
+		size_t write_to(int fd, const std::string &sep="\n", bool background=false);
+		
+		/**
+		 * @short Skips the next n elements. Returns how many were skipped, less than n only at the end.
+		 *
+		 * This default pulls them with next(). Sources that can seek do it without generating the elements,
+		 * as mmap_file that just looks for newlines, and map skips its source without calling f.
+		 */
+		size_t advance(size_t n){
+			T v;
+			size_t i=0;
+			while (i<n && self()->next(v))
+				++i;
+			return i;
+		}
+		
+		/**
+		 * Terminal operations. They consume the generator in a single pass, keeping in memory only the
+		 * result: O(1) or O(number of groups).
+		 *
+		 * Keys of string_ref generators are views: keep the source alive, or map them to strings first.
+		 */
+		
+		/**
+		 * @short Number of elements.
+		 */
+		size_t count(){
+			size_t n=0;
+			T v;
+			while(self()->next(v))
+				++n;
+			return n;
+		}
+		/**
+		 * @short Number of elements that satisfy f.
+		 */
+		template<typename F>
+		size_t count(const F &f){
+			size_t n=0;
+			T v;
+			while(self()->next(v))
+				if (f(v))
+					++n;
+			return n;
+		}
 		
-		genfilter<gen_type> slice(ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()){
-			class slicer{
-				ssize_t start;
-				ssize_t end;
-				
-				ssize_t i;
-			public:
-				slicer(ssize_t _start, ssize_t _end) : start(_start), end(_end), i(0) {}
-				bool operator()(const underscore::string &ignore){
-					if (i>=start){
-						i++;
-						if (i>=end)
-							throw ::underscore::eog();
-						return true;
-					}
+		/**
+		 * @short Reduces the stream, with the same signature as sequence::reduce: f(element, accumulated) returns
+		 * the new accumulated value.
+		 * 
+		 * 	file("/etc/services").reduce<size_t>([](const string &l, size_t acc){ return acc+l.size(); }, 0)
+		 */
+		template<typename S, typename F>
+		S reduce(const F &f, S initial=S()){
+			T v;
+			while(self()->next(v))
+				initial=f(std::move(v), std::move(initial));
+			return initial;
+		}
+		/**
+		 * @short Left fold: f(accumulated, element) returns the new accumulated value.
+		 */
+		template<typename S, typename F>
+		S fold(S initial, const F &f){
+			T v;
+			while(self()->next(v))
+				initial=f(std::move(initial), std::move(v));
+			return initial;
+		}
+		/**
+		 * @short Sum of all the elements, with operator+. S() if empty.
+		 */
+		template<typename S=T>
+		S sum(){
+			S ret=S();
+			T v;
+			while(self()->next(v))
+				ret=ret+v;
+			return ret;
+		}
+		/**
+		 * @short Maximum element, T() if empty.
+		 */
+		T max(){
+			T ret, v;
+			if (!self()->next(ret))
+				return T();
+			while(self()->next(v))
+				if (ret<v)
+					ret=std::move(v);
+			return ret;
+		}
+		/**
+		 * @short Minimum element, T() if empty.
+		 */
+		T min(){
+			T ret, v;
+			if (!self()->next(ret))
+				return T();
+			while(self()->next(v))
+				if (v<ret)
+					ret=std::move(v);
+			return ret;
+		}
+		/**
+		 * @short Checks if any element satisfies f. Stops at the first that does.
+		 */
+		template<typename F>
+		bool any(const F &f){
+			T v;
+			while(self()->next(v))
+				if (f(v))
+					return true;
+			return false;
+		}
+		/**
+		 * @short Checks if all elements satisfy f. Stops at the first that does not.
+		 */
+		template<typename F>
+		bool all(const F &f){
+			T v;
+			while(self()->next(v))
+				if (!f(v))
 					return false;
-				}
-			};
-			
-			return filter(slicer(start, end));
+			return true;
+		}
+		/**
+		 * @short Calls f on each element.
+		 */
+		template<typename F>
+		void each(const F &f){
+			T v;
+			while(self()->next(v))
+				f(v);
 		}
 		
+		/**
+		 * @short Groups the elements by key(element) into a hash map of lists.
+		 */
+		template<typename F, typename K=typename std::decay<decltype(std::declval<F&>()(std::declval<T&>()))>::type>
+		std::unordered_map<K, std::vector<T>> group_by(const F &key){
+			std::unordered_map<K, std::vector<T>> ret;
+			T v;
+			while(self()->next(v)){
+				auto k=key(v);
+				ret[std::move(k)].push_back(std::move(v));
+			}
+			return ret;
+		}
+		/**
+		 * @short Groups by key(element) and folds each group: f(accumulated, element), starting at initial.
+		 * Keeps only one accumulated value per group.
+		 */
+		template<typename F, typename S, typename G, typename K=typename std::decay<decltype(std::declval<F&>()(std::declval<T&>()))>::type>
+		std::unordered_map<K, S> group_by(const F &key, S initial, const G &f){
+			std::unordered_map<K, S> ret;
+			T v;
+			while(self()->next(v)){
+				auto I=ret.find(key(v));
+				if (I==ret.end())
+					I=ret.emplace(key(v), initial).first;
+				I->second=f(std::move(I->second), std::move(v));
+			}
+			return ret;
+		}
+		/**
+		 * @short Number of elements per key(element).
+		 */
+		template<typename F, typename K=typename std::decay<decltype(std::declval<F&>()(std::declval<T&>()))>::type>
+		std::unordered_map<K, size_t> count_by(const F &key){
+			std::unordered_map<K, size_t> ret;
+			T v;
+			while(self()->next(v))
+				++ret[key(v)];
+			return ret;
+		}
+		/**
+		 * @short Creates a map from a stream of tuples or pairs, as sequence::to_map. Later values overwrite earlier ones.
+		 */
+		template<typename A_t, typename B_t>
+		std::map<A_t, B_t> to_map(){
+			std::map<A_t, B_t> ret;
+			T v;
+			while(self()->next(v))
+				ret[std::get<0>(v)]=std::get<1>(v);
+			return ret;
+		}
+		/**
+		 * @short Creates a hash map with key(element) and value(element). Later values overwrite earlier ones.
+		 */
+		template<typename F, typename G,
+				typename K=typename std::decay<decltype(std::declval<F&>()(std::declval<T&>()))>::type,
+				typename V=typename std::decay<decltype(std::declval<G&>()(std::declval<T&>()))>::type>
+		std::unordered_map<K, V> to_map(const F &key, const G &value){
+			std::unordered_map<K, V> ret;
+			T v;
+			while(self()->next(v))
+				ret[key(v)]=value(v);
+			return ret;
+		}
+		
+		/**
+		 * @short The k largest elements, largest first, in one pass and O(k) memory. Equal elements keep their order.
+		 *
+		 * 	file("access.log").top_k(100, [](const string &l){ return l.size(); })
+		 */
+		sequence<std::vector<T>> top_k(size_t k){
+			return _best_k(k, true);
+		}
+		/**
+		 * @short The k elements with the largest key(element), largest first.
+		 */
+		template<typename F>
+		sequence<std::vector<T>> top_k(size_t k, const F &key){
+			return _best_k(k, true, key);
+		}
+		/**
+		 * @short The k smallest elements, smallest first. Same result as sort().slice(0, k), without sorting all.
+		 */
+		sequence<std::vector<T>> bottom_k(size_t k){
+			return _best_k(k, false);
+		}
+		/**
+		 * @short The k elements with the smallest key(element), smallest first.
+		 */
+		template<typename F>
+		sequence<std::vector<T>> bottom_k(size_t k, const F &key){
+			return _best_k(k, false, key);
+		}
+		/**
+		 * @short Same as bottom_k(k): the first k elements of the sorted stream.
+		 */
+		sequence<std::vector<T>> sort(size_t k){
+			return _best_k(k, false);
+		}
+	private:
+		sequence<std::vector<T>> _best_k(size_t k, bool largest){
+			detail::bounded_heap<T> heap(k, largest);
+			T v;
+			while(self()->next(v))
+				heap.push({0, std::move(v)});
+			return heap.sorted();
+		}
+		template<typename F, typename K=typename std::decay<decltype(std::declval<F&>()(std::declval<T&>()))>::type>
+		sequence<std::vector<T>> _best_k(size_t k, bool largest, const F &key){
+			detail::bounded_heap<T, K> heap(k, largest);
+			T v;
+			while(self()->next(v)){
+				K kv=key(v);
+				heap.push({std::move(kv), 0, std::move(v)});
+			}
+			return heap.sorted();
+		}
+		gen_type *self(){
+			return static_cast<gen_type*>(this);
+		}
 	};
 
 
-	template<typename Prev>
-	class genmap : public generator<genmap<Prev>>{
+	template<typename Prev, typename S, typename F>
+	class genmap : public generator<genmap<Prev, S, F>, S>{
+		typedef typename Prev::value_type in_type;
 		Prev _prev;
+		in_type _in;
+		std::vector<in_type> _in_batch;
+		F _f;
 	public:
-		generator<void>::map_f _f;
-		genmap(const generator<void>::map_f &f, Prev &&prev) : _prev(std::forward<Prev>(prev)), _f(f){};
-		genmap(genmap<Prev> &&o) : _prev(std::move(o._prev)), _f(std::move(o._f)){};
+		template<typename G>
+		genmap(G &&f, Prev &&prev) : _prev(std::forward<Prev>(prev)), _f(std::forward<G>(f)){};
+		genmap(genmap &&o) : _prev(std::move(o._prev)), _f(std::move(o._f)){};
 
-		bool empty(){
-			return _prev.empty();
+		bool next(S &out){
+			if (!_prev.next(_in))
+				return false;
+			out=_f(std::move(_in));
+			return true;
+		}
+		/// Skipped elements are not converted, so f is not called for them.
+		size_t advance(size_t n){
+			return _prev.advance(n);
 		}
-		underscore::string get_next(){
-			return _f( this->_prev.get_next() );
+		size_t next_batch(S *out, size_t n){
+			if (_in_batch.size()<n)
+				_in_batch.resize(n);
+			size_t got=_prev.next_batch(_in_batch.data(), n);
+			for (size_t i=0;i<got;++i)
+				out[i]=_f(std::move(_in_batch[i]));
+			return got;
 		}
 	};
 
-	template<typename Prev>
-	class genfilter : public generator<genfilter<Prev>>{
+	template<typename Prev, typename F>
+	class genfilter : public generator<genfilter<Prev, F>, typename Prev::value_type>{
+		typedef typename Prev::value_type T;
 		Prev _prev;
+		F _f;
+		std::vector<size_t> _selected;
 	public:
-		generator<void>::filter_f _f;
-		genfilter(generator<void>::filter_f &&f, Prev &&prev) : _prev(std::forward<Prev>(prev)), _f(f){}
-		genfilter(genfilter<Prev> &&o) : _prev(std::move(o._prev)), _f(std::move(o._f)){};
+		template<typename G>
+		genfilter(G &&f, Prev &&prev) : _prev(std::forward<Prev>(prev)), _f(std::forward<G>(f)){}
+		genfilter(genfilter &&o) : _prev(std::move(o._prev)), _f(std::move(o._f)){};
 		
-		bool empty(){
-			return _prev.empty();
+		bool next(T &out){
+			while(_prev.next(out)){
+				if (_f(out))
+					return true;
+			}
+			return false;
+		};
+		/**
+		 * @short Evaluates f over the full batch into a selection vector, without branches, and then
+		 * compacts the selected elements to the front. They are swapped, so no element loses its memory.
+		 */
+		size_t next_batch(T *out, size_t n){
+			if (_selected.size()<n)
+				_selected.resize(n);
+			for(;;){
+				size_t got=_prev.next_batch(out, n);
+				if (got==0)
+					return 0;
+				size_t k=0;
+				for (size_t i=0;i<got;++i){
+					_selected[k]=i;
+					k+=bool(_f(out[i]));
+				}
+				for (size_t j=0;j<k;++j)
+					if (_selected[j]!=j)
+						std::swap(out[j], out[_selected[j]]);
+				if (k>0)
+					return k;
+			}
 		}
-		underscore::string get_next(){
-			while(!empty()){
-				auto v=_prev.get_next();
-				if (_f(v))
-					return v;
+	};
+	
+	/**
+	 * @short Elements [start, end) of the previous generator. Stops pulling once end is reached.
+	 *
+	 * Negative positions count from the end, as in sequence::slice. A negative start keeps the last
+	 * -start elements while reading everything; a negative end delays the output by -end elements.
+	 */
+	template<typename Prev>
+	class genslice : public generator<genslice<Prev>, typename Prev::value_type>{
+		typedef typename Prev::value_type T;
+		Prev _prev;
+		ssize_t _start, _end, _i;
+		std::deque<T> _buffer;
+		bool _filled;
+		
+		bool _next_delayed(T &out){
+			T v;
+			while (_buffer.size()<size_t(-_end)){
+				if (!_prev.next(v)){
+					_buffer.clear();
+					return false;
+				}
+				_buffer.push_back(std::move(v));
+			}
+			if (!_prev.next(v)){
+				_buffer.clear();
+				return false;
 			}
-			throw ::underscore::eog();
+			out=std::move(_buffer.front());
+			_buffer.pop_front();
+			_buffer.push_back(std::move(v));
+			return true;
+		}
+		bool _next_tail(T &out){
+			if (!_filled){
+				_filled=true;
+				size_t keep=-_start, count=0;
+				T v;
+				while (_prev.next(v)){
+					++count;
+					_buffer.push_back(std::move(v));
+					if (_buffer.size()>keep)
+						_buffer.pop_front();
+				}
+				size_t first=count-_buffer.size(), stop;
+				if (_end>=0)
+					stop=std::min(size_t(_end), count);
+				else
+					stop=count>size_t(-_end) ? count-size_t(-_end) : 0;
+				while (!_buffer.empty() && first+_buffer.size()>stop)
+					_buffer.pop_back();
+			}
+			if (_buffer.empty())
+				return false;
+			out=std::move(_buffer.front());
+			_buffer.pop_front();
+			return true;
+		}
+	public:
+		genslice(ssize_t start, ssize_t end, Prev &&prev) : _prev(std::forward<Prev>(prev)), _start(start), _end(end), _i(0),
+		                                                    _filled(false){}
+		genslice(genslice &&o) : _prev(std::move(o._prev)), _start(o._start), _end(o._end), _i(o._i),
+		                         _buffer(std::move(o._buffer)), _filled(o._filled){};
+		
+		bool next(T &out){
+			if (_start<0)
+				return _next_tail(out);
+			if (_i<_start){
+				size_t skipped=_prev.advance(_start-_i);
+				_i+=skipped;
+				if (_i<_start){ // Ended before start
+					_i=_start;
+					_end=0;
+					return false;
+				}
+			}
+			if (_end<0)
+				return _next_delayed(out);
+			if (_i>=_end || !_prev.next(out))
+				return false;
+			++_i;
+			return true;
 		};
 	};
 	
+	template<typename Prev, typename F>
+	class gentake_while : public generator<gentake_while<Prev, F>, typename Prev::value_type>{
+		typedef typename Prev::value_type T;
+		Prev _prev;
+		F _f;
+		bool _done;
+	public:
+		template<typename G>
+		gentake_while(G &&f, Prev &&prev) : _prev(std::forward<Prev>(prev)), _f(std::forward<G>(f)), _done(false){}
+		gentake_while(gentake_while &&o) : _prev(std::move(o._prev)), _f(std::move(o._f)), _done(o._done){}
+		
+		bool next(T &out){
+			if (_done || !_prev.next(out) || !_f(out)){
+				_done=true;
+				return false;
+			}
+			return true;
+		}
+	};
 	
-	template<typename T>
-	genmap<T> generator<T>::map(map_f &&f){
-		return genmap<T>(std::forward<map_f>(f), std::move(*reinterpret_cast<T*>(this)));
-	}
-	template<typename T>
-	genfilter<T> generator<T>::filter(filter_f &&f){
-		return genfilter<T>(std::forward<filter_f>(f), std::move(*reinterpret_cast<T*>(this)));
-	}
+	template<typename Prev, typename F>
+	class gendrop_while : public generator<gendrop_while<Prev, F>, typename Prev::value_type>{
+		typedef typename Prev::value_type T;
+		Prev _prev;
+		F _f;
+		bool _dropping;
+	public:
+		template<typename G>
+		gendrop_while(G &&f, Prev &&prev) : _prev(std::forward<Prev>(prev)), _f(std::forward<G>(f)), _dropping(true){}
+		gendrop_while(gendrop_while &&o) : _prev(std::move(o._prev)), _f(std::move(o._f)), _dropping(o._dropping){}
+		
+		bool next(T &out){
+			if (!_dropping)
+				return _prev.next(out);
+			while (_prev.next(out))
+				if (!_f(out)){
+					_dropping=false;
+					return true;
+				}
+			return false;
+		}
+		/// Once the head is dropped, seeks as its source.
+		size_t advance(size_t n){
+			if (_dropping)
+				return generator<gendrop_while<Prev, F>, T>::advance(n);
+			return _prev.advance(n);
+		}
+	};
 	
 	
+	template<typename Derived, typename T>
+	genslice<Derived> generator<Derived, T>::slice(ssize_t start, ssize_t end){
+		return genslice<Derived>(start, end, std::move(*self()));
+	}
+	
 	/// specific generators
-	class vector : public generator<vector>{
-		std::vector<underscore::string> v;
+	/**
+	 * @short Generator over the elements of a std::vector. Elements are moved out as they are generated.
+	 */
+	template<typename T>
+	class vector_of : public generator<vector_of<T>, T>{
+		std::vector<T> v;
 		size_t n;
 	public:
-		vector(const std::vector<underscore::string> &strl) : v(strl), n(0) {}
-		vector(vector &&o) : v(std::move(o.v)), n(o.n) {}
+		vector_of(const std::vector<T> &strl) : v(strl), n(0) {}
+		vector_of(std::vector<T> &&strl) : v(std::move(strl)), n(0) {}
+		vector_of(vector_of &&o) : v(std::move(o.v)), n(o.n) {}
 
-		bool empty(){
-			return (n>=v.size());
+		bool next(T &out){
+			if (n>=v.size())
+				return false;
+			out=std::move(v[n++]); // Each element is read only once
+			return true;
 		}
-		underscore::string get_next(){
-			if (empty())
-				throw ::underscore::eog();
-			return v[n++];
+		size_t advance(size_t max){
+			size_t skipped=std::min(max, v.size()-n);
+			n+=skipped;
+			return skipped;
+		}
+		size_t next_batch(T *out, size_t max){
+			size_t got=std::min(max, v.size()-n);
+			std::move(v.begin()+n, v.begin()+n+got, out);
+			n+=got;
+			return got;
 		}
 	};
+	typedef vector_of<underscore::string> vector;
 	
 	
 };
 
+#include "external_sort.hpp"
+#include "async.hpp"
+#include "fields.hpp"
+#include "sink.hpp"
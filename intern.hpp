@@ -0,0 +1,315 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <new>
+#include "sequence.hpp"
+#include "string_ref.hpp"
+
+namespace underscore{
+	class interned_string;
+
+	typedef sequence<std::vector<interned_string>> interned_list;
+
+	/**
+	 * @short Table of unique strings. Each different string is stored only once.
+	 *
+	 * It is split in shards, each with its own mutex, so it can be used concurrently.
+	 *
+	 * Memory is bounded with a soft limit: when a shard grows over its part of the limit, all the
+	 * entries that no interned_string references anymore are freed. Referenced entries are never freed,
+	 * so handles are always valid and pointer equality always means string equality.
+	 *
+	 * Normally the global() pool is used. Handles of a custom pool must not outlive it.
+	 */
+	class intern_pool{
+	public:
+		struct entry{
+			std::atomic<size_t> refs;
+			size_t size;
+
+			const char *data() const{ return reinterpret_cast<const char*>(this+1); }
+			char *data(){ return reinterpret_cast<char*>(this+1); }
+			string_ref ref() const{ return string_ref(data(), size); }
+		};
+		static const size_t shard_count=16;
+	private:
+		struct shard{
+			std::mutex mutex;
+			std::unordered_map<string_ref, entry*> table;
+			size_t bytes;
+			size_t sweep_at;
+
+			shard() : bytes(0), sweep_at(0){}
+		};
+
+		shard _shards[shard_count];
+		std::atomic<size_t> _max_bytes;
+
+		static size_t _entry_bytes(size_t size){
+			return sizeof(entry)+size+1;
+		}
+
+		/// Frees all unreferenced entries of the shard. Must hold the shard lock.
+		size_t _sweep(shard &sh){
+			size_t n=0;
+			for (auto I=sh.table.begin();I!=sh.table.end();){
+				entry *e=I->second;
+				if (e->refs.load(std::memory_order_acquire)==0){
+					sh.bytes-=_entry_bytes(e->size);
+					I=sh.table.erase(I);
+					e->~entry();
+					::operator delete(e);
+					++n;
+				}
+				else
+					++I;
+			}
+			// If still over the limit, wait until it doubles to avoid sweeping at every insert.
+			size_t limit=_max_bytes.load(std::memory_order_relaxed)/shard_count;
+			sh.sweep_at=std::max(limit, sh.bytes*2);
+			return n;
+		}
+	public:
+		/**
+		 * @short Creates a pool. The memory limit is soft, referenced strings are always kept.
+		 */
+		intern_pool(size_t max_bytes=64*1024*1024) : _max_bytes(max_bytes){
+			for (auto &sh: _shards)
+				sh.sweep_at=max_bytes/shard_count;
+		}
+		intern_pool(const intern_pool &)=delete;
+		intern_pool &operator=(const intern_pool &)=delete;
+		~intern_pool(){
+			for (auto &sh: _shards){
+				for (auto &kv: sh.table){
+					kv.second->~entry();
+					::operator delete(kv.second);
+				}
+			}
+		}
+
+		/**
+		 * @short The process wide pool. It is never destroyed, so handles at static objects are safe.
+		 */
+		static intern_pool &global(){
+			static intern_pool *pool=new intern_pool();
+			return *pool;
+		}
+
+		/**
+		 * @short Returns the unique entry for that string, with one more reference. nullptr for the empty string.
+		 */
+		entry *acquire(const string_ref &s){
+			if (s.empty())
+				return nullptr;
+			size_t h=std::hash<string_ref>()(s);
+			shard &sh=_shards[(h>>7)%shard_count];
+			std::lock_guard<std::mutex> lock(sh.mutex);
+			auto I=sh.table.find(s);
+			if (I!=sh.table.end()){
+				I->second->refs.fetch_add(1, std::memory_order_relaxed);
+				return I->second;
+			}
+			if (sh.bytes+_entry_bytes(s.size())>sh.sweep_at)
+				_sweep(sh);
+			entry *e=new (::operator new(_entry_bytes(s.size()))) entry();
+			e->refs.store(1, std::memory_order_relaxed);
+			e->size=s.size();
+			memcpy(e->data(), s.data(), s.size());
+			e->data()[s.size()]=0;
+			sh.table.emplace(e->ref(), e);
+			sh.bytes+=_entry_bytes(s.size());
+			return e;
+		}
+
+		interned_string intern(const string_ref &s);
+
+		/**
+		 * @short Changes the soft memory limit. Takes effect on next inserts.
+		 */
+		void set_memory_limit(size_t max_bytes){
+			_max_bytes=max_bytes;
+			for (auto &sh: _shards){
+				std::lock_guard<std::mutex> lock(sh.mutex);
+				sh.sweep_at=max_bytes/shard_count;
+			}
+		}
+
+		/**
+		 * @short Frees now all the strings no handle references. Returns how many were freed.
+		 */
+		size_t evict(){
+			size_t n=0;
+			for (auto &sh: _shards){
+				std::lock_guard<std::mutex> lock(sh.mutex);
+				n+=_sweep(sh);
+			}
+			return n;
+		}
+
+		/// Number of different strings at the pool.
+		size_t size(){
+			size_t n=0;
+			for (auto &sh: _shards){
+				std::lock_guard<std::mutex> lock(sh.mutex);
+				n+=sh.table.size();
+			}
+			return n;
+		}
+		/// Approximate memory used by the stored strings.
+		size_t memory(){
+			size_t n=0;
+			for (auto &sh: _shards){
+				std::lock_guard<std::mutex> lock(sh.mutex);
+				n+=sh.bytes;
+			}
+			return n;
+		}
+	};
+
+	/**
+	 * @short Handle to a string stored at an intern_pool.
+	 *
+	 * Equality and hashing are O(1), by pointer. Copy is just a reference count increment.
+	 *
+	 * Example:
+	 *
+	 * 	auto a=interned_string("tcp");
+	 * 	auto b=split_interned("udp tcp", ' ')[1];
+	 * 	a==b; // Pointer comparison
+	 */
+	class interned_string{
+		intern_pool::entry *_e;
+
+		void _release(){
+			if (_e)
+				_e->refs.fetch_sub(1, std::memory_order_release);
+		}
+	public:
+		interned_string() : _e(nullptr){}
+		explicit interned_string(const string_ref &s, intern_pool &pool=intern_pool::global()) : _e(pool.acquire(s)){}
+		explicit interned_string(const char *s) : _e(intern_pool::global().acquire(s)){}
+		interned_string(const interned_string &o) : _e(o._e){
+			if (_e)
+				_e->refs.fetch_add(1, std::memory_order_relaxed);
+		}
+		interned_string(interned_string &&o) : _e(o._e){
+			o._e=nullptr;
+		}
+		~interned_string(){
+			_release();
+		}
+		interned_string &operator=(const interned_string &o){
+			if (o._e)
+				o._e->refs.fetch_add(1, std::memory_order_relaxed);
+			_release();
+			_e=o._e;
+			return *this;
+		}
+		interned_string &operator=(interned_string &&o){
+			if (this!=&o){
+				_release();
+				_e=o._e;
+				o._e=nullptr;
+			}
+			return *this;
+		}
+
+		string_ref ref() const{ return _e ? _e->ref() : string_ref(); }
+		operator string_ref() const{ return ref(); }
+		std::string str() const{ return ref().str(); }
+
+		const char *data() const{ return _e ? _e->data() : ""; }
+		const char *c_str() const{ return data(); }
+		size_t size() const{ return _e ? _e->size : 0; }
+		size_t length() const{ return size(); }
+		bool empty() const{ return _e==nullptr; }
+
+		/// Identity of the string, unique per pool.
+		const void *id() const{ return _e; }
+
+		bool operator==(const interned_string &o) const{ return _e==o._e; }
+		bool operator!=(const interned_string &o) const{ return _e!=o._e; }
+		/// Lexicographic order, to keep sorts stable and meaningful. Same handles skip the comparison.
+		bool operator<(const interned_string &o) const{ return _e!=o._e && ref()<o.ref(); }
+
+		friend std::ostream& operator <<(std::ostream &output, const interned_string &str) {
+			return output<<str.ref();
+		}
+	};
+
+	inline interned_string intern_pool::intern(const string_ref &s){
+		return interned_string(s, *this);
+	}
+
+	/**
+	 * @short Callable to intern strings, for example at maps:
+	 *
+	 * 	_("tcp udp tcp").split(' ').map<interned_string>(interner());
+	 */
+	class interner{
+		intern_pool *_pool;
+	public:
+		interner(intern_pool &pool=intern_pool::global()) : _pool(&pool){}
+		interned_string operator()(const string_ref &s) const{
+			return interned_string(s, *_pool);
+		}
+	};
+
+	/**
+	 * @short Splits the string directly into interned handles, with no intermediate copies.
+	 */
+	inline interned_list split_interned(const string_ref &s, char sep=',', bool insert_empty_elements=false, intern_pool &pool=intern_pool::global()){
+		std::vector<interned_string> v;
+		const char *I=s.data(), *endI=s.data()+s.size();
+		const char *p;
+		do{
+			p=(const char*)memchr(I, sep, endI-I);
+			if (!p)
+				p=endI;
+			if (insert_empty_elements || p!=I)
+				v.push_back(interned_string(string_ref(I, p), pool));
+			I=p+1;
+		}while(p!=endI);
+		return interned_list(std::move(v));
+	}
+
+	/**
+	 * @short Interns all the elements of a list of strings.
+	 */
+	template<typename T>
+	inline interned_list map_interned(const sequence<T> &l, intern_pool &pool=intern_pool::global()){
+		std::vector<interned_string> v;
+		v.reserve(l.size());
+		for (auto &s: l)
+			v.push_back(interned_string(s, pool));
+		return interned_list(std::move(v));
+	}
+};
+
+namespace std{
+	template<>
+	struct hash<underscore::interned_string>{
+		size_t operator()(const underscore::interned_string &s) const{
+			return std::hash<const void*>()(s.id());
+		}
+	};
+};
@@ -0,0 +1,168 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <string>
+#include <memory>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "generator.hpp"
+#include "string_ref.hpp"
+
+namespace underscore{
+	/**
+	 * @short Contents of a file, memory mapped if possible, or read into memory if not (pipes, /proc files...).
+	 *
+	 * Shared by all the mmap_file generators over the same file, it is unmapped when the last one is gone.
+	 */
+	class mapped_file{
+		const char *_data;
+		size_t _size;
+		bool _mapped;
+		bool _open;
+		std::string _buffer; // Only if not mapped
+
+		void _read_all(int fd){
+			char buf[64*1024];
+			ssize_t n;
+			while ((n=::read(fd, buf, sizeof(buf)))>0 || (n<0 && errno==EINTR)){
+				if (n>0)
+					_buffer.append(buf, n);
+			}
+			_data=_buffer.data();
+			_size=_buffer.size();
+		}
+	public:
+		explicit mapped_file(const std::string &path) : _data(""), _size(0), _mapped(false), _open(false){
+			int fd=::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd<0)
+				return;
+			_open=true;
+			struct stat st;
+			if (fstat(fd, &st)==0 && S_ISREG(st.st_mode) && st.st_size>0){
+				void *p=mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (p!=MAP_FAILED){
+					_data=(const char*)p;
+					_size=st.st_size;
+					_mapped=true;
+					madvise(p, _size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+					madvise(p, _size, MADV_HUGEPAGE); // Just a hint, most filesystems ignore it.
+#endif
+				}
+			}
+			if (!_mapped)
+				_read_all(fd);
+			::close(fd);
+		}
+		mapped_file(const mapped_file &)=delete;
+		mapped_file &operator=(const mapped_file &)=delete;
+		~mapped_file(){
+			if (_mapped)
+				munmap((void*)_data, _size);
+		}
+
+		const char *data() const{ return _data; }
+		size_t size() const{ return _size; }
+		bool is_mapped() const{ return _mapped; }
+		bool is_open() const{ return _open; }
+		string_ref ref() const{ return string_ref(_data, _size); }
+	};
+
+	/**
+	 * @short Generator of the lines of a file, as string_ref views into the memory mapped file.
+	 *
+	 * There is no copy at all: lines are found with memchr directly at the page cache. Views are valid
+	 * while any generator over the file is alive, so keep one (copies share the mapping) or convert the
+	 * lines to strings before the generator is destroyed. As std::getline, the newline is not included and
+	 * there is no empty line after a final newline.
+	 *
+	 * If the file can not be mapped (pipes, special files) it is read into memory with read().
+	 * If it can not be opened the generator is empty.
+	 *
+	 * Example:
+	 *
+	 * 	mmap_file("/var/log/syslog")
+	 * 		.filter([](const string_ref &l){ return l.contains("error"); })
+	 * 		.map<std::string>([](string_ref l){ return l.str(); })
+	 */
+	class mmap_file : public generator<mmap_file, string_ref>{
+		std::shared_ptr<const mapped_file> _file;
+		const char *_pos, *_end;
+	public:
+		explicit mmap_file(const std::string &path) : _file(std::make_shared<mapped_file>(path)){
+			_pos=_file->data();
+			_end=_pos+_file->size();
+		}
+		/**
+		 * @short Generator over the lines of bytes [begin, end) of an already open file.
+		 *
+		 * begin should be the start of a line.
+		 */
+		mmap_file(std::shared_ptr<const mapped_file> file, size_t begin, size_t end) : _file(std::move(file)){
+			end=std::min(end, _file->size());
+			begin=std::min(begin, end);
+			_pos=_file->data()+begin;
+			_end=_file->data()+end;
+		}
+		mmap_file(mmap_file &&o) : _file(std::move(o._file)), _pos(o._pos), _end(o._end){}
+		mmap_file(const mmap_file &o) : _file(o._file), _pos(o._pos), _end(o._end){}
+
+		bool next(string_ref &out){
+			if (_pos>=_end)
+				return false;
+			const char *nl=(const char*)memchr(_pos, '\n', _end-_pos);
+			if (!nl)
+				nl=_end;
+			out=string_ref(_pos, nl);
+			_pos=nl+1;
+			return true;
+		}
+		/// Skips n lines just looking for the newlines.
+		size_t advance(size_t n){
+			size_t i=0;
+			while (i<n && _pos<_end){
+				const char *nl=(const char*)memchr(_pos, '\n', _end-_pos);
+				_pos=nl ? nl+1 : _end;
+				++i;
+			}
+			return i;
+		}
+		size_t next_batch(string_ref *out, size_t n){
+			size_t i=0;
+			while (i<n && _pos<_end){
+				const char *nl=(const char*)memchr(_pos, '\n', _end-_pos);
+				if (!nl)
+					nl=_end;
+				out[i++]=string_ref(_pos, nl);
+				_pos=nl+1;
+			}
+			return i;
+		}
+
+		bool is_open() const{ return _file->is_open(); }
+		bool is_mapped() const{ return _file->is_mapped(); }
+		/// The full file contents.
+		const std::shared_ptr<const mapped_file> &file() const{ return _file; }
+		/// Bytes not yet consumed.
+		string_ref remaining() const{ return string_ref(_pos, _end); }
+	};
+};
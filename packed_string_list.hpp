@@ -0,0 +1,304 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <unordered_set>
+#include <stdexcept>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include "sequence.hpp"
+#include "string_ref.hpp"
+#include "cache_format.hpp"
+
+namespace underscore{
+
+	/**
+	 * @short List of strings stored contiguously: one byte arena plus an offsets array.
+	 *
+	 * Same layout as an Arrow string column. Each element costs sizeof(Offset) bytes plus its data,
+	 * instead of a full std::string and a heap allocation. Elements are returned as string_ref views
+	 * into the arena, valid until the list is modified.
+	 *
+	 * Normally used as packed_string_list (32 bit offsets, up to 4GB of data), or
+	 * large_packed_string_list (64 bit offsets).
+	 *
+	 * Example:
+	 *
+	 * 	auto l=split_packed("ssh,http,ftp,http", ',');
+	 * 	l.sort().unique(true).join() == "ftp, http, ssh"
+	 */
+	template<typename Offset>
+	class basic_packed_string_list{
+		std::vector<char> _bytes;
+		std::vector<Offset> _offsets; // size()+1 elements, first is always 0.
+
+		/// First 8 bytes as a big endian number, so comparing them is comparing the strings prefix.
+		static uint64_t _prefix(const string_ref &s){
+			uint64_t p=0;
+			size_t n=std::min<size_t>(8, s.size());
+			for (size_t i=0;i<n;++i)
+				p|=uint64_t((unsigned char)s[i])<<(56-8*i);
+			return p;
+		}
+	public:
+		typedef string_ref value_type;
+		typedef Offset offset_type;
+
+		/**
+		 * @short Random access iterator, returns views.
+		 */
+		class const_iterator : public std::iterator<std::random_access_iterator_tag, string_ref, ssize_t, const string_ref*, string_ref>{
+			const basic_packed_string_list *_list;
+			size_t _i;
+		public:
+			const_iterator(const basic_packed_string_list *list, size_t i) : _list(list), _i(i){}
+			const_iterator() : _list(nullptr), _i(0){}
+			string_ref operator*() const{ return (*_list)[_i]; }
+			string_ref operator[](ssize_t n) const{ return (*_list)[_i+n]; }
+			const_iterator &operator++(){ ++_i; return *this; }
+			const_iterator operator++(int){ auto r=*this; ++_i; return r; }
+			const_iterator &operator--(){ --_i; return *this; }
+			const_iterator operator--(int){ auto r=*this; --_i; return r; }
+			const_iterator &operator+=(ssize_t n){ _i+=n; return *this; }
+			const_iterator &operator-=(ssize_t n){ _i-=n; return *this; }
+			const_iterator operator+(ssize_t n) const{ return const_iterator(_list, _i+n); }
+			const_iterator operator-(ssize_t n) const{ return const_iterator(_list, _i-n); }
+			ssize_t operator-(const const_iterator &o) const{ return ssize_t(_i)-ssize_t(o._i); }
+			bool operator==(const const_iterator &o) const{ return _i==o._i; }
+			bool operator!=(const const_iterator &o) const{ return _i!=o._i; }
+			bool operator<(const const_iterator &o) const{ return _i<o._i; }
+		};
+		typedef const_iterator iterator;
+
+		basic_packed_string_list() : _offsets(1, 0){}
+		basic_packed_string_list(std::initializer_list<string_ref> l) : _offsets(1, 0){
+			for (auto &s: l)
+				push_back(s);
+		}
+		/**
+		 * @short Packs any container of strings.
+		 */
+		template<typename T>
+		explicit basic_packed_string_list(const sequence<T> &l) : _offsets(1, 0){
+			_offsets.reserve(l.size()+1);
+			for (auto &s: l)
+				push_back(s);
+		}
+
+		size_t size() const{ return _offsets.size()-1; }
+		size_t count() const{ return size(); }
+		bool empty() const{ return size()==0; }
+		/// Total bytes of string data.
+		size_t bytes() const{ return _offsets.back(); }
+
+		string_ref operator[](size_t p) const{
+			return string_ref(_bytes.data()+_offsets[p], _offsets[p+1]-_offsets[p]);
+		}
+		string_ref at(size_t p) const{
+			if (p>=size())
+				throw std::out_of_range("packed_string_list::at");
+			return (*this)[p];
+		}
+
+		const_iterator begin() const{ return const_iterator(this, 0); }
+		const_iterator end() const{ return const_iterator(this, size()); }
+
+		/**
+		 * @short Appends a copy of s at the arena. Amortized O(len(s)).
+		 */
+		void push_back(const string_ref &s){
+			size_t end=size_t(_offsets.back())+s.size();
+			if (end>std::numeric_limits<Offset>::max())
+				throw std::length_error("packed_string_list arena is full, use large_packed_string_list");
+			size_t old=_bytes.size();
+			if (s.size() && s.data()>=_bytes.data() && s.data()<_bytes.data()+old){ // A view into this list
+				size_t from=s.data()-_bytes.data();
+				_bytes.resize(old+s.size());
+				memcpy(_bytes.data()+old, _bytes.data()+from, s.size());
+			}
+			else
+				_bytes.insert(_bytes.end(), s.begin(), s.end());
+			_offsets.push_back(Offset(end));
+		}
+		/**
+		 * @short Appends all the elements of another packed list, with just two copies.
+		 */
+		void append(const basic_packed_string_list &o){
+			Offset base=_offsets.back();
+			if (size_t(base)+o.bytes()>std::numeric_limits<Offset>::max())
+				throw std::length_error("packed_string_list arena is full, use large_packed_string_list");
+			// Sizes first and no iterators into o, as o may be this list
+			size_t n=o.size(), nbytes=o.bytes();
+			_bytes.resize(size_t(base)+nbytes);
+			if (nbytes)
+				memcpy(_bytes.data()+base, o._bytes.data(), nbytes);
+			_offsets.reserve(_offsets.size()+n);
+			for (size_t i=1;i<=n;++i)
+				_offsets.push_back(base+o._offsets[i]);
+		}
+		/**
+		 * @short Reserve space for n elements and nbytes of data.
+		 */
+		void reserve(size_t n, size_t nbytes=0){
+			_offsets.reserve(n+1);
+			_bytes.reserve(nbytes);
+		}
+		void shrink_to_fit(){
+			_offsets.shrink_to_fit();
+			_bytes.shrink_to_fit();
+		}
+		void clear(){
+			_bytes.clear();
+			_offsets.resize(1);
+		}
+
+		/**
+		 * @short Joins all elements of the list into a string, with a single allocation.
+		 */
+		std::string join(const std::string &sep=", ") const{
+			std::string ret;
+			if (empty())
+				return ret;
+			ret.reserve(bytes()+(size()-1)*sep.size());
+			ret.append(_bytes.data(), _offsets[1]);
+			for (size_t i=1;i<size();++i){
+				ret+=sep;
+				auto s=(*this)[i];
+				ret.append(s.data(), s.size());
+			}
+			return ret;
+		}
+
+		/**
+		 * @short Returns a new sorted packed list, byte order.
+		 *
+		 * Sorts an index using the first 8 bytes as key, so most comparisons do not touch the arena.
+		 */
+		basic_packed_string_list sort() const{
+			struct key{
+				uint64_t prefix;
+				size_t idx;
+			};
+			std::vector<key> keys;
+			keys.reserve(size());
+			for (size_t i=0;i<size();++i)
+				keys.push_back(key{_prefix((*this)[i]), i});
+			std::sort(keys.begin(), keys.end(), [this](const key &a, const key &b){
+				if (a.prefix!=b.prefix)
+					return a.prefix<b.prefix;
+				return (*this)[a.idx]<(*this)[b.idx];
+			});
+			basic_packed_string_list ret;
+			ret.reserve(size(), bytes());
+			for (auto &k: keys)
+				ret.push_back((*this)[k.idx]);
+			return ret;
+		}
+
+		/**
+		 * @short Writes the list in a binary format that mapped_string_list maps back without parsing.
+		 */
+		void save(const std::string &path, const cache_key &key=cache_key()) const{
+			detail::write_string_list(path, key, begin(), end());
+		}
+
+		/**
+		 * @short Returns a list with the same elements only once, in the same order.
+		 *
+		 * If is_sorted only adjacent elements are compared, if not a hash set of views is used. O(N) both.
+		 */
+		basic_packed_string_list unique(bool is_sorted=false) const{
+			basic_packed_string_list ret;
+			if (is_sorted){
+				for (size_t i=0;i<size();++i)
+					if (i==0 || (*this)[i]!=(*this)[i-1])
+						ret.push_back((*this)[i]);
+			}
+			else{
+				std::unordered_set<string_ref> seen;
+				seen.reserve(size());
+				for (auto s: *this)
+					if (seen.insert(s).second)
+						ret.push_back(s);
+			}
+			return ret;
+		}
+
+		/**
+		 * @short Filters out all the elements that do no comply to the condition.
+		 *
+		 * The condition is a callable with signature "bool (const string_ref &)".
+		 */
+		template<typename F>
+		basic_packed_string_list filter(const F &f) const{
+			basic_packed_string_list ret;
+			for (auto s: *this)
+				if (f(s))
+					ret.push_back(s);
+			return ret;
+		}
+
+		/**
+		 * @short Just executes a function on each element. Returns the same list.
+		 */
+		template<typename F>
+		const basic_packed_string_list &each(const F &f) const{
+			for (auto s: *this)
+				f(s);
+			return *this;
+		}
+
+		/**
+		 * @short Unpacks to a sequence of views, for the rest of sequence operations.
+		 */
+		string_ref_list refs() const{
+			return string_ref_list(std::vector<string_ref>(begin(), end()));
+		}
+	};
+
+	typedef basic_packed_string_list<uint32_t> packed_string_list;
+	typedef basic_packed_string_list<uint64_t> large_packed_string_list;
+
+	/**
+	 * @short Splits directly into a packed list, no per element allocation.
+	 */
+	inline packed_string_list split_packed(const string_ref &s, char sep=',', bool insert_empty_elements=false){
+		packed_string_list ret;
+		ret.reserve(0, s.size());
+		const char *I=s.data(), *endI=s.data()+s.size();
+		const char *p;
+		do{
+			p=(const char*)memchr(I, sep, endI-I);
+			if (!p)
+				p=endI;
+			if (insert_empty_elements || p!=I)
+				ret.push_back(string_ref(I, p));
+			I=p+1;
+		}while(p!=endI);
+		return ret;
+	}
+	inline packed_string_list split_packed(const string_ref &s, const string_ref &sep, bool insert_empty_elements=false){
+		packed_string_list ret;
+		ret.reserve(0, s.size());
+		for (auto &r: s.split(sep, insert_empty_elements))
+			ret.push_back(r);
+		return ret;
+	}
+};
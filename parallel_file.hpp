@@ -0,0 +1,277 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
+#include <memory>
+#include <exception>
+#include <type_traits>
+#include "sequence.hpp"
+#include "mmap_file.hpp"
+
+namespace underscore{
+	/**
+	 * @short Runs a generator pipeline over a big file using several threads.
+	 *
+	 * The file is memory mapped and split in chunks of about chunk_size bytes, each ending at a newline.
+	 * The pipeline is a callable that receives an mmap_file over one chunk and returns a generator, so the
+	 * same stages run on each chunk. Chunks are handed to the threads as they finish the previous one.
+	 *
+	 * Results are combined with an associative reduce, or concatenated in file order with collect.
+	 * Stages must not share mutable state, as they run concurrently.
+	 *
+	 * Example:
+	 *
+	 * 	auto tcp=parallel_file("/var/log/huge.log").count([](mmap_file &&chunk){
+	 * 		return chunk.filter(searcher("/tcp"));
+	 * 	});
+	 */
+	class parallel_file{
+	public:
+		static const size_t default_chunk_size=16*1024*1024;
+	private:
+		std::shared_ptr<const mapped_file> _file;
+		size_t _threads;
+		size_t _chunk_size;
+		std::vector<std::pair<size_t, size_t>> _chunks;
+
+		void _split(){
+			const char *data=_file->data();
+			size_t size=_file->size(), start=0;
+			while (start<size){
+				size_t end=std::min(size, start+_chunk_size);
+				if (end<size){
+					const char *nl=(const char*)memchr(data+end-1, '\n', size-end+1);
+					end=nl ? (nl-data)+1 : size;
+				}
+				_chunks.push_back(std::make_pair(start, end));
+				start=end;
+			}
+		}
+
+		/// Calls f(chunk_index) for every chunk, from _threads threads. Rethrows the first exception.
+		template<typename F>
+		void _run(const F &f) const{
+			std::atomic<size_t> next_chunk(0);
+			std::exception_ptr error;
+			std::atomic<bool> failed(false);
+			auto worker=[&](){
+				try{
+					size_t i;
+					while (!failed && (i=next_chunk++)<_chunks.size())
+						f(i);
+				}
+				catch(...){
+					if (!failed.exchange(true))
+						error=std::current_exception();
+				}
+			};
+			size_t nthreads=std::min(_threads, _chunks.size());
+			std::vector<std::thread> threads;
+			for (size_t i=1;i<nthreads;++i)
+				threads.push_back(std::thread(worker));
+			worker(); // This thread works too
+			for (auto &t: threads)
+				t.join();
+			if (error)
+				std::rethrow_exception(error);
+		}
+
+		template<typename Pipeline>
+		struct pipeline_traits{
+			typedef typename std::decay<decltype(std::declval<Pipeline&>()(std::declval<mmap_file>()))>::type generator_type;
+			typedef typename generator_type::value_type value_type;
+		};
+	public:
+		/**
+		 * @short Opens and splits the file. threads 0 means one per core.
+		 */
+		explicit parallel_file(const std::string &path, size_t threads=0, size_t chunk_size=default_chunk_size)
+				: _file(std::make_shared<mapped_file>(path)), _threads(threads), _chunk_size(std::max<size_t>(chunk_size, 1)){
+			if (_threads==0)
+				_threads=std::max<size_t>(std::thread::hardware_concurrency(), 1);
+			_split();
+		}
+
+		bool is_open() const{ return _file->is_open(); }
+		size_t threads() const{ return _threads; }
+		/// Byte ranges [first, second) of each chunk, in file order.
+		const std::vector<std::pair<size_t, size_t>> &chunks() const{ return _chunks; }
+		/// Generator over the lines of the given chunk.
+		mmap_file chunk(size_t i) const{ return mmap_file(_file, _chunks[i].first, _chunks[i].second); }
+
+		/**
+		 * @short Folds the elements of each chunk with fold(acc, element), starting at init, and then the
+		 * chunk results with combine(acc, acc). Both must be associative for the result to be deterministic.
+		 *
+		 * Every chunk starts at init, so it must be the identity of combine: 0 for sums, an empty container...
+		 */
+		template<typename Pipeline, typename T, typename Fold, typename Combine>
+		T reduce(const Pipeline &pipeline, const T &init, const Fold &fold, const Combine &combine) const{
+			typedef typename pipeline_traits<Pipeline>::value_type V;
+			std::vector<T> partial(_chunks.size(), init);
+			_run([&](size_t i){
+				auto gen=pipeline(chunk(i));
+				T acc=init;
+				V v;
+				while (gen.next(v))
+					acc=fold(std::move(acc), std::move(v));
+				partial[i]=std::move(acc);
+			});
+			if (partial.empty())
+				return init;
+			T ret=std::move(partial[0]);
+			for (size_t i=1;i<partial.size();++i)
+				ret=combine(std::move(ret), std::move(partial[i]));
+			return ret;
+		}
+		/**
+		 * @short Reduce when the elements and the result are the same type, as a sum.
+		 *
+		 * init is used once, as in a sequential fold: the first chunk starts at it, and the others at their
+		 * first element. So the result does not depend on the number of chunks, init needs not be an identity.
+		 */
+		template<typename Pipeline, typename T, typename Op>
+		T reduce(const Pipeline &pipeline, const T &init, const Op &op) const{
+			typedef typename pipeline_traits<Pipeline>::value_type V;
+			std::vector<T> partial(_chunks.size(), init);
+			std::vector<char> has(_chunks.size(), 0); // Empty chunks are skipped at the combine
+			_run([&](size_t i){
+				auto gen=pipeline(chunk(i));
+				T acc=init;
+				V v;
+				bool got=true;
+				if (i>0 && (got=gen.next(v)))
+					acc=T(std::move(v));
+				if (got)
+					while (gen.next(v))
+						acc=op(std::move(acc), std::move(v));
+				partial[i]=std::move(acc);
+				has[i]=got;
+			});
+			if (partial.empty())
+				return init;
+			T ret=std::move(partial[0]);
+			for (size_t i=1;i<partial.size();++i)
+				if (has[i])
+					ret=op(std::move(ret), std::move(partial[i]));
+			return ret;
+		}
+
+		/**
+		 * @short Number of elements the pipeline generates over all the file.
+		 */
+		template<typename Pipeline>
+		size_t count(const Pipeline &pipeline) const{
+			typedef typename pipeline_traits<Pipeline>::value_type V;
+			return reduce(pipeline, size_t(0),
+							[](size_t acc, V &&){ return acc+1; },
+							[](size_t a, size_t b){ return a+b; });
+		}
+
+		/**
+		 * @short All the generated elements, in file order.
+		 *
+		 * If they are string_ref views of the lines, they are valid while this parallel_file is alive.
+		 */
+		template<typename Pipeline>
+		sequence<std::vector<typename pipeline_traits<Pipeline>::value_type>> collect(const Pipeline &pipeline) const{
+			typedef typename pipeline_traits<Pipeline>::value_type V;
+			std::vector<std::vector<V>> partial(_chunks.size());
+			_run([&](size_t i){
+				auto gen=pipeline(chunk(i));
+				V v;
+				while (gen.next(v))
+					partial[i].push_back(std::move(v));
+			});
+			size_t total=0;
+			for (auto &p: partial)
+				total+=p.size();
+			std::vector<V> ret;
+			ret.reserve(total);
+			for (auto &p: partial)
+				for (auto &v: p)
+					ret.push_back(std::move(v));
+			return sequence<std::vector<V>>(std::move(ret));
+		}
+
+		/**
+		 * @short The k largest generated elements, largest first. Each chunk keeps its own top k, and they
+		 * are merged at the end, so memory is O(k) per chunk.
+		 */
+		template<typename Pipeline>
+		sequence<std::vector<typename pipeline_traits<Pipeline>::value_type>> top_k(const Pipeline &pipeline, size_t k) const{
+			return _best_k(pipeline, k, true);
+		}
+		/**
+		 * @short The k elements with largest key(element), largest first.
+		 */
+		template<typename Pipeline, typename F>
+		sequence<std::vector<typename pipeline_traits<Pipeline>::value_type>> top_k(const Pipeline &pipeline, size_t k, const F &key) const{
+			return _best_k(pipeline, k, true, key);
+		}
+		/**
+		 * @short The k smallest generated elements, smallest first.
+		 */
+		template<typename Pipeline>
+		sequence<std::vector<typename pipeline_traits<Pipeline>::value_type>> bottom_k(const Pipeline &pipeline, size_t k) const{
+			return _best_k(pipeline, k, false);
+		}
+		/**
+		 * @short The k elements with smallest key(element), smallest first.
+		 */
+		template<typename Pipeline, typename F>
+		sequence<std::vector<typename pipeline_traits<Pipeline>::value_type>> bottom_k(const Pipeline &pipeline, size_t k, const F &key) const{
+			return _best_k(pipeline, k, false, key);
+		}
+	private:
+		/// Per chunk heaps, merged in file order so equal keys keep the file order.
+		template<typename Pipeline>
+		sequence<std::vector<typename pipeline_traits<Pipeline>::value_type>> _best_k(const Pipeline &pipeline, size_t k, bool largest) const{
+			typedef typename pipeline_traits<Pipeline>::value_type V;
+			std::vector<std::vector<V>> partial(_chunks.size());
+			_run([&](size_t i){
+				auto gen=pipeline(chunk(i));
+				partial[i]=largest ? gen.top_k(k) : gen.bottom_k(k);
+			});
+			detail::bounded_heap<V> heap(k, largest);
+			for (auto &p: partial)
+				for (auto &v: p)
+					heap.push({0, std::move(v)});
+			return heap.sorted();
+		}
+		template<typename Pipeline, typename F>
+		sequence<std::vector<typename pipeline_traits<Pipeline>::value_type>> _best_k(const Pipeline &pipeline, size_t k, bool largest, const F &key) const{
+			typedef typename pipeline_traits<Pipeline>::value_type V;
+			typedef typename std::decay<decltype(key(std::declval<V&>()))>::type K;
+			std::vector<std::vector<V>> partial(_chunks.size());
+			_run([&](size_t i){
+				auto gen=pipeline(chunk(i));
+				partial[i]=largest ? gen.top_k(k, key) : gen.bottom_k(k, key);
+			});
+			detail::bounded_heap<V, K> heap(k, largest);
+			for (auto &p: partial)
+				for (auto &v: p){
+					K kv=key(v);
+					heap.push({std::move(kv), 0, std::move(v)});
+				}
+			return heap.sorted();
+		}
+	};
+};
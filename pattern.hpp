@@ -0,0 +1,816 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include "string_ref.hpp"
+#include "searcher.hpp"
+
+namespace underscore{
+	/**
+	 * @short Result of pattern::exec. Group 0 is the full match, 1..n the capture groups.
+	 *
+	 * Groups are views into the matched string.
+	 */
+	class match_result{
+		string_ref _subject;
+		std::vector<ssize_t> _caps; // start, end for each group, -1 if not set
+	public:
+		match_result(){}
+		match_result(const string_ref &subject, std::vector<ssize_t> &&caps) : _subject(subject), _caps(std::move(caps)){}
+
+		explicit operator bool() const{ return !_caps.empty() && _caps[0]>=0; }
+		bool matched() const{ return bool(*this); }
+		/// Number of groups, including group 0.
+		size_t size() const{ return _caps.size()/2; }
+		bool matched(size_t n) const{ return 2*n<_caps.size() && _caps[2*n]>=0; }
+		string_ref operator[](size_t n) const{
+			if (!matched(n))
+				return string_ref();
+			return string_ref(_subject.data()+_caps[2*n], _caps[2*n+1]-_caps[2*n]);
+		}
+		ssize_t position(size_t n=0) const{ return matched(n) ? _caps[2*n] : -1; }
+	};
+
+	/**
+	 * @short Compiled pattern: globs and a practical regex subset, compiled once, matched in linear time.
+	 *
+	 * Supported regex syntax: literals, escapes (\\d \\w \\s \\D \\W \\S \\t \\n \\.), '.', classes ([a-z_], [^0-9]),
+	 * groups ((...) capturing, (?:...) not capturing), alternation '|', quantifiers '*', '+', '?', {m}, {m,}, {m,n}
+	 * (all of them greedy, or lazy with a '?' suffix), and '^' / '$' anchors.
+	 *
+	 * Regexes search anywhere in the string unless anchored. Globs ('*', '?', [abc], [!abc]) must match the full string.
+	 *
+	 * match() runs a lazily built DFA, after a SIMD literal prefilter when the pattern has a required literal.
+	 * exec() also returns the capture groups, using an NFA simulation (still linear) only when the DFA matched.
+	 *
+	 * It is a predicate, so it works directly at sequence and generator filters:
+	 *
+	 * 	file("/etc/services").filter(pattern::regex("^[a-z]+\\s+\\d+/tcp"))
+	 * 	_(files).filter(pattern::glob("*.log"))
+	 *
+	 * The DFA cache is mutable state: use one copy per thread.
+	 */
+	class pattern{
+	public:
+		class invalid_pattern : public std::exception{
+			std::string _msg;
+		public:
+			invalid_pattern(const std::string &msg) : _msg("Invalid pattern: "+msg){}
+			const char *what() const throw(){ return _msg.c_str(); };
+		};
+		/// Max DFA states cached. When reached the cache is flushed and rebuilt as needed.
+		static const size_t max_dfa_states=2048;
+		/// Max count at {m,n}, and max NFA instructions, so nested repetitions can not blow up the program.
+		static const int max_repeat=1000;
+		static const size_t max_program=100000;
+	private:
+		typedef std::bitset<256> charset;
+
+		// AST
+		struct node{
+			enum kind_t{ CHARS, CONCAT, ALT, REPEAT, GROUP, EMPTY, BOL, EOL } kind;
+			charset chars;
+			std::vector<int> kids;
+			int min, max; // REPEAT, max -1 is unbounded
+			bool greedy;
+			int group;    // GROUP, -1 if not capturing
+		};
+
+		// NFA program
+		struct inst{
+			enum op_t{ CHAR, SPLIT, JMP, SAVE, MATCH, BOL, EOL } op;
+			int x, y; // Jump targets, SAVE slot or charset index
+		};
+
+		struct dfa_state{
+			std::vector<int> pcs;
+			std::vector<int> next; // 256, -1 not computed yet
+			bool accept;           // MATCH reached
+			bool accept_at_end;    // MATCH reached if at the end of input
+		};
+
+		struct compiled{
+			std::vector<inst> prog;
+			std::vector<charset> sets;
+			int ngroups;
+			bool anchored_begin;
+			std::string literal;
+			bool pure_literal;
+		};
+
+		std::shared_ptr<const compiled> _c; // Shared between copies, immutable.
+		std::shared_ptr<const searcher> _prefilter;
+
+		// DFA cache, per copy.
+		mutable std::vector<dfa_state> _states;
+		mutable std::map<std::vector<int>, int> _state_index;
+		mutable int _start_state;
+		std::vector<int> _start_pcs; // Closure of the start, not at the begining of the input.
+
+		/// Parser state
+		struct parser{
+			const std::string &re;
+			size_t p;
+			std::vector<node> &nodes;
+			int ngroups;
+
+			parser(const std::string &_re, std::vector<node> &_nodes) : re(_re), p(0), nodes(_nodes), ngroups(0){}
+
+			int add(node::kind_t k){
+				node n;
+				n.kind=k; n.min=n.max=0; n.greedy=true; n.group=-1;
+				nodes.push_back(n);
+				return nodes.size()-1;
+			}
+			int add_chars(const charset &cs){
+				int n=add(node::CHARS);
+				nodes[n].chars=cs;
+				return n;
+			}
+			bool more() const{ return p<re.size(); }
+			char peek() const{ return re[p]; }
+			[[noreturn]] void fail(const std::string &what) const{
+				throw invalid_pattern(what+" at position "+std::to_string(p)+" of '"+re+"'");
+			}
+
+			static charset class_of(char c){
+				charset cs;
+				switch(c){
+					case 'd': case 'D':
+						for (int i='0';i<='9';++i) cs.set(i);
+						break;
+					case 'w': case 'W':
+						for (int i='0';i<='9';++i) cs.set(i);
+						for (int i='a';i<='z';++i) cs.set(i);
+						for (int i='A';i<='Z';++i) cs.set(i);
+						cs.set('_');
+						break;
+					case 's': case 'S':
+						for (char s: std::string(" \t\n\r\f\v")) cs.set((unsigned char)s);
+						break;
+				}
+				if (c=='D' || c=='W' || c=='S')
+					cs.flip();
+				return cs;
+			}
+			static bool is_class_escape(char c){
+				return c=='d' || c=='w' || c=='s' || c=='D' || c=='W' || c=='S';
+			}
+			/// Escaped punctuation is literal; letters and digits other than these (\b, \B, \1...) are not supported.
+			char escaped(char c) const{
+				switch(c){
+					case 't': return '\t';
+					case 'n': return '\n';
+					case 'r': return '\r';
+					case 'f': return '\f';
+					case 'v': return '\v';
+					case '0': return '\0';
+				}
+				if (isalnum((unsigned char)c))
+					fail(std::string("unsupported escape \\")+c);
+				return c;
+			}
+
+			int parse_alt(){
+				int first=parse_concat();
+				if (!more() || peek()!='|')
+					return first;
+				int alt=add(node::ALT);
+				nodes[alt].kids.push_back(first);
+				while (more() && peek()=='|'){
+					++p;
+					int k=parse_concat();
+					nodes[alt].kids.push_back(k);
+				}
+				return alt;
+			}
+			int parse_concat(){
+				int cat=add(node::CONCAT);
+				while (more() && peek()!='|' && peek()!=')'){
+					int k=parse_repeat();
+					nodes[cat].kids.push_back(k);
+				}
+				return cat;
+			}
+			int parse_int(){
+				if (!more() || !isdigit(peek()))
+					fail("expected number");
+				int n=0;
+				while (more() && isdigit(peek())){
+					n=n*10+(re[p++]-'0');
+					if (n>max_repeat)
+						fail("repetition count over "+std::to_string(max_repeat));
+				}
+				return n;
+			}
+			int parse_repeat(){
+				int atom=parse_atom();
+				while (more()){
+					int min, max;
+					char c=peek();
+					if (c=='*'){ min=0; max=-1; ++p; }
+					else if (c=='+'){ min=1; max=-1; ++p; }
+					else if (c=='?'){ min=0; max=1; ++p; }
+					else if (c=='{'){
+						++p;
+						min=max=parse_int();
+						if (more() && peek()==','){
+							++p;
+							max=(more() && peek()=='}') ? -1 : parse_int();
+						}
+						if (!more() || peek()!='}')
+							fail("expected }");
+						++p;
+						if (max>=0 && max<min)
+							fail("bad repetition range");
+					}
+					else
+						break;
+					int k=nodes[atom].kind;
+					if (k==node::BOL || k==node::EOL)
+						fail("nothing to repeat");
+					int r=add(node::REPEAT);
+					nodes[r].kids.push_back(atom);
+					nodes[r].min=min;
+					nodes[r].max=max;
+					if (more() && peek()=='?'){
+						nodes[r].greedy=false;
+						++p;
+					}
+					atom=r;
+				}
+				return atom;
+			}
+			int parse_class(){
+				// p is after '['
+				charset cs;
+				bool negate=false;
+				if (more() && peek()=='^'){
+					negate=true;
+					++p;
+				}
+				bool first=true;
+				while (more() && (peek()!=']' || first)){
+					first=false;
+					char c=re[p++];
+					if (c=='\\'){
+						if (!more())
+							fail("trailing \\");
+						char e=re[p++];
+						if (is_class_escape(e)){
+							cs|=class_of(e);
+							continue;
+						}
+						c=escaped(e);
+					}
+					if (more() && peek()=='-' && p+1<re.size() && re[p+1]!=']'){
+						++p;
+						char to=re[p++];
+						if (to=='\\'){
+							if (!more())
+								fail("trailing \\");
+							to=escaped(re[p++]);
+						}
+						if ((unsigned char)to<(unsigned char)c)
+							fail("bad class range");
+						for (int i=(unsigned char)c;i<=(unsigned char)to;++i)
+							cs.set(i);
+					}
+					else
+						cs.set((unsigned char)c);
+				}
+				if (!more())
+					fail("unterminated [");
+				++p; // ]
+				if (negate)
+					cs.flip();
+				return add_chars(cs);
+			}
+			int parse_atom(){
+				char c=re[p++];
+				switch(c){
+					case '(':{
+						int g=add(node::GROUP);
+						if (p+1<re.size() && re[p]=='?' && re[p+1]==':')
+							p+=2;
+						else
+							nodes[g].group=++ngroups;
+						int body=parse_alt();
+						nodes[g].kids.push_back(body);
+						if (!more() || peek()!=')')
+							fail("unterminated (");
+						++p;
+						return g;
+					}
+					case '[':
+						return parse_class();
+					case '.':{
+						charset cs;
+						cs.set();
+						cs.reset('\n');
+						return add_chars(cs);
+					}
+					case '^':
+						return add(node::BOL);
+					case '$':
+						return add(node::EOL);
+					case '*': case '+': case '?': case '{':
+						fail("nothing to repeat");
+					case ')':
+						fail("unbalanced )");
+					case '\\':{
+						if (!more())
+							fail("trailing \\");
+						char e=re[p++];
+						if (is_class_escape(e))
+							return add_chars(class_of(e));
+						charset cs;
+						cs.set((unsigned char)escaped(e));
+						return add_chars(cs);
+					}
+				}
+				charset cs;
+				cs.set((unsigned char)c);
+				return add_chars(cs);
+			}
+		};
+
+		/// NFA compiler
+		struct emitter{
+			const std::vector<node> &nodes;
+			compiled &c;
+
+			int emit(inst::op_t op, int x=0, int y=0){
+				if (c.prog.size()>=max_program)
+					throw invalid_pattern("too large, over "+std::to_string(max_program)+" instructions");
+				inst i;
+				i.op=op; i.x=x; i.y=y;
+				c.prog.push_back(i);
+				return c.prog.size()-1;
+			}
+			int pc() const{ return c.prog.size(); }
+
+			void compile(int n){
+				const node &nd=nodes[n];
+				switch(nd.kind){
+					case node::CHARS:
+						c.sets.push_back(nd.chars);
+						emit(inst::CHAR, c.sets.size()-1);
+						break;
+					case node::CONCAT:
+						for (int k: nd.kids)
+							compile(k);
+						break;
+					case node::ALT:{
+						std::vector<int> jumps;
+						for (size_t i=0;i+1<nd.kids.size();++i){
+							int split=emit(inst::SPLIT);
+							c.prog[split].x=pc();
+							compile(nd.kids[i]);
+							jumps.push_back(emit(inst::JMP));
+							c.prog[split].y=pc();
+						}
+						compile(nd.kids.back());
+						for (int j: jumps)
+							c.prog[j].x=pc();
+						break;
+					}
+					case node::GROUP:
+						if (nd.group>=0)
+							emit(inst::SAVE, 2*nd.group);
+						compile(nd.kids[0]);
+						if (nd.group>=0)
+							emit(inst::SAVE, 2*nd.group+1);
+						break;
+					case node::REPEAT:{
+						int body=nd.kids[0];
+						for (int i=0;i<nd.min;++i)
+							compile(body);
+						if (nd.max<0){ // Star
+							int split=emit(inst::SPLIT);
+							compile(body);
+							emit(inst::JMP, split);
+							set_split(split, split+1, pc(), nd.greedy);
+						}
+						else{ // Optionals, nested: (x(x(x)?)?)?
+							std::vector<int> splits;
+							for (int i=nd.min;i<nd.max;++i){
+								splits.push_back(emit(inst::SPLIT));
+								compile(body);
+							}
+							for (int s: splits)
+								set_split(s, s+1, pc(), nd.greedy);
+						}
+						break;
+					}
+					case node::BOL:
+						emit(inst::BOL);
+						break;
+					case node::EOL:
+						emit(inst::EOL);
+						break;
+					case node::EMPTY:
+						break;
+				}
+			}
+			void set_split(int s, int body, int out, bool greedy){
+				c.prog[s].x=greedy ? body : out;
+				c.prog[s].y=greedy ? out : body;
+			}
+		};
+
+		/// Longest literal that any match must contain, for the prefilter.
+		static std::string _required_literal(const std::vector<node> &nodes, int n){
+			const node &nd=nodes[n];
+			switch(nd.kind){
+				case node::CHARS:
+					if (nd.chars.count()==1){
+						for (int i=0;i<256;++i)
+							if (nd.chars.test(i))
+								return std::string(1, char(i));
+					}
+					return std::string();
+				case node::GROUP:
+					return _required_literal(nodes, nd.kids[0]);
+				case node::REPEAT:
+					if (nd.min>0)
+						return _required_literal(nodes, nd.kids[0]);
+					return std::string();
+				case node::CONCAT:{
+					std::string best, run;
+					for (int k: nd.kids){
+						const node &kn=nodes[k];
+						if (kn.kind==node::CHARS && kn.chars.count()==1){
+							run+=_required_literal(nodes, k);
+							continue;
+						}
+						if (kn.kind==node::BOL || kn.kind==node::EOL)
+							continue; // Zero width, the run goes on
+						if (run.size()>best.size())
+							best=run;
+						run.clear();
+						auto sub=_required_literal(nodes, k);
+						if (sub.size()>best.size())
+							best=sub;
+					}
+					if (run.size()>best.size())
+						best=run;
+					return best;
+				}
+				default:
+					return std::string();
+			}
+		}
+		static bool _is_pure_literal(const std::vector<node> &nodes, int n){
+			const node &nd=nodes[n];
+			if (nd.kind==node::CHARS)
+				return nd.chars.count()==1;
+			if (nd.kind==node::CONCAT){
+				for (int k: nd.kids)
+					if (!_is_pure_literal(nodes, k))
+						return false;
+				return true;
+			}
+			return false;
+		}
+
+		void _compile(const std::string &re){
+			auto c=std::make_shared<compiled>();
+			std::vector<node> nodes;
+			parser ps(re, nodes);
+			int root=ps.parse_alt();
+			if (ps.more())
+				ps.fail("unbalanced )");
+			c->ngroups=ps.ngroups;
+			c->literal=_required_literal(nodes, root);
+			c->pure_literal=_is_pure_literal(nodes, root);
+			const node &rn=nodes[root];
+			c->anchored_begin=(rn.kind==node::CONCAT && !rn.kids.empty() && nodes[rn.kids[0]].kind==node::BOL);
+
+			emitter em{nodes, *c};
+			em.emit(inst::SAVE, 0);
+			em.compile(root);
+			em.emit(inst::SAVE, 1);
+			em.emit(inst::MATCH);
+			_c=c;
+			if (!c->literal.empty())
+				_prefilter=std::make_shared<searcher>(c->literal);
+			_start_pcs=_closure(std::vector<int>{0}, false);
+			_dfa_flush();
+		}
+
+		/// Epsilon closure, keeps CHAR, MATCH and EOL instructions.
+		std::vector<int> _closure(const std::vector<int> &from, bool at_begin, bool at_end=false) const{
+			const auto &prog=_c->prog;
+			std::vector<char> seen(prog.size(), 0);
+			std::vector<int> stack(from.rbegin(), from.rend()), out;
+			while (!stack.empty()){
+				int pc=stack.back();
+				stack.pop_back();
+				if (seen[pc])
+					continue;
+				seen[pc]=1;
+				const inst &i=prog[pc];
+				switch(i.op){
+					case inst::CHAR: case inst::MATCH:
+						out.push_back(pc);
+						break;
+					case inst::EOL:
+						if (at_end)
+							stack.push_back(pc+1);
+						else
+							out.push_back(pc);
+						break;
+					case inst::BOL:
+						if (at_begin)
+							stack.push_back(pc+1);
+						break;
+					case inst::JMP:
+						stack.push_back(i.x);
+						break;
+					case inst::SPLIT:
+						stack.push_back(i.y);
+						stack.push_back(i.x);
+						break;
+					case inst::SAVE:
+						stack.push_back(pc+1);
+						break;
+				}
+			}
+			std::sort(out.begin(), out.end());
+			return out;
+		}
+
+		void _dfa_flush() const{
+			_states.clear();
+			_state_index.clear();
+			_start_state=-1;
+		}
+		int _dfa_state(std::vector<int> &&pcs) const{
+			auto I=_state_index.find(pcs);
+			if (I!=_state_index.end())
+				return I->second;
+			dfa_state st;
+			st.accept=false;
+			for (int pc: pcs)
+				if (_c->prog[pc].op==inst::MATCH)
+					st.accept=true;
+			st.accept_at_end=st.accept;
+			if (!st.accept){
+				for (int pc: _closure(pcs, false, true))
+					if (_c->prog[pc].op==inst::MATCH)
+						st.accept_at_end=true;
+			}
+			st.next.assign(256, -1);
+			st.pcs=pcs;
+			_states.push_back(std::move(st));
+			int n=_states.size()-1;
+			_state_index[std::move(pcs)]=n;
+			return n;
+		}
+		/// Computes a missing transition. If the cache is full it is flushed first, and cur is renumbered.
+		int _dfa_step(int &cur, unsigned char c) const{
+			if (_states.size()>=max_dfa_states){
+				auto pcs=_states[cur].pcs;
+				_dfa_flush();
+				cur=_dfa_state(std::move(pcs));
+			}
+			std::vector<int> next;
+			for (int pc: _states[cur].pcs){
+				const inst &i=_c->prog[pc];
+				if (i.op==inst::CHAR && _c->sets[i.x].test(c))
+					next.push_back(pc+1);
+			}
+			auto cl=_closure(next, false);
+			if (!_c->anchored_begin){ // Search: a new match can start at any position
+				cl.insert(cl.end(), _start_pcs.begin(), _start_pcs.end());
+				std::sort(cl.begin(), cl.end());
+				cl.erase(std::unique(cl.begin(), cl.end()), cl.end());
+			}
+			int n=_dfa_state(std::move(cl));
+			_states[cur].next[c]=n;
+			return n;
+		}
+
+		bool _dfa_match(const string_ref &s) const{
+			if (_start_state<0)
+				_start_state=_dfa_state(_closure(std::vector<int>{0}, true));
+			int cur=_start_state;
+			if (_states[cur].accept || (s.empty() && _states[cur].accept_at_end))
+				return true;
+			const unsigned char *p=(const unsigned char*)s.data(), *end=p+s.size();
+			for (;p<end;++p){
+				int n=_states[cur].next[*p];
+				if (n<0)
+					n=_dfa_step(cur, *p);
+				cur=n;
+				const dfa_state &st=_states[cur];
+				if (st.accept)
+					return true;
+				if (st.pcs.empty()) // Dead, only when anchored
+					return false;
+			}
+			return _states[cur].accept_at_end;
+		}
+
+		/// Pike VM, leftmost first with captures.
+		struct thread{
+			int pc;
+			std::shared_ptr<std::vector<ssize_t>> caps;
+		};
+		/// Follows jumps depth first with an explicit stack, so long SPLIT chains can not overflow the call stack.
+		void _add_thread(std::vector<thread> &list, std::vector<int> &seen, int gen, int pc, std::shared_ptr<std::vector<ssize_t>> caps, ssize_t pos, size_t len) const{
+			std::vector<thread> stack{thread{pc, std::move(caps)}};
+			while (!stack.empty()){
+				thread t=std::move(stack.back());
+				stack.pop_back();
+				if (seen[t.pc]==gen)
+					continue;
+				seen[t.pc]=gen;
+				const inst &i=_c->prog[t.pc];
+				switch(i.op){
+					case inst::JMP:
+						stack.push_back(thread{i.x, std::move(t.caps)});
+						break;
+					case inst::SPLIT: // x has priority, so it goes on top
+						stack.push_back(thread{i.y, t.caps});
+						stack.push_back(thread{i.x, std::move(t.caps)});
+						break;
+					case inst::SAVE:{
+						auto nc=std::make_shared<std::vector<ssize_t>>(*t.caps);
+						(*nc)[i.x]=pos;
+						stack.push_back(thread{t.pc+1, nc});
+						break;
+					}
+					case inst::BOL:
+						if (pos==0)
+							stack.push_back(thread{t.pc+1, std::move(t.caps)});
+						break;
+					case inst::EOL:
+						if (size_t(pos)==len)
+							stack.push_back(thread{t.pc+1, std::move(t.caps)});
+						break;
+					default:
+						list.push_back(std::move(t));
+				}
+			}
+		}
+		std::vector<ssize_t> _pike(const string_ref &s) const{
+			const auto &prog=_c->prog;
+			const size_t nslots=2*(_c->ngroups+1);
+			std::vector<thread> clist, nlist;
+			std::vector<int> seen(prog.size(), -1);
+			std::shared_ptr<std::vector<ssize_t>> matched;
+			auto empty_caps=std::make_shared<std::vector<ssize_t>>(nslots, -1);
+			for (size_t pos=0;;++pos){
+				int gen=pos;
+				if (!matched && (pos==0 || !_c->anchored_begin))
+					_add_thread(clist, seen, gen, 0, empty_caps, pos, s.size()); // Lowest priority
+				if (clist.empty())
+					break;
+				nlist.clear();
+				for (size_t t=0;t<clist.size();++t){
+					const inst &i=prog[clist[t].pc];
+					if (i.op==inst::MATCH){
+						matched=clist[t].caps;
+						break; // Lower priority threads are cut
+					}
+					if (pos<s.size() && _c->sets[i.x].test((unsigned char)s[pos]))
+						_add_thread(nlist, seen, gen+1, clist[t].pc+1, clist[t].caps, pos+1, s.size());
+				}
+				if (pos>=s.size())
+					break;
+				std::swap(clist, nlist);
+			}
+			if (matched)
+				return *matched;
+			return std::vector<ssize_t>();
+		}
+	public:
+		pattern(){ _compile(""); }
+		/**
+		 * @short Compiles a regex.
+		 */
+		explicit pattern(const std::string &regex){ _compile(regex); }
+		explicit pattern(const char *regex){ _compile(regex); }
+
+		/// Copies share the compiled program, but not the DFA cache.
+		pattern(const pattern &o) : _c(o._c), _prefilter(o._prefilter), _start_state(-1), _start_pcs(o._start_pcs){}
+		pattern &operator=(const pattern &o){
+			_c=o._c;
+			_prefilter=o._prefilter;
+			_start_pcs=o._start_pcs;
+			_dfa_flush();
+			return *this;
+		}
+
+		static pattern regex(const std::string &re){
+			return pattern(re);
+		}
+		/**
+		 * @short Compiles a shell like glob: '*' any string, '?' any char, [abc] and [!abc] classes. Must match the full string.
+		 */
+		static pattern glob(const std::string &g){
+			std::string re="^";
+			for (size_t i=0;i<g.size();++i){
+				char c=g[i];
+				switch(c){
+					case '*':
+						re+="[\\s\\S]*";
+						break;
+					case '?':
+						re+="[\\s\\S]";
+						break;
+					case '[':{
+						size_t j=i+1;
+						bool negate=j<g.size() && g[j]=='!';
+						if (negate)
+							++j;
+						// As in fnmatch, a ']' right after '[' or '[!' is a literal, not the end
+						size_t end=g.find(']', j+1);
+						if (end==std::string::npos){
+							re+="\\[";
+							break;
+						}
+						re+='[';
+						if (negate)
+							re+='^';
+						for (;j<end;++j){
+							if (g[j]=='\\' || g[j]=='[' || g[j]==']' || g[j]=='^')
+								re+='\\';
+							re+=g[j];
+						}
+						re+=']';
+						i=end;
+						break;
+					}
+					case '\\':
+						if (i+1<g.size())
+							c=g[++i];
+						// fallthrough
+					default:
+						if (!isalnum((unsigned char)c))
+							re+='\\';
+						re+=c;
+				}
+			}
+			re+='$';
+			return pattern(re);
+		}
+
+		/// Number of capture groups, without group 0.
+		int groups() const{ return _c->ngroups; }
+		/// Literal every match contains, used as prefilter. May be empty.
+		const std::string &required_literal() const{ return _c->literal; }
+
+		/**
+		 * @short Checks if the pattern matches s. Linear time, no allocations once the DFA is warm.
+		 */
+		bool match(const string_ref &s) const{
+			if (_prefilter){
+				if (_prefilter->find(s.data(), s.size())<0)
+					return false;
+				if (_c->pure_literal)
+					return true;
+			}
+			return _dfa_match(s);
+		}
+		/**
+		 * @short Matches and returns the capture groups as views into s.
+		 */
+		match_result exec(const string_ref &s) const{
+			if (!match(s))
+				return match_result();
+			return match_result(s, _pike(s));
+		}
+
+		bool operator()(const string_ref &s) const{
+			return match(s);
+		}
+	};
+
+	inline bool string_ref::match(const pattern &p) const{
+		return p.match(*this);
+	}
+};
@@ -0,0 +1,506 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <exception>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+#include "generator.hpp"
+#include "string_ref.hpp"
+
+namespace underscore{
+	namespace detail{
+		/**
+		 * @short Reads a file as a sequence of blocks, some of them ahead of time.
+		 *
+		 * next_block returns the blocks in order. The previous block buffer is reused once next_block is called again.
+		 */
+		class block_prefetcher{
+		protected:
+			size_t _block_size;
+			size_t _depth;
+			std::vector<std::unique_ptr<char[]>> _buffers; // One per block in flight
+
+			block_prefetcher(size_t block_size, size_t depth) : _block_size(block_size), _depth(depth){
+				for (size_t i=0;i<depth;++i)
+					_buffers.push_back(std::unique_ptr<char[]>(new char[block_size]));
+			}
+
+			/**
+			 * @short Reads until the buffer is full or end of file. Uses pread if offset>=0. Throws
+			 * std::runtime_error on read errors.
+			 *
+			 * Else, as for pipes, it waits for data with poll, and returns -1 as soon as wake is readable.
+			 */
+			static ssize_t _read_full(int fd, char *buf, size_t size, off_t offset, int wake=-1){
+				size_t done=0;
+				while (done<size){
+					if (offset<0 && wake>=0){
+						struct pollfd p[2]={{fd, POLLIN, 0}, {wake, POLLIN, 0}};
+						if (poll(p, 2, -1)<0 && errno!=EINTR)
+							throw std::runtime_error(std::string("Can not read: ")+strerror(errno));
+						if (p[1].revents)
+							return -1;
+						if (!p[0].revents)
+							continue;
+					}
+					ssize_t n=(offset>=0) ? ::pread(fd, buf+done, size-done, offset+done) : ::read(fd, buf+done, size-done);
+					if (n>0){
+						done+=n;
+						continue;
+					}
+					if (n==0)
+						break;
+					if (errno==EINTR)
+						continue;
+					if (errno==EAGAIN || errno==EWOULDBLOCK){ // Nonblocking fd, wait for data
+						struct pollfd p={fd, POLLIN, 0};
+						poll(&p, 1, -1);
+						continue;
+					}
+					throw std::runtime_error(std::string("Can not read: ")+strerror(errno));
+				}
+				return done;
+			}
+		public:
+			virtual ~block_prefetcher(){}
+			virtual bool next_block(const char *&data, size_t &size)=0;
+		};
+
+		/**
+		 * @short Prefetcher with a thread doing pread (or read, for pipes) of the next depth blocks.
+		 *
+		 * Read errors are rethrown at next_block, after the blocks read before. Reads of pipes wait with poll
+		 * on an eventfd too, so the destructor does not wait for a writer.
+		 */
+		class thread_prefetcher : public block_prefetcher{
+			int _fd;
+			bool _seekable;
+			std::vector<size_t> _sizes;
+			std::mutex _mutex;
+			std::condition_variable _cv;
+			size_t _produced; // Blocks read
+			size_t _released; // Blocks whose buffer can be reused
+			size_t _consumed; // Blocks given to the consumer
+			bool _done, _stop;
+			std::exception_ptr _error;
+			int _wake; // eventfd, stops a read waiting for a pipe
+			std::thread _thread;
+
+			void _producer(){
+				try{
+					for (size_t blk=0;;++blk){
+						{
+							std::unique_lock<std::mutex> lock(_mutex);
+							_cv.wait(lock, [&]{ return _stop || blk<_released+_depth; });
+							if (_stop)
+								return;
+						}
+						size_t slot=blk%_depth;
+						ssize_t n=_read_full(_fd, _buffers[slot].get(), _block_size, _seekable ? off_t(blk*_block_size) : -1, _wake);
+						if (n<0) // Stopped
+							return;
+						std::lock_guard<std::mutex> lock(_mutex);
+						_sizes[slot]=n;
+						if (n>0)
+							_produced=blk+1;
+						if (size_t(n)<_block_size)
+							_done=true;
+						_cv.notify_all();
+						if (_done)
+							return;
+					}
+				}
+				catch(...){
+					std::lock_guard<std::mutex> lock(_mutex);
+					_error=std::current_exception();
+					_done=true;
+					_cv.notify_all();
+				}
+			}
+		public:
+			thread_prefetcher(int fd, size_t block_size, size_t depth)
+					: block_prefetcher(block_size, depth), _fd(fd), _sizes(depth, 0), _produced(0), _released(0), _consumed(0), _done(false), _stop(false){
+				struct stat st;
+				_seekable=(fstat(fd, &st)==0 && S_ISREG(st.st_mode));
+				_wake=_seekable ? -1 : eventfd(0, EFD_CLOEXEC);
+				_thread=std::thread([this]{ _producer(); });
+			}
+			~thread_prefetcher(){
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					_stop=true;
+					_cv.notify_all();
+				}
+				uint64_t v=1;
+				if (_wake>=0 && ::write(_wake, &v, sizeof(v))<0){}
+				_thread.join();
+				if (_wake>=0)
+					::close(_wake);
+			}
+
+			bool next_block(const char *&data, size_t &size) override{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_released=_consumed; // Previous block is not used anymore
+				_cv.notify_all();
+				_cv.wait(lock, [&]{ return _done || _produced>_consumed; });
+				if (_consumed>=_produced){
+					if (_error){
+						auto e=_error;
+						_error=nullptr;
+						std::rethrow_exception(e);
+					}
+					return false;
+				}
+				size_t slot=_consumed%_depth;
+				data=_buffers[slot].get();
+				size=_sizes[slot];
+				++_consumed;
+				return true;
+			}
+		};
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+		/**
+		 * @short Prefetcher that keeps depth reads in flight with io_uring, using the raw system calls.
+		 *
+		 * Only for regular files. Reads that fail (for example kernels without IORING_OP_READ) or are short are
+		 * redone with pread. If a submission fails the ring is not used anymore: the rest is read with pread.
+		 */
+		class uring_prefetcher : public block_prefetcher{
+			int _fd;
+			int _ring;
+			size_t _file_size;
+			size_t _nblocks;
+			size_t _submitted, _consumed;
+			bool _broken; // A submission failed, pread from then on
+			std::vector<ssize_t> _results;
+			enum{ pending=-1-4096 }; // Not a valid -errno
+
+			void *_sq_ptr, *_cq_ptr;
+			size_t _sq_len, _cq_len, _sqes_len;
+			unsigned *_sq_head, *_sq_tail, *_sq_mask, *_sq_array;
+			unsigned *_cq_head, *_cq_tail, *_cq_mask;
+			struct io_uring_sqe *_sqes;
+			struct io_uring_cqe *_cqes;
+
+			static int _enter(int ring, unsigned to_submit, unsigned min_complete, unsigned flags){
+				return syscall(__NR_io_uring_enter, ring, to_submit, min_complete, flags, nullptr, 0);
+			}
+
+			uring_prefetcher(int fd, size_t block_size, size_t depth, size_t file_size)
+					: block_prefetcher(block_size, depth), _fd(fd), _ring(-1), _file_size(file_size),
+					  _nblocks((file_size+block_size-1)/block_size), _submitted(0), _consumed(0), _broken(false), _results(depth, 0),
+					  _sq_ptr(MAP_FAILED), _cq_ptr(MAP_FAILED), _sq_len(0), _cq_len(0), _sqes_len(0), _sqes((struct io_uring_sqe*)MAP_FAILED){}
+
+			bool _setup(){
+				struct io_uring_params p;
+				memset(&p, 0, sizeof(p));
+				_ring=syscall(__NR_io_uring_setup, unsigned(_depth), &p);
+				if (_ring<0)
+					return false;
+				_sq_len=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+				_cq_len=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+				bool single=(p.features & IORING_FEAT_SINGLE_MMAP);
+				if (single)
+					_sq_len=_cq_len=std::max(_sq_len, _cq_len);
+				_sq_ptr=mmap(nullptr, _sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+				if (_sq_ptr==MAP_FAILED)
+					return false;
+				_cq_ptr=single ? _sq_ptr : mmap(nullptr, _cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+				if (_cq_ptr==MAP_FAILED)
+					return false;
+				_sqes_len=p.sq_entries*sizeof(struct io_uring_sqe);
+				_sqes=(struct io_uring_sqe*)mmap(nullptr, _sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _ring, IORING_OFF_SQES);
+				if (_sqes==MAP_FAILED)
+					return false;
+				char *sq=(char*)_sq_ptr, *cq=(char*)_cq_ptr;
+				_sq_head=(unsigned*)(sq+p.sq_off.head);
+				_sq_tail=(unsigned*)(sq+p.sq_off.tail);
+				_sq_mask=(unsigned*)(sq+p.sq_off.ring_mask);
+				_sq_array=(unsigned*)(sq+p.sq_off.array);
+				_cq_head=(unsigned*)(cq+p.cq_off.head);
+				_cq_tail=(unsigned*)(cq+p.cq_off.tail);
+				_cq_mask=(unsigned*)(cq+p.cq_off.ring_mask);
+				_cqes=(struct io_uring_cqe*)(cq+p.cq_off.cqes);
+				return true;
+			}
+
+			size_t _expected(size_t blk) const{
+				return std::min(_block_size, _file_size-blk*_block_size);
+			}
+
+			void _submit(size_t blk){
+				size_t slot=blk%_depth;
+				if (_broken){
+					_results[slot]=_read_full(_fd, _buffers[slot].get(), _expected(blk), blk*_block_size);
+					++_submitted;
+					return;
+				}
+				unsigned tail=*_sq_tail;
+				unsigned idx=tail & *_sq_mask;
+				struct io_uring_sqe *sqe=&_sqes[idx];
+				memset(sqe, 0, sizeof(*sqe));
+				sqe->opcode=IORING_OP_READ;
+				sqe->fd=_fd;
+				sqe->addr=(uint64_t)(uintptr_t)_buffers[slot].get();
+				sqe->len=_expected(blk);
+				sqe->off=blk*_block_size;
+				sqe->user_data=blk;
+				_sq_array[idx]=idx;
+				__atomic_store_n(_sq_tail, tail+1, __ATOMIC_RELEASE);
+				_results[slot]=pending;
+				int r;
+				while ((r=_enter(_ring, 1, 0, 0))<0 && errno==EINTR)
+					;
+				if (r<1){
+					// Not submitted. If the kernel did not take it, take it back, so it never reads into the
+					// buffer later, and read it now; else its completion is waited for as any other.
+					_broken=true;
+					if (__atomic_load_n(_sq_head, __ATOMIC_ACQUIRE)==tail){
+						__atomic_store_n(_sq_tail, tail, __ATOMIC_RELEASE);
+						_results[slot]=_read_full(_fd, _buffers[slot].get(), _expected(blk), blk*_block_size);
+					}
+				}
+				++_submitted;
+			}
+
+			void _reap(){
+				unsigned head=*_cq_head;
+				unsigned tail=__atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+				for (;head!=tail;++head){
+					struct io_uring_cqe *cqe=&_cqes[head & *_cq_mask];
+					_results[cqe->user_data%_depth]=cqe->res;
+				}
+				__atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+			}
+
+			bool _in_flight() const{
+				for (auto r: _results)
+					if (r==pending)
+						return true;
+				return false;
+			}
+		public:
+			/**
+			 * @short Creates the prefetcher, or returns null if io_uring is not available.
+			 */
+			static std::unique_ptr<block_prefetcher> create(int fd, size_t block_size, size_t depth){
+				struct stat st;
+				if (fstat(fd, &st)!=0 || !S_ISREG(st.st_mode))
+					return nullptr;
+				std::unique_ptr<uring_prefetcher> p(new uring_prefetcher(fd, block_size, depth, st.st_size));
+				if (!p->_setup())
+					return nullptr;
+				while (p->_submitted<std::min(p->_nblocks, depth))
+					p->_submit(p->_submitted);
+				return std::unique_ptr<block_prefetcher>(p.release());
+			}
+			~uring_prefetcher(){
+				if (_ring>=0){
+					while (_in_flight()){ // The kernel may still write at the buffers
+						_reap();
+						if (_in_flight())
+							_enter(_ring, 0, 1, IORING_ENTER_GETEVENTS);
+					}
+				}
+				if (_sqes!=MAP_FAILED)
+					munmap(_sqes, _sqes_len);
+				if (_cq_ptr!=MAP_FAILED && _cq_ptr!=_sq_ptr)
+					munmap(_cq_ptr, _cq_len);
+				if (_sq_ptr!=MAP_FAILED)
+					munmap(_sq_ptr, _sq_len);
+				if (_ring>=0)
+					::close(_ring);
+			}
+
+			bool next_block(const char *&data, size_t &size) override{
+				if (_consumed>0 && _submitted<_nblocks) // Buffer of the previous block is free
+					_submit(_submitted);
+				if (_consumed>=_nblocks)
+					return false;
+				size_t slot=_consumed%_depth;
+				while (_results[slot]==pending){
+					_reap();
+					if (_results[slot]==pending)
+						_enter(_ring, 0, 1, IORING_ENTER_GETEVENTS);
+				}
+				size_t expected=_expected(_consumed);
+				ssize_t n=_results[slot];
+				if (n<0)
+					n=0;
+				if (size_t(n)<expected) // Failed or short read, complete it synchronously
+					n+=_read_full(_fd, _buffers[slot].get()+n, expected-n, _consumed*_block_size+n);
+				data=_buffers[slot].get();
+				size=n;
+				++_consumed;
+				return n>0;
+			}
+		};
+#endif
+	};
+
+	/**
+	 * @short Generator of the lines of a file, reading the next blocks while the current one is processed.
+	 *
+	 * Keeps depth reads of block_size bytes in flight, so parsing block k overlaps the read of the next ones.
+	 * Uses io_uring when available, or a thread doing pread when not (old kernels, sandboxes, pipes).
+	 *
+	 * Lines are views into the block buffers, or into an internal buffer for the lines that straddle two
+	 * blocks. Each view is valid until the next call to next().
+	 *
+	 * Example:
+	 *
+	 * 	prefetch_file("/cold/storage/huge.log", 4*1024*1024, 8)
+	 * 		.filter(searcher("ERROR"))
+	 */
+	class prefetch_file : public generator<prefetch_file, string_ref>{
+	public:
+		enum backend_type{
+			automatic=0,
+			uring,
+			thread
+		};
+		static const size_t default_block_size=1024*1024;
+		static const size_t default_depth=4;
+	private:
+		int _fd;
+		bool _own_fd;
+		backend_type _backend;
+		std::unique_ptr<detail::block_prefetcher> _prefetcher;
+		const char *_pos, *_end;
+		std::string _carry, _line;
+
+		void _init(backend_type backend, size_t block_size, size_t depth){
+			block_size=std::max<size_t>(block_size, 1);
+			depth=std::max<size_t>(depth, 2);
+			if (_fd<0)
+				return;
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+			if (backend!=thread){
+				_prefetcher=detail::uring_prefetcher::create(_fd, block_size, depth);
+				if (_prefetcher){
+					_backend=uring;
+					return;
+				}
+			}
+#endif
+			_prefetcher.reset(new detail::thread_prefetcher(_fd, block_size, depth));
+			_backend=thread;
+		}
+	public:
+		/**
+		 * @short Opens the file. With automatic backend io_uring is tried first.
+		 */
+		explicit prefetch_file(const std::string &path, size_t block_size=default_block_size, size_t depth=default_depth, backend_type backend=automatic)
+				: _fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC)), _own_fd(true), _backend(automatic), _pos(nullptr), _end(nullptr){
+			_init(backend, block_size, depth);
+		}
+		/**
+		 * @short Reads an already open file descriptor. It is not closed.
+		 */
+		explicit prefetch_file(int fd, size_t block_size=default_block_size, size_t depth=default_depth, backend_type backend=automatic)
+				: _fd(fd), _own_fd(false), _backend(automatic), _pos(nullptr), _end(nullptr){
+			_init(backend, block_size, depth);
+		}
+		prefetch_file(prefetch_file &&o) : _fd(o._fd), _own_fd(o._own_fd), _backend(o._backend), _prefetcher(std::move(o._prefetcher)),
+				_pos(o._pos), _end(o._end), _carry(std::move(o._carry)), _line(std::move(o._line)){
+			o._fd=-1;
+			o._own_fd=false;
+		}
+		prefetch_file(const prefetch_file &)=delete;
+		prefetch_file &operator=(const prefetch_file &)=delete;
+		~prefetch_file(){
+			_prefetcher.reset(); // Stop reads before closing the fd
+			if (_own_fd && _fd>=0)
+				::close(_fd);
+		}
+
+		bool next(string_ref &out){
+			_line.clear();
+			for(;;){
+				if (_pos<_end){
+					const char *nl=(const char*)memchr(_pos, '\n', _end-_pos);
+					if (nl){
+						if (_carry.empty())
+							out=string_ref(_pos, nl);
+						else{
+							_carry.append(_pos, nl);
+							_line.swap(_carry);
+							_carry.clear();
+							out=string_ref(_line);
+						}
+						_pos=nl+1;
+						return true;
+					}
+					_carry.append(_pos, _end);
+				}
+				const char *data;
+				size_t size;
+				if (!_prefetcher || !_prefetcher->next_block(data, size)){
+					_pos=_end=nullptr;
+					if (_carry.empty())
+						return false;
+					_line.swap(_carry); // Last line, without newline
+					_carry.clear();
+					out=string_ref(_line);
+					return true;
+				}
+				_pos=data;
+				_end=data+size;
+			}
+		}
+
+		/**
+		 * @short Lines already at the current block, so the views stay valid until the next call. At least
+		 * one unless at the end.
+		 */
+		size_t next_batch(string_ref *out, size_t n){
+			if (n==0 || !next(out[0]))
+				return 0;
+			size_t i=1;
+			while (i<n && _pos<_end){
+				const char *nl=(const char*)memchr(_pos, '\n', _end-_pos);
+				if (!nl)
+					break;
+				out[i++]=string_ref(_pos, nl);
+				_pos=nl+1;
+			}
+			return i;
+		}
+
+		bool is_open() const{ return _fd>=0; }
+		/// Backend in use: uring or thread.
+		backend_type backend() const{ return _backend; }
+	};
+};
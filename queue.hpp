@@ -0,0 +1,221 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <exception>
+#include <sys/types.h>
+
+namespace underscore{
+	namespace detail{
+		inline size_t _round_pow2(size_t n){
+			size_t r=2;
+			while (r<n)
+				r<<=1;
+			return r;
+		}
+
+		/// First exception of a set of threads. failed is set once error can be read.
+		struct thread_error{
+			std::atomic<bool> claimed, failed;
+			std::exception_ptr error;
+			thread_error() : claimed(false), failed(false){}
+
+			void set(std::exception_ptr e){
+				if (!claimed.exchange(true)){
+					error=e;
+					failed.store(true, std::memory_order_release);
+				}
+			}
+			/// Rethrows the error only once, later calls just return false.
+			bool rethrow(){
+				if (!failed.load(std::memory_order_acquire))
+					return false;
+				if (error){
+					auto e=error;
+					error=nullptr;
+					std::rethrow_exception(e);
+				}
+				return true;
+			}
+		};
+	};
+
+	/**
+	 * @short Waits for a lock free queue: spins a little, then yields, then sleeps, so a waiting thread
+	 * does not take the core from the one it waits for.
+	 */
+	class backoff{
+		unsigned _n;
+	public:
+		backoff() : _n(0){}
+		void pause(){
+			++_n;
+			if (_n<64)
+				return;
+			if (_n<128)
+				std::this_thread::yield();
+			else
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+		void reset(){ _n=0; }
+	};
+
+	/**
+	 * @short Lets a thread sleep until a condition on lock free state is true, and others wake it.
+	 *
+	 * wait() checks the condition a few times, then sleeps on a condition variable. notify() must be called
+	 * after changing the state the condition reads; it only takes the mutex if someone is sleeping, so it
+	 * costs an atomic operation when nobody waits.
+	 */
+	class waiter{
+		std::mutex _mutex;
+		std::condition_variable _cv;
+		std::atomic<unsigned> _sleeping;
+	public:
+		waiter() : _sleeping(0){}
+		waiter(const waiter &)=delete;
+
+		/// Returns when pred() is true. pred may have side effects, as popping from a queue.
+		template<typename P>
+		void wait(P pred){
+			for (int i=0;i<64;++i)
+				if (pred())
+					return;
+			std::unique_lock<std::mutex> lock(_mutex);
+			_sleeping.fetch_add(1, std::memory_order_acq_rel);
+			_cv.wait(lock, pred);
+			_sleeping.fetch_sub(1, std::memory_order_relaxed);
+		}
+		void notify(){
+			// A read-modify-write: either it sees the sleeper, or the sleeper's one comes after it and its pred
+			// sees the state written before.
+			if (_sleeping.fetch_add(0, std::memory_order_acq_rel)){
+				std::lock_guard<std::mutex> lock(_mutex);
+				_cv.notify_all();
+			}
+		}
+	};
+
+	/**
+	 * @short Bounded lock free queue for one producer thread and one consumer thread.
+	 *
+	 * Capacity is rounded up to a power of two. try_push and try_pop never block; the value is moved
+	 * only if they succeed, so they can be retried.
+	 */
+	template<typename T>
+	class spsc_queue{
+		std::vector<T> _slots;
+		size_t _mask;
+		std::atomic<size_t> _head; // Next to pop, written by the consumer
+		char _pad[64];             // Keeps head and tail in different cache lines
+		std::atomic<size_t> _tail; // Next to push, written by the producer
+	public:
+		explicit spsc_queue(size_t capacity) : _slots(detail::_round_pow2(capacity)), _mask(_slots.size()-1), _head(0), _tail(0){}
+		spsc_queue(const spsc_queue &)=delete;
+
+		bool try_push(T &v){
+			size_t t=_tail.load(std::memory_order_relaxed);
+			if (t-_head.load(std::memory_order_acquire)==_slots.size())
+				return false;
+			_slots[t & _mask]=std::move(v);
+			_tail.store(t+1, std::memory_order_release);
+			return true;
+		}
+		bool try_pop(T &out){
+			size_t h=_head.load(std::memory_order_relaxed);
+			if (h==_tail.load(std::memory_order_acquire))
+				return false;
+			out=std::move(_slots[h & _mask]);
+			_head.store(h+1, std::memory_order_release);
+			return true;
+		}
+		size_t capacity() const{ return _slots.size(); }
+	};
+
+	/**
+	 * @short Bounded lock free queue for any number of producers and consumers.
+	 *
+	 * Each cell has a sequence number that tells if it is free for the push or ready for the pop of a
+	 * given turn (D. Vyukov's bounded MPMC queue). Same interface as spsc_queue.
+	 */
+	template<typename T>
+	class mpmc_queue{
+		struct cell{
+			std::atomic<size_t> seq;
+			T value;
+		};
+		std::unique_ptr<cell[]> _cells;
+		size_t _mask;
+		std::atomic<size_t> _enqueue;
+		char _pad[64];
+		std::atomic<size_t> _dequeue;
+	public:
+		explicit mpmc_queue(size_t capacity) : _mask(detail::_round_pow2(capacity)-1), _enqueue(0), _dequeue(0){
+			_cells.reset(new cell[_mask+1]);
+			for (size_t i=0;i<=_mask;++i)
+				_cells[i].seq.store(i, std::memory_order_relaxed);
+		}
+		mpmc_queue(const mpmc_queue &)=delete;
+
+		bool try_push(T &v){
+			size_t pos=_enqueue.load(std::memory_order_relaxed);
+			cell *c;
+			for(;;){
+				c=&_cells[pos & _mask];
+				ssize_t dif=ssize_t(c->seq.load(std::memory_order_acquire))-ssize_t(pos);
+				if (dif==0){
+					if (_enqueue.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+						break;
+				}
+				else if (dif<0)
+					return false; // Full
+				else
+					pos=_enqueue.load(std::memory_order_relaxed);
+			}
+			c->value=std::move(v);
+			c->seq.store(pos+1, std::memory_order_release);
+			return true;
+		}
+		bool try_pop(T &out){
+			size_t pos=_dequeue.load(std::memory_order_relaxed);
+			cell *c;
+			for(;;){
+				c=&_cells[pos & _mask];
+				ssize_t dif=ssize_t(c->seq.load(std::memory_order_acquire))-ssize_t(pos+1);
+				if (dif==0){
+					if (_dequeue.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+						break;
+				}
+				else if (dif<0)
+					return false; // Empty
+				else
+					pos=_dequeue.load(std::memory_order_relaxed);
+			}
+			out=std::move(c->value);
+			c->seq.store(pos+_mask+1, std::memory_order_release);
+			return true;
+		}
+		size_t capacity() const{ return _mask+1; }
+	};
+};
@@ -0,0 +1,261 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <memory>
+#include <string>
+#include <limits>
+#include <stdexcept>
+#include "string_ref.hpp"
+#include "string.hpp"
+
+namespace underscore{
+	/**
+	 * @short Immutable string for very long documents built from many pieces.
+	 *
+	 * It is a balanced (AVL) tree of shared chunks, so append, concatenation and slice are O(log n)
+	 * and never copy the existing data. Copies of a rope share all the structure.
+	 *
+	 * Small appends are merged into the last chunk while it is smaller than leaf_size.
+	 *
+	 * Example:
+	 *
+	 * 	rope doc;
+	 * 	for(auto &l: lines)
+	 * 		doc+=l;
+	 * 	auto header=doc.slice(0,1024).str();
+	 */
+	class rope{
+	public:
+		static const size_t leaf_size=512;
+	private:
+		struct node;
+		typedef std::shared_ptr<const node> ptr;
+		struct node{
+			ptr left, right;
+			std::shared_ptr<const std::string> chunk; // Only at leafs
+			size_t offset;
+			size_t size;
+			int height;
+
+			bool is_leaf() const{ return !left; }
+			string_ref ref() const{ return string_ref(chunk->data()+offset, size); }
+		};
+
+		ptr _root;
+
+		static int _height(const ptr &n){ return n ? n->height : 0; }
+		static size_t _size(const ptr &n){ return n ? n->size : 0; }
+
+		static ptr _leaf(std::shared_ptr<const std::string> chunk, size_t offset, size_t size){
+			if (size==0)
+				return ptr();
+			auto n=std::make_shared<node>();
+			n->chunk=std::move(chunk);
+			n->offset=offset;
+			n->size=size;
+			n->height=1;
+			return n;
+		}
+		static ptr _leaf(const string_ref &s){
+			return _leaf(std::make_shared<const std::string>(s.data(), s.size()), 0, s.size());
+		}
+		static ptr _node(const ptr &l, const ptr &r){
+			auto n=std::make_shared<node>();
+			n->left=l;
+			n->right=r;
+			n->offset=0;
+			n->size=l->size+r->size;
+			n->height=std::max(l->height, r->height)+1;
+			return n;
+		}
+		/// Builds a node from two subtrees whose heights differ at most 2, rotating if needed.
+		static ptr _balanced(const ptr &l, const ptr &r){
+			int hl=_height(l), hr=_height(r);
+			if (hl>hr+1){
+				if (_height(l->left)>=_height(l->right))
+					return _node(l->left, _node(l->right, r));
+				return _node(_node(l->left, l->right->left), _node(l->right->right, r));
+			}
+			if (hr>hl+1){
+				if (_height(r->right)>=_height(r->left))
+					return _node(_node(l, r->left), r->right);
+				return _node(_node(l, r->left->left), _node(r->left->right, r->right));
+			}
+			return _node(l, r);
+		}
+		static ptr _join(const ptr &a, const ptr &b){
+			if (!a)
+				return b;
+			if (!b)
+				return a;
+			if (a->is_leaf() && b->is_leaf() && a->size+b->size<=leaf_size){
+				std::string merged;
+				merged.reserve(a->size+b->size);
+				merged.append(a->ref().data(), a->size);
+				merged.append(b->ref().data(), b->size);
+				size_t n=merged.size();
+				return _leaf(std::make_shared<const std::string>(std::move(merged)), 0, n);
+			}
+			int ha=a->height, hb=b->height;
+			if (ha>hb+1)
+				return _balanced(a->left, _join(a->right, b));
+			if (hb>ha+1)
+				return _balanced(_join(a, b->left), b->right);
+			return _node(a, b);
+		}
+		/// Splits t at position k: l gets [0,k), r gets [k,end).
+		static void _split(const ptr &t, size_t k, ptr &l, ptr &r){
+			if (!t){
+				l=r=ptr();
+				return;
+			}
+			if (k==0){
+				l=ptr();
+				r=t;
+				return;
+			}
+			if (k>=t->size){
+				l=t;
+				r=ptr();
+				return;
+			}
+			if (t->is_leaf()){
+				l=_leaf(t->chunk, t->offset, k);
+				r=_leaf(t->chunk, t->offset+k, t->size-k);
+				return;
+			}
+			size_t ls=t->left->size;
+			ptr a, b;
+			if (k<=ls){
+				_split(t->left, k, a, b);
+				l=a;
+				r=_join(b, t->right);
+			}
+			else{
+				_split(t->right, k-ls, a, b);
+				l=_join(t->left, a);
+				r=b;
+			}
+		}
+		template<typename F>
+		static void _each_chunk(const ptr &t, const F &f){
+			if (!t)
+				return;
+			if (t->is_leaf()){
+				f(t->ref());
+				return;
+			}
+			_each_chunk(t->left, f);
+			_each_chunk(t->right, f);
+		}
+
+		explicit rope(ptr root) : _root(std::move(root)){}
+
+		ssize_t _wrap_position(ssize_t p) const{
+			ssize_t s=size();
+			if (p>s)
+				return s;
+			if (p<0){
+				p=s+p;
+				if (p<0)
+					return 0;
+				return p;
+			}
+			return p;
+		}
+	public:
+		rope(){}
+		rope(const string_ref &s) : _root(_leaf(s)){}
+		rope(const char *s) : rope(string_ref(s)){}
+		rope(const std::string &s) : rope(string_ref(s)){}
+		rope(const string &s) : rope(s.ref()){}
+		/// Takes ownership of the string, no copy.
+		rope(std::string &&s){
+			size_t n=s.size();
+			_root=_leaf(std::make_shared<const std::string>(std::move(s)), 0, n);
+		}
+
+		size_t size() const{ return _size(_root); }
+		size_t length() const{ return size(); }
+		bool empty() const{ return !_root; }
+		/// Tree height, log2 of the number of chunks.
+		int depth() const{ return _height(_root); }
+
+		rope &append(const rope &o){
+			_root=_join(_root, o._root);
+			return *this;
+		}
+		rope &operator+=(const rope &o){
+			return append(o);
+		}
+
+		/**
+		 * @short Returns the part of the rope from start to end, with the same rules as string::slice. O(log n).
+		 */
+		rope slice(ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
+			start=_wrap_position(start);
+			end=_wrap_position(end);
+			if (end<=start)
+				return rope();
+			ptr l, m, r;
+			_split(_root, end, l, r);
+			_split(l, start, r, m);
+			return rope(m);
+		}
+
+		char operator[](size_t p) const{
+			const node *n=_root.get();
+			while (!n->is_leaf()){
+				if (p<n->left->size)
+					n=n->left.get();
+				else{
+					p-=n->left->size;
+					n=n->right.get();
+				}
+			}
+			return n->chunk->data()[n->offset+p];
+		}
+
+		/**
+		 * @short Calls f(string_ref) for each chunk, in order. Useful to write it out without materializing.
+		 */
+		template<typename F>
+		void each_chunk(const F &f) const{
+			_each_chunk(_root, f);
+		}
+
+		/**
+		 * @short Materializes the rope with a single allocation.
+		 */
+		std::string str() const{
+			std::string ret;
+			ret.reserve(size());
+			each_chunk([&ret](const string_ref &s){ ret.append(s.data(), s.size()); });
+			return ret;
+		}
+
+		friend std::ostream& operator <<(std::ostream &output, const rope &r) {
+			r.each_chunk([&output](const string_ref &s){ output<<s; });
+			return output;
+		}
+	};
+
+	inline rope operator+(const rope &a, const rope &b){
+		rope r=a;
+		return r.append(b);
+	}
+};
@@ -0,0 +1,246 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <cstring>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace underscore{
+	/**
+	 * @short Precompiled substring search. Build it once per needle, use it many times.
+	 *
+	 * Depending on the needle length it uses:
+	 *
+	 * - 1 byte: memchr / memrchr.
+	 * - Short needles: SIMD filter on the first and last byte, then memcmp on the candidates. Backwards,
+	 *   memrchr of the first byte.
+	 * - Long needles: Boyer-Moore-Horspool, with a second table for backwards searches.
+	 *
+	 * It is also a predicate, so it can be used directly at filters:
+	 *
+	 * 	auto tcp=searcher("/tcp");
+	 * 	_(lines).filter(tcp);
+	 */
+	class searcher{
+	public:
+		enum strategy{
+			empty_needle=0,
+			single_byte,
+			first_last,
+			horspool
+		};
+		/// Needles at least this long use Horspool.
+		static const size_t horspool_threshold=32;
+	private:
+		std::string _needle;
+		strategy _strategy;
+		std::vector<size_t> _skip;
+		std::vector<size_t> _rskip; // Horspool backwards: the window moves left, aligned on its first byte
+
+		ssize_t _find_first_last(const char *h, size_t n) const{
+			const char *nd=_needle.data();
+			const size_t k=_needle.size();
+			if (n<k)
+				return -1;
+			size_t i=0;
+#ifdef __SSE2__
+			const __m128i first=_mm_set1_epi8(nd[0]);
+			const __m128i last=_mm_set1_epi8(nd[k-1]);
+			for (;i+k+15<=n;i+=16){
+				__m128i bf=_mm_loadu_si128((const __m128i*)(h+i));
+				__m128i bl=_mm_loadu_si128((const __m128i*)(h+i+k-1));
+				unsigned int mask=_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first,bf), _mm_cmpeq_epi8(last,bl)));
+				while (mask){
+					unsigned int bit=__builtin_ctz(mask);
+					if (memcmp(h+i+bit+1, nd+1, k-2)==0)
+						return i+bit;
+					mask&=mask-1;
+				}
+			}
+#endif
+			for (;i+k<=n;++i){
+				const char *p=(const char*)memchr(h+i, nd[0], n-k-i+1);
+				if (!p)
+					return -1;
+				i=p-h;
+				if (h[i+k-1]==nd[k-1] && memcmp(h+i+1, nd+1, k-2)==0)
+					return i;
+			}
+			return -1;
+		}
+		ssize_t _find_horspool(const char *h, size_t n) const{
+			const char *nd=_needle.data();
+			const size_t k=_needle.size();
+			if (n<k)
+				return -1;
+			const unsigned char lastc=nd[k-1];
+			size_t i=0;
+			while (i+k<=n){
+				unsigned char c=h[i+k-1];
+				if (c==lastc && memcmp(h+i, nd, k-1)==0)
+					return i;
+				i+=_skip[c];
+			}
+			return -1;
+		}
+		ssize_t _rfind_first_last(const char *h, size_t n) const{
+			const char *nd=_needle.data();
+			const size_t k=_needle.size();
+			if (n<k)
+				return -1;
+			size_t end=n-k+1; // Candidates are at [0, end)
+			while (end>0){
+				const char *p=(const char*)memrchr(h, nd[0], end);
+				if (!p)
+					return -1;
+				size_t i=p-h;
+				if (h[i+k-1]==nd[k-1] && memcmp(h+i+1, nd+1, k-2)==0)
+					return i;
+				end=i;
+			}
+			return -1;
+		}
+		ssize_t _rfind_horspool(const char *h, size_t n) const{
+			const char *nd=_needle.data();
+			const size_t k=_needle.size();
+			if (n<k)
+				return -1;
+			const unsigned char firstc=nd[0];
+			size_t i=n-k;
+			for(;;){
+				unsigned char c=h[i];
+				if (c==firstc && memcmp(h+i+1, nd+1, k-1)==0)
+					return i;
+				if (i<_rskip[c])
+					return -1;
+				i-=_rskip[c];
+			}
+		}
+	public:
+		explicit searcher(const std::string &needle) : _needle(needle){
+			if (_needle.empty())
+				_strategy=empty_needle;
+			else if (_needle.size()==1)
+				_strategy=single_byte;
+			else if (_needle.size()<horspool_threshold)
+				_strategy=first_last;
+			else{
+				_strategy=horspool;
+				const size_t k=_needle.size();
+				_skip.assign(256, k);
+				for (size_t i=0;i+1<k;++i)
+					_skip[(unsigned char)_needle[i]]=k-1-i;
+				_rskip.assign(256, k);
+				for (size_t i=k-1;i>0;--i)
+					_rskip[(unsigned char)_needle[i]]=i;
+			}
+		}
+		explicit searcher(const char *needle) : searcher(std::string(needle)){}
+		explicit searcher(const char *needle, size_t n) : searcher(std::string(needle, n)){}
+
+		const std::string &needle() const{ return _needle; }
+		size_t size() const{ return _needle.size(); }
+		strategy get_strategy() const{ return _strategy; }
+
+		/**
+		 * @short Finds the first ocurrence at the n bytes of haystack.
+		 *
+		 * @returns the position or -1.
+		 */
+		ssize_t find(const char *haystack, size_t n) const{
+			switch(_strategy){
+				case empty_needle:
+					return 0;
+				case single_byte:{
+					const char *p=(const char*)memchr(haystack, _needle[0], n);
+					return p ? p-haystack : -1;
+				}
+				case first_last:
+					return _find_first_last(haystack, n);
+				case horspool:
+					return _find_horspool(haystack, n);
+			}
+			return -1;
+		}
+		/**
+		 * @short Finds the last ocurrence at the n bytes of haystack.
+		 *
+		 * @returns the position or -1.
+		 */
+		ssize_t rfind(const char *haystack, size_t n) const{
+			switch(_strategy){
+				case empty_needle:
+					return n;
+				case single_byte:{
+					const char *p=(const char*)memrchr(haystack, _needle[0], n);
+					return p ? p-haystack : -1;
+				}
+				case first_last:
+					return _rfind_first_last(haystack, n);
+				case horspool:
+					return _rfind_horspool(haystack, n);
+			}
+			return -1;
+		}
+
+		/**
+		 * @short One shot search, when it is not worth to build a searcher. Does not allocate.
+		 */
+		static ssize_t find_once(const char *haystack, size_t n, const char *needle, size_t k){
+			if (k==0)
+				return 0;
+			const char *p=(const char*)memmem(haystack, n, needle, k);
+			return p ? p-haystack : -1;
+		}
+		static ssize_t rfind_once(const char *haystack, size_t n, const char *needle, size_t k){
+			if (k>n)
+				return -1;
+			if (k==0)
+				return n;
+			if (k==1){
+				const char *p=(const char*)memrchr(haystack, needle[0], n);
+				return p ? p-haystack : -1;
+			}
+			for (ssize_t i=n-k;i>=0;--i)
+				if (haystack[i]==needle[0] && haystack[i+k-1]==needle[k-1] && memcmp(haystack+i+1, needle+1, k-2)==0)
+					return i;
+			return -1;
+		}
+
+		template<typename S>
+		ssize_t find(const S &s) const{
+			return find(s.data(), s.size());
+		}
+		template<typename S>
+		ssize_t rfind(const S &s) const{
+			return rfind(s.data(), s.size());
+		}
+
+		/**
+		 * @short Predicate version: true if the needle is contained in s.
+		 */
+		template<typename S>
+		bool operator()(const S &s) const{
+			return find(s.data(), s.size())!=-1;
+		}
+	};
+};
@@ -23,10 +23,20 @@
 #include <tuple>
 #include <map>
 #include <functional>
+#include <limits>
+#include <numeric>
+#include <type_traits>
+
+namespace underscore{
+	class string_ref;
+	class interned_string;
+};
 
 namespace std{
 	inline std::string to_string(const std::string &str){ return str; }; // Need to copy it anyway, so no const &.
 	inline std::string to_string(const char c){ char tmp[]={c,0}; return std::string(tmp); }; // Need to copy it anyway, so no const &.
+	template<typename T> // Only for string_ref and interned_string, without conversions.
+	inline typename std::enable_if<std::is_same<T, underscore::string_ref>::value || std::is_same<T, underscore::interned_string>::value, std::string>::type to_string(const T &str){ return str.str(); };
 };
 
 namespace underscore{
@@ -113,6 +123,19 @@ namespace underscore{
 			return ret;
 		}
 		
+		/**
+		 * @short Writes all elements to the file at path, each followed by sep. Returns how many. Defined at
+		 * sink.hpp, included by underscore.hpp.
+		 *
+		 * Strings are not copied: each one and each separator are an iovec of big writev() calls. With
+		 * background, the writes are done from another thread.
+		 */
+		size_t write_to(const std::string &path, const std::string &sep="\n", bool background=false) const;
+		/**
+		 * @short Writes all elements to an open file descriptor, as write_to(path). It is not closed.
+		 */
+		size_t write_to(int fd, const std::string &sep="\n", bool background=false) const;
+		
 		/**
 		 * @short Filters out all the elements that do no comply to the condition.
 		 * 
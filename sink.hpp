@@ -0,0 +1,392 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include "string.hpp"
+#include "queue.hpp"
+#include "generator.hpp"
+
+namespace underscore{
+	/**
+	 * @short Writes elements to a file descriptor, each followed by a separator, in big writev() calls.
+	 *
+	 * Elements are gathered into a batch of about buffer_size bytes, and the batch is written with one
+	 * iovec per element and per separator, so they are never concatenated. With background, batches are
+	 * written by another thread while the next one is filled.
+	 *
+	 * write() copies views into a buffer of the batch, reused from batch to batch, or takes ownership of
+	 * std::string rvalues. write_ref() only keeps a view, which must be valid until flush() or close().
+	 *
+	 * Errors throw std::runtime_error; with background, at the next write(), flush() or close(). Writing
+	 * after close() throws std::logic_error.
+	 */
+	class sink{
+	public:
+		static const size_t default_buffer_size=4*1024*1024;
+	private:
+		static const size_t chunk_size=64*1024;
+		static const size_t max_pending=2; // Batches waiting for the writer thread
+		struct batch{
+			std::deque<std::string> owned; // A deque, so views to its strings do not move
+			std::vector<std::pair<std::unique_ptr<char[]>, size_t>> chunks; // Copies of views, kept for the next use
+			size_t chunk, used;            // Where the next copy goes
+			std::vector<string_ref> pieces;
+			size_t bytes;
+			batch() : chunk(0), used(0), bytes(0){}
+			void clear(){
+				owned.clear();
+				chunk=used=0;
+				pieces.clear();
+				bytes=0;
+			}
+			/// Copies s at the chunks. They are never reallocated, so the copy does not move.
+			string_ref copy(const string_ref &s){
+				while (chunk<chunks.size() && chunks[chunk].second-used<s.size()){
+					++chunk;
+					used=0;
+				}
+				if (chunk==chunks.size()){
+					size_t size=s.size()>chunk_size ? s.size() : size_t(chunk_size);
+					chunks.emplace_back(std::unique_ptr<char[]>(new char[size]), size);
+				}
+				char *at=chunks[chunk].first.get()+used;
+				memcpy(at, s.data(), s.size());
+				used+=s.size();
+				return string_ref(at, s.size());
+			}
+		};
+		struct writer_state{
+			int fd;
+			std::string sep;
+			std::mutex mutex;
+			std::condition_variable cv;                 // Batches submitted, written, or closing
+			std::deque<std::unique_ptr<batch>> full;    // To write, in order
+			std::vector<std::unique_ptr<batch>> empty;  // Written, to reuse
+			size_t submitted, written;
+			bool closing;
+			detail::thread_error error;
+			writer_state(int fd, const std::string &sep) : fd(fd), sep(sep), submitted(0), written(0), closing(false){}
+		};
+
+		int _fd;
+		bool _own_fd;
+		std::string _sep;
+		size_t _buffer_size;
+		size_t _count;
+		std::unique_ptr<batch> _current;
+		std::unique_ptr<writer_state> _writer;
+		std::thread _thread;
+
+		static void _writev_all(int fd, struct iovec *iov, int n){
+			while (n>0){
+				ssize_t w=::writev(fd, iov, n);
+				if (w<0){
+					if (errno==EINTR)
+						continue;
+					throw std::runtime_error(std::string("Can not write: ")+strerror(errno));
+				}
+				while (n>0 && size_t(w)>=iov->iov_len){
+					w-=iov->iov_len;
+					++iov;
+					--n;
+				}
+				if (n>0){
+					iov->iov_base=(char*)iov->iov_base+w;
+					iov->iov_len-=w;
+				}
+			}
+		}
+		static void _write_batch(int fd, const std::string &sep, const batch &b){
+			const int max_iov=IOV_MAX & ~1;
+			struct iovec iov[max_iov];
+			int n=0;
+			for (auto &p: b.pieces){
+				iov[n].iov_base=(void*)p.data();
+				iov[n].iov_len=p.size();
+				++n;
+				if (!sep.empty()){
+					iov[n].iov_base=(void*)sep.data();
+					iov[n].iov_len=sep.size();
+					++n;
+				}
+				if (n==max_iov){
+					_writev_all(fd, iov, n);
+					n=0;
+				}
+			}
+			_writev_all(fd, iov, n);
+		}
+		static void _write_loop(writer_state *w){
+			for(;;){
+				std::unique_ptr<batch> b;
+				{
+					std::unique_lock<std::mutex> lock(w->mutex);
+					w->cv.wait(lock, [w]{ return !w->full.empty() || w->closing; });
+					if (w->full.empty()) // Closing, and all written
+						return;
+					b=std::move(w->full.front());
+					w->full.pop_front();
+				}
+				try{
+					if (!w->error.failed.load(std::memory_order_acquire))
+						_write_batch(w->fd, w->sep, *b);
+				}
+				catch(...){
+					w->error.set(std::current_exception());
+				}
+				b->clear();
+				{
+					std::lock_guard<std::mutex> lock(w->mutex);
+					if (w->empty.size()<max_pending)
+						w->empty.push_back(std::move(b));
+					++w->written;
+				}
+				w->cv.notify_all();
+			}
+		}
+
+		void _check_open() const{
+			if (!_current)
+				throw std::logic_error("The sink is closed");
+		}
+		void _submit(){
+			_check_open();
+			if (_current->pieces.empty())
+				return;
+			if (!_writer){
+				_write_batch(_fd, _sep, *_current);
+				_current->clear();
+				return;
+			}
+			{
+				std::unique_lock<std::mutex> lock(_writer->mutex);
+				_writer->cv.wait(lock, [this]{ return _writer->full.size()<max_pending; });
+				_writer->full.push_back(std::move(_current));
+				++_writer->submitted;
+				if (!_writer->empty.empty()){
+					_current=std::move(_writer->empty.back());
+					_writer->empty.pop_back();
+				}
+			}
+			_writer->cv.notify_all();
+			if (!_current)
+				_current.reset(new batch());
+			_writer->error.rethrow();
+		}
+		void _add(const string_ref &piece){
+			_check_open();
+			_current->pieces.push_back(piece);
+			_current->bytes+=piece.size()+_sep.size();
+			++_count;
+			if (_current->bytes>=_buffer_size)
+				_submit();
+		}
+		void _start(bool background){
+			if (_fd<0)
+				throw std::runtime_error("Can not open the sink file");
+			if (background){
+				_writer.reset(new writer_state(_fd, _sep));
+				_thread=std::thread(_write_loop, _writer.get());
+			}
+		}
+	public:
+		/**
+		 * @short Creates or truncates the file at path.
+		 */
+		explicit sink(const std::string &path, const std::string &sep="\n", bool background=false, size_t buffer_size=default_buffer_size)
+				: _fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)), _own_fd(true), _sep(sep),
+				  _buffer_size(buffer_size), _count(0), _current(new batch()){
+			_start(background);
+		}
+		/**
+		 * @short Writes to an already open file descriptor. It is not closed.
+		 */
+		explicit sink(int fd, const std::string &sep="\n", bool background=false, size_t buffer_size=default_buffer_size)
+				: _fd(fd), _own_fd(false), _sep(sep), _buffer_size(buffer_size), _count(0), _current(new batch()){
+			_start(background);
+		}
+		sink(const sink &)=delete;
+		sink &operator=(const sink &)=delete;
+		~sink(){
+			try{
+				close();
+			}
+			catch(...){
+			}
+		}
+
+		void write(std::string &&s){
+			_check_open();
+			_current->owned.push_back(std::move(s));
+			_add(string_ref(_current->owned.back()));
+		}
+		void write(underscore::string &&s){
+			write(std::string(std::move(s)));
+		}
+		void write(const string_ref &s){
+			_check_open();
+			_add(_current->copy(s));
+		}
+		void write(const std::string &s){
+			write(string_ref(s));
+		}
+		void write(const underscore::string &s){
+			write(s.ref());
+		}
+		void write(const char *s){
+			write(string_ref(s));
+		}
+		template<typename T>
+		typename std::enable_if<std::is_arithmetic<T>::value>::type write(const T &v){
+			write(std::to_string(v));
+		}
+
+		/// Borrows the data, it must be valid until flush().
+		void write_ref(const string_ref &s){
+			_add(s);
+		}
+		void write_ref(const std::string &s){
+			_add(string_ref(s));
+		}
+		void write_ref(const underscore::string &s){
+			_add(s.ref());
+		}
+		void write_ref(const char *s){
+			_add(string_ref(s));
+		}
+		/// Elements that are not strings are converted, and the sink keeps the result.
+		template<typename T>
+		typename std::enable_if<std::is_arithmetic<T>::value>::type write_ref(const T &v){
+			write(v);
+		}
+
+		/**
+		 * @short Writes all the pending elements. With background, waits for the writer thread.
+		 */
+		void flush(){
+			_submit();
+			if (_writer){
+				{
+					std::unique_lock<std::mutex> lock(_writer->mutex);
+					_writer->cv.wait(lock, [this]{ return _writer->written==_writer->submitted; });
+				}
+				_writer->error.rethrow();
+			}
+		}
+		/**
+		 * @short Flushes, stops the writer thread and closes the file if it was opened by path.
+		 */
+		void close(){
+			if (!_current)
+				return;
+			std::exception_ptr error;
+			try{
+				flush();
+			}
+			catch(...){
+				error=std::current_exception();
+			}
+			if (_thread.joinable()){
+				{
+					std::lock_guard<std::mutex> lock(_writer->mutex);
+					_writer->closing=true;
+				}
+				_writer->cv.notify_all();
+				_thread.join();
+			}
+			if (_own_fd && _fd>=0)
+				::close(_fd);
+			_fd=-1;
+			_current.reset();
+			if (error)
+				std::rethrow_exception(error);
+		}
+
+		/// Elements written so far.
+		size_t count() const{ return _count; }
+		bool is_open() const{ return _fd>=0; }
+	};
+
+	template<typename Derived, typename T>
+	size_t generator<Derived, T>::write_to(const std::string &path, const std::string &sep, bool background){
+		sink out(path, sep, background);
+		T v;
+		while (self()->next(v))
+			out.write(std::move(v));
+		out.close();
+		return out.count();
+	}
+	template<typename Derived, typename T>
+	size_t generator<Derived, T>::write_to(int fd, const std::string &sep, bool background){
+		sink out(fd, sep, background);
+		T v;
+		while (self()->next(v))
+			out.write(std::move(v));
+		out.close();
+		return out.count();
+	}
+	
+	/**
+	 * @short Writes all the elements of a sequence, or any container, to the file at path, each followed by
+	 * sep. Returns how many.
+	 *
+	 * Strings are not copied: each one and each separator are an iovec of big writev() calls. With
+	 * background, the writes are done from another thread.
+	 */
+	template<typename Container>
+	size_t write_to(const Container &elements, const std::string &path, const std::string &sep="\n", bool background=false){
+		sink out(path, sep, background);
+		for (auto &v: elements)
+			out.write_ref(v);
+		out.close();
+		return out.count();
+	}
+	/**
+	 * @short Writes all the elements to an open file descriptor, as write_to(elements, path). It is not closed.
+	 */
+	template<typename Container>
+	size_t write_to(const Container &elements, int fd, const std::string &sep="\n", bool background=false){
+		sink out(fd, sep, background);
+		for (auto &v: elements)
+			out.write_ref(v);
+		out.close();
+		return out.count();
+	}
+
+	template<typename T>
+	size_t sequence<T>::write_to(const std::string &path, const std::string &sep, bool background) const{
+		return underscore::write_to(*this, path, sep, background);
+	}
+	template<typename T>
+	size_t sequence<T>::write_to(int fd, const std::string &sep, bool background) const{
+		return underscore::write_to(*this, fd, sep, background);
+	}
+};
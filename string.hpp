@@ -18,7 +18,14 @@
 #include <string>
 #include <vector>
 #include <stdexcept>
+#include <limits>
+#include <type_traits>
+#include <memory>
 #include "sequence.hpp"
+#include "ascii.hpp"
+#include "searcher.hpp"
+#include "string_ref.hpp"
+#include "pattern.hpp"
 
 namespace underscore{
 	class string;
@@ -26,98 +33,110 @@ namespace underscore{
 	typedef sequence<std::vector<string>> string_list;
 	typedef std::vector<string> std_string_list;
 	
+	/**
+	 * @short Owning string with python like methods.
+	 * 
+	 * All read only methods are implemented by string_ref, so they do not allocate unless they return a new string.
+	 */
 	class string{
 		std::string _str;
 		
-		
-		ssize_t _wrap_position(ssize_t p) const{
-			ssize_t s=size();
-			if (p>s)
-				return s;
-			if (p<0){
-				p=s+p;
-				if (p<0)
-					return 0;
-				return p;
-			}
-			return p;
+		static string_list _to_string_list(const string_ref_list &l){
+			std_string_list v;
+			v.reserve(l.size());
+			for (auto &r: l)
+				v.push_back(string(r));
+			return string_list(std::move(v));
 		}
 	public:
 		
 		string(std::string &&str) : _str(std::move(str)){};
 		string(const std::string &str) : _str(str){};
 		string(const char *str) : _str(str){};
-		template<typename T> string(const T &v) : _str(std::to_string(v)){};
+		explicit string(const string_ref &str) : _str(str.data(), str.size()){};
+		template<typename T, typename=typename std::enable_if<std::is_arithmetic<T>::value>::type>
+		string(const T &v) : _str(std::to_string(v)){};
 		string() : _str(){};
+		
+		/**
+		 * @short Non owning view of this string. Valid while this string is alive and not modified.
+		 */
+		string_ref ref() const{
+			return string_ref(_str);
+		}
+		operator string_ref() const{
+			return ref();
+		}
 
 		string_list split(const char &sep=',', bool insert_empty_elements=false) const {
-			std_string_list v;
-			std::string el;
-			
-			std::string::const_iterator I=_str.begin(), endI=_str.end();
-			std::string::const_iterator p;
-			do{
-				p=std::find(I, endI, sep);
-				
-				el=std::string(I, p);
-				if (insert_empty_elements || !el.empty())
-					v.push_back(std::move(el));
-				I=p+1;
-			}while(p!=endI);
-			
-			return string_list(std::move(v));
+			return _to_string_list(ref().split(sep, insert_empty_elements));
 		}
 		
-		string_list split(const std::string &sep, bool insert_empty_elements=false) const {
-			std_string_list v;
-			std::string el;
-			
-			auto I=_str.begin(), endI=_str.end(), sepBegin=sep.begin(), sepEnd=sep.end();
-			std::string::const_iterator p;
-			
-			do{
-				p=std::search(I, endI, sepBegin, sepEnd);
-				
-				el=std::string(I, p);
-				if (insert_empty_elements || !el.empty())
-					v.push_back(el);
-				I=p+sep.size();
-			}while(p!=endI);
-			
-			return string_list(std::move(v));
+		string_list split(const string_ref &sep, bool insert_empty_elements=false) const {
+			return _to_string_list(ref().split(sep, insert_empty_elements));
 		}
 		
-		string lower() const{
-			std::string ret;
-			ret.reserve(_str.size());
-			for (auto c: _str)
-				ret.push_back(::tolower(c));
+		/**
+		 * @short Returns a lowercase copy. Only ASCII letters change, so it is UTF-8 safe and locale independent.
+		 */
+		string lower() const &{
+			std::string ret(_str.size(), '\0');
+			ascii::lower(_str.data(), &ret[0], _str.size());
 			return string(std::move(ret));
 		};
-		string upper() const{
-			std::string ret;
-			ret.reserve(_str.size());
-			for (auto c: _str)
-				ret.push_back(::toupper(c));
+		/**
+		 * @short Lowercase in place when called on a temporary, no allocation.
+		 */
+		string lower() &&{
+			ascii::lower(_str.data(), &_str[0], _str.size());
+			return std::move(*this);
+		};
+		/**
+		 * @short Returns an uppercase copy. Only ASCII letters change, so it is UTF-8 safe and locale independent.
+		 */
+		string upper() const &{
+			std::string ret(_str.size(), '\0');
+			ascii::upper(_str.data(), &ret[0], _str.size());
 			return string(std::move(ret));
 		};
+		/**
+		 * @short Uppercase in place when called on a temporary, no allocation.
+		 */
+		string upper() &&{
+			ascii::upper(_str.data(), &_str[0], _str.size());
+			return std::move(*this);
+		};
 		
-		bool startswith(const std::string &starting) const {
-			if (_str.size()<starting.size())
-				return false;
-			return (_str.substr(0,starting.size())==starting);
+		/**
+		 * @short Compares ignoring ASCII case, without creating lowered copies.
+		 */
+		bool iequals(const string_ref &other) const {
+			return ref().iequals(other);
+		}
+		bool istartswith(const string_ref &starting) const {
+			return ref().istartswith(starting);
+		}
+		bool icontains(const string_ref &substr) const {
+			return ref().icontains(substr);
 		}
 		
-		bool endswith(const std::string &ending) const {
-			if (_str.size()<ending.size())
-				return false;
-			return (_str.substr(_str.size()-ending.size())==ending);
+		bool startswith(const string_ref &starting) const {
+			return ref().startswith(starting);
+		}
+		bool endswith(const string_ref &ending) const {
+			return ref().endswith(ending);
 		}
-		bool contains(const std::string &substr) const {
-			return _str.find(substr)!=std::string::npos;
+		bool contains(const string_ref &substr) const {
+			return ref().contains(substr);
 		}
 		bool contains(char c) const {
-			return _str.find(c)!=std::string::npos;
+			return ref().contains(c);
+		}
+		bool contains(const searcher &s) const {
+			return ref().contains(s);
+		}
+		bool match(const pattern &p) const {
+			return p.match(ref());
 		}
 		
 		string replace(const std::string &orig, const std::string &replace_with) const{
@@ -137,14 +156,15 @@ namespace underscore{
 		 * @short Removes all spaces, new lines and tabs from begining and end.
 		 */
 		string strip() const{
-			auto begin=_str.find_first_not_of(" \n\t");
-			auto end=_str.find_last_not_of(" \n\t");
-			return slice(begin, end+1);
+			return string(ref().strip());
 		}
 		
-		operator std::string() const{
+		operator std::string() const &{
 			return _str;
 		}
+		operator std::string() &&{
+			return std::move(_str);
+		}
 		
 		size_t size() const { 
 			return _str.size();
@@ -162,65 +182,58 @@ namespace underscore{
 			return _str.c_str();
 		}
 		
+		const char *data() const{
+			return _str.data();
+		}
+		
 		/**
 		 * @short Returns the index of the first ocurrence of that char, or -1.
+		 * 
+		 * The ranged versions search in place, no copy of the range is made.
 		 */
 		ssize_t index(char c) const{
-			auto p=_str.find(c);
-			if (p==std::string::npos)
-				return -1;
-			return p;
+			return ref().index(c);
 		}
 		ssize_t index(char c, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
-			start=_wrap_position(start); end=_wrap_position(end);
-			return slice(start, end).index(c) + start;
+			return ref().index(c, start, end);
 		}
-
-		ssize_t index(const std::string &s) const{
-			auto p=_str.find(s);
-			if (p==std::string::npos)
-				return -1;
-			return p;
+		ssize_t index(const string_ref &s) const{
+			return ref().index(s);
+		}
+		ssize_t index(const string_ref &s, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
+			return ref().index(s, start, end);
 		}
-		ssize_t index(const std::string &s, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
-			start=_wrap_position(start); end=_wrap_position(end);
-			return slice(start, end).index(s) + start;
+		ssize_t index(const searcher &s) const{
+			return ref().index(s);
+		}
+		ssize_t index(const searcher &s, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
+			return ref().index(s, start, end);
 		}
 
+		ssize_t rindex(char c) const{
+			return ref().rindex(c);
+		}
 		ssize_t rindex(char c, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
-			start=_wrap_position(start); end=_wrap_position(end);
-			for(int i=end;i>=start;--i)
-				if (_str[i]==c)
-					return i;
-			return -1;
+			return ref().rindex(c, start, end);
 		}
-		ssize_t rindex(char c) const{
-			auto p=_str.rfind(c);
-			if (p==std::string::npos)
-				return -1;
-			return p;
+		ssize_t rindex(const string_ref &s) const{
+			return ref().rindex(s);
 		}
-
-		ssize_t rindex(const std::string &s, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
-			start=_wrap_position(start); end=_wrap_position(end);
-			return slice(start,end).rindex(s);
+		ssize_t rindex(const string_ref &s, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
+			return ref().rindex(s, start, end);
+		}
+		ssize_t rindex(const searcher &s) const{
+			return ref().rindex(s);
 		}
-		ssize_t rindex(const std::string &s) const{
-			auto p=_str.rfind(s);
-			if (p==std::string::npos)
-				return -1;
-			return p;
+		ssize_t rindex(const searcher &s, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
+			return ref().rindex(s, start, end);
 		}
 
 		string slice(ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
-			start=_wrap_position(start);
-			end=_wrap_position(end);
-			if (end<start)
-				return string();
-			ssize_t s=size();
-			if (start==0 && end==s)
+			auto r=ref().slice(start, end);
+			if (r.size()==size())
 				return *this;
-			return _str.substr(start, end-start);
+			return string(r);
 		}
 
 		string format(const string &a){
@@ -282,25 +295,13 @@ namespace underscore{
 		}
 		
 		long to_long() const {
-			size_t n;
-			long l=stol(_str, &n);
-			if (n!=_str.size())
-				throw std::invalid_argument(_str);
-			return l;
+			return ref().to_long();
 		}
 		double to_double() const {
-			size_t n;
-			double f=stod(_str, &n);
-			if (n!=_str.size())
-				throw std::invalid_argument(_str);
-			return f;
+			return ref().to_double();
 		}
 		float to_float() const {
-			size_t n;
-			float f=stof(_str, &n);
-			if (n!=_str.size())
-				throw std::invalid_argument(_str);
-			return f;
+			return ref().to_float();
 		}
 		
 		friend std::ostream& operator <<(std::ostream &output, const string &str) {
@@ -308,20 +309,121 @@ namespace underscore{
 			return output;
 		}
 
-		bool operator==(const std::string &str){
-			return _str==str;
+		bool operator==(const string_ref &str) const{
+			return ref()==str;
+		}
+		bool operator==(const string &str) const{
+			return _str==str._str;
+		}
+		bool operator!=(const string &str) const{
+			return _str!=str._str;
+		}
+		
+		/**
+		 * @short Replaces the contents, reusing the current memory if it is big enough.
+		 */
+		string &assign(const string_ref &s){
+			_str.assign(s.data(), s.size());
+			return *this;
+		}
+		/**
+		 * @short Appends in place. Used to chain concatenations without copying the left side.
+		 */
+		string &append(const string_ref &s){
+			_str.append(s.data(), s.size());
+			return *this;
+		}
+		string &operator+=(const string_ref &s){
+			return append(s);
+		}
+	};
+	
+	/**
+	 * @short Records pieces and creates the final string with one exact allocation and copy.
+	 * 
+	 * Pieces added as string_ref are borrowed, and must be alive until str() is called. Temporaries
+	 * (std::string&&) are kept by the builder.
+	 * 
+	 * Example:
+	 * 
+	 * 	auto s=(string_builder() << a << ", " << b << ", " << c).str();
+	 */
+	class string_builder{
+		std::vector<string_ref> _pieces;
+		std::vector<std::unique_ptr<std::string>> _owned;
+		size_t _size;
+	public:
+		string_builder() : _size(0){}
+		
+		string_builder &append(const string_ref &s){
+			_pieces.push_back(s);
+			_size+=s.size();
+			return *this;
+		}
+		string_builder &append(const char *s){
+			return append(string_ref(s));
+		}
+		string_builder &append(const std::string &s){
+			return append(string_ref(s));
+		}
+		string_builder &append(const string &s){
+			return append(s.ref());
+		}
+		string_builder &append(std::string &&s){
+			_owned.emplace_back(new std::string(std::move(s)));
+			return append(string_ref(*_owned.back()));
+		}
+		string_builder &append(string &&s){
+			return append(std::string(std::move(s)));
+		}
+		string_builder &append(char c){
+			return append(std::string(1, c));
+		}
+		template<typename T>
+		string_builder &operator<<(T &&v){
+			return append(std::forward<T>(v));
+		}
+		
+		size_t size() const{
+			return _size;
+		}
+		void clear(){
+			_pieces.clear();
+			_owned.clear();
+			_size=0;
+		}
+		
+		/**
+		 * @short Materializes the string: one allocation of the exact size, and one copy per piece.
+		 */
+		string str() const{
+			std::string ret;
+			ret.reserve(_size);
+			for (auto &p: _pieces)
+				ret.append(p.data(), p.size());
+			return string(std::move(ret));
 		}
 	};
 	
 	inline bool operator==(const std::string &a, const string &b){
-		return b==a;
+		return b==string_ref(a);
 	}
 	inline bool operator<(const string &a, const string &b){
-		return std::string(a)<std::string(b);
+		return a.ref()<b.ref();
 	}
 	
 	inline string operator+(const string &a, const string &b){
-		return std::string(a)+std::string(b);
+		std::string ret;
+		ret.reserve(a.size()+b.size());
+		ret.append(a.data(), a.size());
+		ret.append(b.data(), b.size());
+		return string(std::move(ret));
+	}
+	/**
+	 * @short Left side is a temporary (as in a+b+c), so append in place.
+	 */
+	inline string operator+(string &&a, const string &b){
+		return std::move(a.append(b));
 	}
 	
 	inline string _(std::string &&s){
@@ -331,4 +433,13 @@ namespace underscore{
 		return string(std::string(s));
 	}
 
-};
\ No newline at end of file
+};
+
+namespace std{
+	template<>
+	struct hash<underscore::string>{
+		size_t operator()(const underscore::string &s) const{
+			return std::hash<underscore::string_ref>()(s.ref());
+		}
+	};
+};
@@ -0,0 +1,346 @@
+/*
+ *	Copyright 2014 David Moreno Montero <dmoreno@coralbits.com>
+ *
+ *	Licensed under the Apache License, Version 2.0 (the "License");
+ *	you may not use this file except in compliance with the License.
+ *	You may obtain a copy of the License at
+ *
+ *			http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *	Unless required by applicable law or agreed to in writing, software
+ *	distributed under the License is distributed on an "AS IS" BASIS,
+ *	WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *	See the License for the specific language governing permissions and
+ *	limitations under the License.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <climits>
+#include <stdexcept>
+#include <limits>
+#include <iostream>
+#include "sequence.hpp"
+#include "ascii.hpp"
+#include "searcher.hpp"
+
+namespace underscore{
+	class string_ref;
+	class pattern;
+
+	typedef sequence<std::vector<string_ref>> string_ref_list;
+
+	/**
+	 * @short Non owning view over a string buffer, with the same read only API as underscore::string.
+	 *
+	 * All operations return new views into the same buffer, so nothing is allocated (except the
+	 * list itself at split). The buffer must outlive the view.
+	 *
+	 * To get an owning copy, explicitly call str() or construct an underscore::string from it.
+	 *
+	 * Example:
+	 *
+	 * 	std::string line="  ssh    22/tcp  # comment";
+	 * 	auto port=string_ref(line).split(' ')[1].slice(0,-4).to_long(); // == 22, no allocations but the list.
+	 */
+	class string_ref{
+		const char *_data;
+		size_t _size;
+
+		ssize_t _wrap_position(ssize_t p) const{
+			ssize_t s=size();
+			if (p>s)
+				return s;
+			if (p<0){
+				p=s+p;
+				if (p<0)
+					return 0;
+				return p;
+			}
+			return p;
+		}
+
+		template<typename F>
+		F _to_floating(F (*conv)(const char *, char **)) const{
+			char tmp[64];
+			std::string big;
+			const char *cstr;
+			if (_size<sizeof(tmp)){
+				memcpy(tmp, _data, _size);
+				tmp[_size]=0;
+				cstr=tmp;
+			}
+			else{
+				big=str();
+				cstr=big.c_str();
+			}
+			char *end;
+			errno=0;
+			F f=conv(cstr, &end);
+			if (end==cstr || size_t(end-cstr)!=_size)
+				throw std::invalid_argument(str());
+			if (errno==ERANGE)
+				throw std::out_of_range(str());
+			return f;
+		}
+		static float _strtof(const char *s, char **end){ return strtof(s, end); }
+		static double _strtod(const char *s, char **end){ return strtod(s, end); }
+	public:
+		typedef const char *iterator;
+		typedef const char *const_iterator;
+		typedef char value_type;
+
+		string_ref() : _data(""), _size(0){}
+		string_ref(const char *str) : _data(str), _size(strlen(str)){}
+		string_ref(const char *str, size_t size) : _data(str), _size(size){}
+		string_ref(const char *begin, const char *end) : _data(begin), _size(end-begin){}
+		string_ref(const std::string &str) : _data(str.data()), _size(str.size()){}
+
+		const char *data() const{ return _data; }
+		size_t size() const{ return _size; }
+		size_t length() const{ return _size; }
+		bool empty() const{ return _size==0; }
+
+		iterator begin() const{ return _data; }
+		iterator end() const{ return _data+_size; }
+		char operator[](size_t p) const{ return _data[p]; }
+
+		/**
+		 * @short Owning copy. Conversions to owning strings are always explicit.
+		 */
+		std::string str() const{ return std::string(_data, _size); }
+		explicit operator std::string() const{ return str(); }
+
+		string_ref_list split(const char &sep=',', bool insert_empty_elements=false) const {
+			std::vector<string_ref> v;
+			const char *I=_data, *endI=_data+_size;
+			const char *p;
+			do{
+				p=(const char*)memchr(I, sep, endI-I);
+				if (!p)
+					p=endI;
+				if (insert_empty_elements || p!=I)
+					v.push_back(string_ref(I, p));
+				I=p+1;
+			}while(p!=endI);
+
+			return string_ref_list(std::move(v));
+		}
+
+		string_ref_list split(const string_ref &sep, bool insert_empty_elements=false) const {
+			std::vector<string_ref> v;
+			if (sep.empty()){
+				if (insert_empty_elements || !empty())
+					v.push_back(*this);
+				return string_ref_list(std::move(v));
+			}
+			const char *I=_data, *endI=_data+_size;
+			const char *p;
+			do{
+				auto pos=searcher::find_once(I, endI-I, sep._data, sep._size);
+				p=(pos<0) ? endI : I+pos;
+				if (insert_empty_elements || p!=I)
+					v.push_back(string_ref(I, p));
+				I=p+sep._size;
+			}while(p!=endI);
+
+			return string_ref_list(std::move(v));
+		}
+
+		bool startswith(const string_ref &starting) const {
+			return _size>=starting._size && memcmp(_data, starting._data, starting._size)==0;
+		}
+		bool endswith(const string_ref &ending) const {
+			return _size>=ending._size && memcmp(_data+_size-ending._size, ending._data, ending._size)==0;
+		}
+		bool contains(const string_ref &substr) const {
+			return index(substr)!=-1;
+		}
+		bool contains(char c) const {
+			return memchr(_data, c, _size)!=nullptr;
+		}
+		bool contains(const searcher &s) const {
+			return s.find(_data, _size)!=-1;
+		}
+		/**
+		 * @short Checks a compiled glob or regex, see pattern.hpp.
+		 */
+		bool match(const pattern &p) const;
+
+		bool iequals(const string_ref &other) const {
+			return _size==other._size && ascii::iequals(_data, other._data, _size);
+		}
+		bool istartswith(const string_ref &starting) const {
+			return _size>=starting._size && ascii::iequals(_data, starting._data, starting._size);
+		}
+		bool icontains(const string_ref &substr) const {
+			return ascii::ifind(_data, _size, substr._data, substr._size)!=-1;
+		}
+
+		/**
+		 * @short Removes all spaces, new lines and tabs from begining and end.
+		 */
+		string_ref strip() const{
+			const char *b=_data, *e=_data+_size;
+			while (b<e && (*b==' ' || *b=='\n' || *b=='\t'))
+				++b;
+			while (e>b && (e[-1]==' ' || e[-1]=='\n' || e[-1]=='\t'))
+				--e;
+			return string_ref(b, e);
+		}
+
+		string_ref slice(ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
+			start=_wrap_position(start);
+			end=_wrap_position(end);
+			if (end<start)
+				return string_ref();
+			return string_ref(_data+start, end-start);
+		}
+
+		/**
+		 * @short Returns the index of the first ocurrence of that char, or -1.
+		 */
+		ssize_t index(char c) const{
+			auto p=(const char*)memchr(_data, c, _size);
+			return p ? p-_data : -1;
+		}
+		ssize_t index(char c, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
+			start=_wrap_position(start); end=_wrap_position(end);
+			if (end<=start)
+				return -1;
+			auto p=(const char*)memchr(_data+start, c, end-start);
+			return p ? p-_data : -1;
+		}
+		ssize_t index(const searcher &s) const{
+			return s.find(_data, _size);
+		}
+		ssize_t index(const searcher &s, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
+			start=_wrap_position(start); end=_wrap_position(end);
+			if (end<start)
+				return -1;
+			auto p=s.find(_data+start, end-start);
+			return p<0 ? -1 : p+start;
+		}
+		ssize_t index(const string_ref &s) const{
+			return searcher::find_once(_data, _size, s._data, s._size);
+		}
+		ssize_t index(const string_ref &s, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
+			start=_wrap_position(start); end=_wrap_position(end);
+			if (end<start)
+				return -1;
+			auto p=searcher::find_once(_data+start, end-start, s._data, s._size);
+			return p<0 ? -1 : p+start;
+		}
+
+		ssize_t rindex(char c) const{
+			auto p=(const char*)memrchr(_data, c, _size);
+			return p ? p-_data : -1;
+		}
+		ssize_t rindex(char c, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
+			start=_wrap_position(start); end=_wrap_position(end);
+			if (end<=start)
+				return -1;
+			auto p=(const char*)memrchr(_data+start, c, end-start);
+			return p ? p-_data : -1;
+		}
+		ssize_t rindex(const searcher &s) const{
+			return s.rfind(_data, _size);
+		}
+		ssize_t rindex(const searcher &s, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
+			start=_wrap_position(start); end=_wrap_position(end);
+			if (end<start)
+				return -1;
+			auto p=s.rfind(_data+start, end-start);
+			return p<0 ? -1 : p+start;
+		}
+		ssize_t rindex(const string_ref &s) const{
+			return searcher::rfind_once(_data, _size, s._data, s._size);
+		}
+		ssize_t rindex(const string_ref &s, ssize_t start, ssize_t end=std::numeric_limits<ssize_t>::max()) const{
+			start=_wrap_position(start); end=_wrap_position(end);
+			if (end<start)
+				return -1;
+			auto p=searcher::rfind_once(_data+start, end-start, s._data, s._size);
+			return p<0 ? -1 : p+start;
+		}
+
+		/**
+		 * @short Parses a base 10 long. All the view must be used, or it throws std::invalid_argument.
+		 *
+		 * Same rules as std::stol (leading spaces and sign allowed, std::out_of_range on overflow), but without copies.
+		 */
+		long to_long() const {
+			const char *p=_data, *e=_data+_size;
+			while (p<e && isspace(*p))
+				++p;
+			bool neg=false;
+			if (p<e && (*p=='-' || *p=='+')){
+				neg=(*p=='-');
+				++p;
+			}
+			if (p==e)
+				throw std::invalid_argument(str());
+			const unsigned long limit=neg ? (unsigned long)(LONG_MAX)+1 : (unsigned long)(LONG_MAX);
+			unsigned long v=0;
+			for (;p<e;++p){
+				unsigned int d=(unsigned char)*p-'0';
+				if (d>9)
+					throw std::invalid_argument(str());
+				if (v>(limit-d)/10)
+					throw std::out_of_range(str());
+				v=v*10+d;
+			}
+			if (neg)
+				return v==0 ? 0 : -(long)(v-1)-1;
+			return (long)v;
+		}
+		double to_double() const {
+			return _to_floating<double>(_strtod);
+		}
+		float to_float() const {
+			return _to_floating<float>(_strtof);
+		}
+
+		int compare(const string_ref &o) const{
+			int r=memcmp(_data, o._data, std::min(_size, o._size));
+			if (r!=0)
+				return r;
+			return (_size<o._size) ? -1 : (_size>o._size ? 1 : 0);
+		}
+
+		friend std::ostream& operator <<(std::ostream &output, const string_ref &str) {
+			output.write(str._data, str._size);
+			return output;
+		}
+	};
+
+	inline bool operator==(const string_ref &a, const string_ref &b){
+		return a.size()==b.size() && memcmp(a.data(), b.data(), a.size())==0;
+	}
+	inline bool operator!=(const string_ref &a, const string_ref &b){
+		return !(a==b);
+	}
+	inline bool operator<(const string_ref &a, const string_ref &b){
+		return a.compare(b)<0;
+	}
+};
+
+namespace std{
+	template<>
+	struct hash<underscore::string_ref>{
+		size_t operator()(const underscore::string_ref &s) const{
+			// FNV-1a
+			size_t h=14695981039346656037ULL;
+			for (auto c: s){
+				h^=(unsigned char)c;
+				h*=1099511628211ULL;
+			}
+			return h;
+		}
+	};
+};
@@ -5,6 +5,15 @@
 #include "file.hpp"
 #include "range.hpp"
 #include "underscore.hpp"
+#include "intern.hpp"
+#include "packed_string_list.hpp"
+#include "rope.hpp"
+#include "mmap_file.hpp"
+#include "parallel_file.hpp"
+#include "files.hpp"
+#include "csv.hpp"
+#include "follow_file.hpp"
+#include "sink.hpp"
 
 #include <vector>
 #include <iostream>
@@ -246,6 +255,936 @@ void g03_slice(){
 		n++;
 	}
 	FAIL_IF_NOT_EQUAL_INT(n,5);
+	
+	// Negative positions count from the end, as sequence::slice does
+	auto abc=[]{ return vector({"a","b","c","d","e"}); };
+	FAIL_IF_NOT_EQUAL_STRING(abc().slice(-2).to_vector().join(","), "d,e");
+	FAIL_IF_NOT_EQUAL_STRING(abc().slice(-10).to_vector().join(","), "a,b,c,d,e");
+	FAIL_IF_NOT_EQUAL_STRING(abc().slice(0,-2).to_vector().join(","), "a,b,c");
+	FAIL_IF_NOT_EQUAL_STRING(abc().slice(1,-1).to_vector().join(","), "b,c,d");
+	FAIL_IF_NOT_EQUAL_STRING(abc().slice(-3,-1).to_vector().join(","), "c,d");
+	FAIL_IF_NOT_EQUAL_STRING(abc().slice(-3,3).to_vector().join(","), "c");
+	FAIL_IF_NOT_EQUAL_INT(abc().slice(-2,2).count(), 0);
+	FAIL_IF_NOT_EQUAL_INT(abc().slice(0,-10).count(), 0);
+	FAIL_IF_NOT_EQUAL_INT(abc().slice(7,-1).count(), 0);
+	FAIL_IF_NOT_EQUAL_INT(file("/etc/services").slice(-3).count(), 3);
+	FAIL_IF_NOT_EQUAL_INT(file("/etc/services").slice(0,-3).count()+3, file("/etc/services").count());
+	END_LOCAL();
+}
+
+class countdown : public generator<countdown>{
+	int n;
+public:
+	countdown(int _n) : n(_n){}
+	bool empty(){ return n<=0; }
+	underscore::string get_next(){ return std::to_string(n--); }
+};
+
+void g04_next(){
+	INIT_LOCAL();
+	
+	auto v=underscore::vector({"a","b","c","d","e"});
+	underscore::string s;
+	FAIL_IF_NOT(v.next(s));
+	FAIL_IF_NOT_EQUAL_STRING(s, "a");
+	FAIL_IF_NOT_EQUAL_STRING(v.get_next(), "b");
+	FAIL_IF_NOT_EQUAL_STRING(v.to_vector().join(""), "cde");
+	FAIL_IF(v.next(s));
+	FAIL_IF_NOT_EXCEPTION(v.get_next());
+	
+	FAIL_IF_NOT_EQUAL_STRING(underscore::vector({"a","b","c","d","e"}).slice(1,3).to_vector().join(""), "bc");
+	FAIL_IF_NOT_EQUAL_STRING(countdown(3).map([](const underscore::string &s){ return s+"!"; }).to_vector().join(""), "3!2!1!");
+	
+	int n=0, empty=0;
+	for (auto &l: file("/etc/services")){
+		n++;
+		if (l.empty())
+			empty++;
+	}
+	std::ifstream ifs("/etc/services");
+	std::string line;
+	int expected=0, expected_empty=0;
+	while (std::getline(ifs, line)){
+		expected++;
+		if (line.empty())
+			expected_empty++;
+	}
+	FAIL_IF_NOT_EQUAL_INT(n, expected);
+	FAIL_IF_NOT_EQUAL_INT(empty, expected_empty);
+	
+	END_LOCAL();
+}
+
+void g05_typed(){
+	INIT_LOCAL();
+	
+	auto ports=underscore::vector({"ssh 22/tcp","dns 53/udp","www 80/tcp"})
+		.map<string_list>([](const underscore::string &s){ return s.split(' '); })
+		.filter([](const string_list &l){ return l[1].endswith("/tcp"); })
+		.map<long>([](string_list &&l){ return l[1].slice(0,-4).to_long(); })
+		.to_vector();
+	FAIL_IF_NOT_EQUAL_INT(ports.count(), 2);
+	FAIL_IF_NOT_EQUAL_INT(ports[0], 22);
+	FAIL_IF_NOT_EQUAL_INT(ports[1], 80);
+	
+	auto squares=vector_of<int>({1,2,3,4,5})
+		.map([](int &&i){ return i*i; })
+		.filter([](const int &i){ return i%2==1; })
+		.slice(1);
+	int sum=0;
+	for (auto i: squares)
+		sum+=i;
+	FAIL_IF_NOT_EQUAL_INT(sum, 9+25);
+	
+	std::vector<std::string> strs=underscore::vector({"a","b"}).map([](underscore::string &&s){ return s+"!"; });
+	FAIL_IF_NOT_EQUAL_STRING(strs[1], "b!");
+	
+	// The result type is the lambda one, even if it converts to the input type
+	auto lengths=underscore::vector({"a","bb","ccc"}).map([](const underscore::string &s){ return s.size(); });
+	static_assert(std::is_same<decltype(lengths)::value_type, size_t>::value, "map keeps the lambda result type");
+	FAIL_IF_NOT_EQUAL_INT(lengths.sum(), 6);
+	auto owned=vector_of<string_ref>({string_ref("ab"), string_ref("c")}).map([](string_ref &&r){ return r.str()+"!"; });
+	static_assert(std::is_same<decltype(owned)::value_type, std::string>::value, "no views to temporaries");
+	FAIL_IF_NOT_EQUAL_STRING(owned.to_vector().join("|"), "ab!|c!");
+	FAIL_IF_NOT_EQUAL_STRING(underscore::vector({"a"}).map<underscore::string>([](underscore::string &&s){ return s.size(); }).to_vector().join(), "1");
+	
+	END_LOCAL();
+}
+
+void g06_mmap_file(){
+	INIT_LOCAL();
+	
+	std::vector<std::string> expected;
+	std::ifstream ifs("/etc/services");
+	std::string line;
+	while (std::getline(ifs, line))
+		expected.push_back(line);
+	
+	auto services=mmap_file("/etc/services");
+	FAIL_IF_NOT(services.is_mapped());
+	auto lines=mmap_file(services).to_vector(); // Copies share the mapping, that must outlive the views
+
+	FAIL_IF_NOT_EQUAL_INT(lines.size(), expected.size());
+	FAIL_IF_NOT_EQUAL_STRING(lines[10].str(), expected[10]);
+	FAIL_IF_NOT_EQUAL_STRING(lines[lines.size()-1].str(), expected.back());
+	
+	auto tcp=mmap_file(services).filter(searcher("/tcp")).to_vector();
+	FAIL_IF_NOT(tcp.size()>0);
+	FAIL_IF_NOT(tcp.all([](const string_ref &l){ return l.contains("/tcp"); }));
+	
+	{
+		std::ofstream out("/tmp/underscore-test-mmap.txt");
+		out<<"first\n\nthird";
+	}
+	FAIL_IF_NOT_EQUAL_STRING(mmap_file("/tmp/underscore-test-mmap.txt").to_vector().join("|"), "first||third");
+	unlink("/tmp/underscore-test-mmap.txt");
+	
+	auto proc=mmap_file("/proc/self/status");
+	FAIL_IF(proc.is_mapped());
+	FAIL_IF_NOT(proc.to_vector()[0].startswith("Name:"));
+	
+	FAIL_IF(mmap_file("/does/not/exist").is_open());
+	FAIL_IF_NOT_EQUAL_INT(mmap_file("/does/not/exist").to_vector().size(), 0);
+	
+	END_LOCAL();
+}
+
+void g07_fd_file(){
+	INIT_LOCAL();
+	
+	int fds[2];
+	FAIL_IF(pipe(fds)!=0);
+	std::string data="short\na much longer line than the buffer\n\nlast";
+	FAIL_IF_NOT_EQUAL_INT(write(fds[1], data.data(), data.size()), data.size());
+	close(fds[1]);
+	auto lines=fd_file(fds[0], 8).map<std::string>([](string_ref &&l){ return l.str(); }).to_vector();
+	close(fds[0]);
+	FAIL_IF_NOT_EQUAL_STRING(lines.join("|"), "short|a much longer line than the buffer||last");
+	
+	FAIL_IF_NOT(file("/etc/services").is_mapped());
+	auto status=file("/proc/self/status");
+	FAIL_IF(status.is_mapped());
+	FAIL_IF_NOT(status.get_next().startswith("Name:"));
+	
+	int n=0;
+	for (auto &l: fd_file("/etc/services", 100))
+		n+=l.contains("/tcp");
+	FAIL_IF_NOT_EQUAL_INT(n, file("/etc/services").filter([](const underscore::string &l){ return l.contains("/tcp"); }).to_vector().size());
+	
+	FAIL_IF(fd_file("/does/not/exist").is_open());
+	FAIL_IF_NOT_EXCEPTION(fd_file("/tmp").count()); // EISDIR is an error, not an empty file
+	
+	// Nonblocking pipe: EAGAIN waits for the writer
+	FAIL_IF(pipe(fds)!=0);
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	int written=0;
+	std::thread writer([&fds, &written](){
+		for (int i=0;i<3;i++){
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			written+=write(fds[1], "slow\n", 5);
+		}
+		close(fds[1]);
+	});
+	FAIL_IF_NOT_EQUAL_INT(fd_file(fds[0], 16).count(), 3);
+	writer.join();
+	FAIL_IF_NOT_EQUAL_INT(written, 15);
+	close(fds[0]);
+	
+	END_LOCAL();
+}
+
+void g08_parallel_file(){
+	INIT_LOCAL();
+	
+	auto services=parallel_file("/etc/services", 4, 1000);
+	FAIL_IF_NOT(services.chunks().size()>4);
+	auto tcp=[](mmap_file &&chunk){ return chunk.filter(searcher("/tcp")); };
+	auto sequential=mmap_file("/etc/services");
+	auto expected=mmap_file(sequential).filter(searcher("/tcp")).to_vector();
+	FAIL_IF_NOT_EQUAL_INT(services.count(tcp), expected.size());
+	
+	auto ordered=services.collect(tcp);
+	FAIL_IF_NOT_EQUAL_INT(ordered.size(), expected.size());
+	FAIL_IF_NOT(std::equal(ordered.begin(), ordered.end(), expected.begin()));
+	
+	auto bytes=services.reduce([](mmap_file &&chunk){ return chunk.map<size_t>([](string_ref &&l){ return l.size()+1; }); }, size_t(0),
+								[](size_t a, size_t b){ return a+b; });
+	std::ifstream ifs("/etc/services", std::ifstream::ate | std::ifstream::binary);
+	FAIL_IF_NOT_EQUAL_INT(bytes, ifs.tellg());
+	// init is added once, whatever the number of chunks
+	auto lengths=[](mmap_file &&chunk){ return chunk.map<size_t>([](string_ref &&l){ return l.size()+1; }); };
+	auto plus=[](size_t a, size_t b){ return a+b; };
+	for (size_t chunk_size: {size_t(1), size_t(4096), size_t(1)<<30}){
+		parallel_file split("/etc/services", 4, chunk_size);
+		FAIL_IF_NOT_EQUAL_INT(split.reduce(lengths, size_t(10), plus), bytes+10);
+	}
+	FAIL_IF_NOT_EQUAL_INT(parallel_file("/does/not/exist").reduce(lengths, size_t(10), plus), 10);
+	
+	FAIL_IF_NOT_EXCEPTION(services.count([](mmap_file &&chunk){
+		return chunk.filter([](const string_ref &) -> bool{ throw std::runtime_error("stage failed"); });
+	}));
+	
+	END_LOCAL();
+}
+
+void g09_prefetch_file(){
+	INIT_LOCAL();
+	
+	std::string data;
+	for (int i=0;i<5000;i++)
+		data+=std::to_string(i)+(i%100 ? "" : std::string(3000, 'x'))+"\n";
+	data+="last";
+	{
+		std::ofstream out("/tmp/underscore-test-prefetch.txt");
+		out<<data;
+	}
+	auto expected=underscore::string(data).split('\n', true).join("|");
+	// Asking for io_uring falls back to the thread where it is not available (old kernels, sandboxes)
+	bool has_uring=prefetch_file("/tmp/underscore-test-prefetch.txt", 1000, 3).backend()==prefetch_file::uring;
+	for (auto backend: {prefetch_file::uring, prefetch_file::thread}){
+		auto f=prefetch_file("/tmp/underscore-test-prefetch.txt", 1000, 3, backend);
+		if (backend==prefetch_file::uring && !has_uring){
+			FAIL_IF_NOT(f.backend()==prefetch_file::thread);
+			continue;
+		}
+		FAIL_IF_NOT(f.backend()==backend);
+		auto lines=std::move(f).map<std::string>([](string_ref &&l){ return l.str(); }).to_vector();
+		FAIL_IF_NOT_EQUAL_INT(lines.size(), 5001);
+		FAIL_IF_NOT(lines.join("|")==expected);
+	}
+	FAIL_IF_NOT_EQUAL_STRING(file::prefetched("/tmp/underscore-test-prefetch.txt").get_next(), "0"+std::string(3000, 'x'));
+	unlink("/tmp/underscore-test-prefetch.txt");
+	
+	FAIL_IF(prefetch_file("/does/not/exist").is_open());
+	FAIL_IF_NOT_EQUAL_INT(prefetch_file("/does/not/exist").to_vector().size(), 0);
+	FAIL_IF_NOT_EXCEPTION(prefetch_file("/tmp", 1000, 3).count()); // Read errors are not the end of the file
+	
+	int fds[2];
+	FAIL_IF(pipe(fds)!=0);
+	FAIL_IF(write(fds[1], "open\n", 5)!=5);
+	{
+		prefetch_file waiting(fds[0], 1000, 3); // Its thread waits for more, the writer is still there
+		FAIL_IF_NOT(waiting.backend()==prefetch_file::thread);
+	}
+	close(fds[0]);
+	close(fds[1]);
+	
+	END_LOCAL();
+}
+
+void g10_terminals(){
+	INIT_LOCAL();
+	
+	auto numbers=[](){ return vector_of<int>({5,3,8,1,9,2}); };
+	FAIL_IF_NOT_EQUAL_INT(numbers().count(), 6);
+	FAIL_IF_NOT_EQUAL_INT(numbers().count([](int i){ return i>4; }), 3);
+	FAIL_IF_NOT_EQUAL_INT(numbers().sum(), 28);
+	FAIL_IF_NOT_EQUAL_INT(numbers().reduce<int>([](int v, int acc){ return acc+v*v; }, 0), 184);
+	FAIL_IF_NOT_EQUAL_STRING(numbers().fold(std::string(), [](std::string &&acc, int v){ return acc+std::to_string(v); }), "538192");
+	FAIL_IF_NOT_EQUAL_INT(numbers().max(), 9);
+	FAIL_IF_NOT_EQUAL_INT(numbers().min(), 1);
+	FAIL_IF_NOT_EQUAL_INT(vector_of<int>({}).max(), 0);
+	
+	int seen=0;
+	FAIL_IF_NOT(numbers().map([&seen](int &&i){ seen++; return i; }).any([](int i){ return i==8; }));
+	FAIL_IF_NOT_EQUAL_INT(seen, 3); // Stops at the first
+	FAIL_IF(numbers().all([](int i){ return i<9; }));
+	FAIL_IF_NOT(numbers().all([](int i){ return i>0; }));
+	int total=0;
+	numbers().each([&total](int i){ total+=i; });
+	FAIL_IF_NOT_EQUAL_INT(total, 28);
+	
+	auto words=[](){ return underscore::vector({"ssh","sftp","dns","http","ftp","smtp"}); };
+	auto by_first=words().group_by([](const underscore::string &s){ return s.data()[0]; });
+	FAIL_IF_NOT_EQUAL_INT(by_first.size(), 4);
+	FAIL_IF_NOT_EQUAL_INT(by_first['s'].size(), 3);
+	FAIL_IF_NOT_EQUAL_STRING(by_first['s'][2], "smtp");
+	auto length_by_first=words().group_by([](const underscore::string &s){ return s.data()[0]; }, size_t(0),
+								[](size_t acc, underscore::string &&s){ return acc+s.size(); });
+	FAIL_IF_NOT_EQUAL_INT(length_by_first['s'], 11);
+	auto by_size=words().count_by([](const underscore::string &s){ return s.size(); });
+	FAIL_IF_NOT_EQUAL_INT(by_size[3], 3);
+	FAIL_IF_NOT_EQUAL_INT(by_size[4], 3);
+	auto lengths=words().to_map([](const underscore::string &s){ return s; }, [](const underscore::string &s){ return s.size(); });
+	FAIL_IF_NOT_EQUAL_INT(lengths[_("http")], 4);
+	
+	auto ports=underscore::vector({"ssh 22","dns 53"})
+		.map<std::pair<std::string,int>>([](const underscore::string &s){ auto p=s.split(' '); return std::make_pair(std::string(p[0]), int(p[1].to_long())); })
+		.to_map<std::string,int>();
+	FAIL_IF_NOT_EQUAL_INT(ports["dns"], 53);
+	
+	END_LOCAL();
+}
+
+void g11_external_sort(){
+	INIT_LOCAL();
+	
+	std::vector<int> numbers;
+	for (int i=0;i<10000;i++)
+		numbers.push_back((i*7919)%5003);
+	std::vector<int> expected=numbers;
+	std::stable_sort(expected.begin(), expected.end());
+	
+	auto in_memory=vector_of<int>(numbers).external_sort();
+	std::vector<int> sorted=in_memory;
+	FAIL_IF_NOT_EQUAL_INT(in_memory.runs(), 1);
+	FAIL_IF_NOT(sorted==expected);
+	
+	auto spilled=vector_of<int>(numbers).external_sort(4096);
+	sorted=spilled;
+	FAIL_IF_NOT_EQUAL_INT(spilled.runs(), 10); // 1024 ints per run
+	FAIL_IF_NOT(sorted==expected);
+	
+	sorted=vector_of<int>(numbers).external_sort(4096, false, 3);
+	FAIL_IF_NOT(sorted==expected);
+	
+	expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+	sorted=vector_of<int>(numbers).external_sort(4096, true);
+	FAIL_IF_NOT_EQUAL_INT(sorted.size(), 5003);
+	FAIL_IF_NOT(sorted==expected);
+	
+	auto words=underscore::vector({"smtp","dns","ssh","","dns","http","ftp","ssh","sftp"})
+		.external_sort(40, true).to_vector();
+	FAIL_IF_NOT_EQUAL_STRING(words.join(","), ",dns,ftp,http,sftp,smtp,ssh");
+	
+	FAIL_IF_NOT_EQUAL_INT(vector_of<int>({}).external_sort(16).count(), 0);
+	
+	// More runs than the fan in: merged in several passes
+	std::vector<int> many;
+	for (int i=0;i<16*4095+5;i++) // 4095 spilled runs of 16 ints, plus 5 in memory
+		many.push_back((i*7919)%65521);
+	expected=many;
+	std::sort(expected.begin(), expected.end());
+	auto passes=vector_of<int>(many).external_sort(64);
+	sorted=passes;
+	FAIL_IF_NOT_EQUAL_INT(passes.runs(), 64);
+	FAIL_IF_NOT(sorted==expected);
+	sorted=vector_of<int>(many).external_sort(64, false, 3);
+	FAIL_IF_NOT(sorted==expected);
+	expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+	sorted=vector_of<int>(many).external_sort(64, true);
+	FAIL_IF_NOT(sorted==expected);
+	
+	// The end of a run is told apart from a truncated one
+	{
+		FILE *f=tmpfile();
+		detail::run_codec<std::string>::write(f, "sftp");
+		fwrite("\x05" "ab", 1, 3, f); // Says 5 bytes, has 2
+		rewind(f);
+		std::string v;
+		FAIL_IF_NOT(detail::run_codec<std::string>::read(f, v));
+		FAIL_IF_NOT_EQUAL_STRING(v, "sftp");
+		FAIL_IF_NOT_EXCEPTION(detail::run_codec<std::string>::read(f, v));
+		fclose(f);
+		
+		f=tmpfile();
+		int n=42;
+		detail::run_codec<int>::write(f, n);
+		fwrite(&n, 1, 2, f);
+		rewind(f);
+		FAIL_IF_NOT(detail::run_codec<int>::read(f, n));
+		FAIL_IF_NOT_EXCEPTION(detail::run_codec<int>::read(f, n));
+		rewind(f);
+		FAIL_IF(ftruncate(fileno(f), sizeof(int))!=0);
+		FAIL_IF_NOT(detail::run_codec<int>::read(f, n));
+		FAIL_IF(detail::run_codec<int>::read(f, n)); // Clean end
+		fclose(f);
+	}
+	
+	END_LOCAL();
+}
+
+void g12_top_k(){
+	INIT_LOCAL();
+	
+	auto numbers=[](){ return vector_of<int>({5,3,8,1,9,2,8,7}); };
+	FAIL_IF_NOT_EQUAL_STRING(numbers().top_k(3).join(","), "9,8,8");
+	FAIL_IF_NOT_EQUAL_STRING(numbers().bottom_k(3).join(","), "1,2,3");
+	FAIL_IF_NOT_EQUAL_STRING(numbers().sort(4).join(","), numbers().sort().slice(0,4).join(","));
+	FAIL_IF_NOT_EQUAL_INT(numbers().top_k(100).size(), 8);
+	FAIL_IF_NOT_EQUAL_INT(numbers().top_k(0).size(), 0);
+	
+	auto words=[](){ return underscore::vector({"ssh","sftp","dns","http","ftp","smtp"}); };
+	auto longest=words().top_k(3, [](const underscore::string &s){ return s.size(); });
+	FAIL_IF_NOT_EQUAL_STRING(longest.join(","), "sftp,http,smtp"); // Ties keep the order
+	auto shortest=words().bottom_k(2, [](const underscore::string &s){ return s.size(); });
+	FAIL_IF_NOT_EQUAL_STRING(shortest.join(","), "ssh,dns");
+	
+	auto services=parallel_file("/etc/services", 4, 1000);
+	auto lines=[](mmap_file &&chunk){ return chunk.map<underscore::string>([](string_ref &&l){ return underscore::string(l); }); };
+	auto length=[](const underscore::string &l){ return l.size(); };
+	auto sequential=file("/etc/services").top_k(10, length);
+	auto parallel=services.top_k(lines, 10, length);
+	FAIL_IF_NOT_EQUAL_INT(parallel.size(), 10);
+	FAIL_IF_NOT(std::equal(parallel.begin(), parallel.end(), sequential.begin()));
+	FAIL_IF_NOT_EQUAL_STRING(services.bottom_k(lines, 5).join("|"), file("/etc/services").sort(5).join("|"));
+	
+	END_LOCAL();
+}
+
+void g13_async(){
+	INIT_LOCAL();
+	
+	std::vector<int> numbers;
+	for (int i=0;i<10000;i++)
+		numbers.push_back(i);
+	
+	auto twice=vector_of<int>(numbers).async(16).map([](int i){ return i*2; }).async();
+	FAIL_IF_NOT_EQUAL_INT(twice.sum<long>(), 99990000L);
+	
+	std::vector<int> ordered=vector_of<int>(numbers).parallel_map([](int i){ return i+1; }, 3, true, 8);
+	FAIL_IF_NOT_EQUAL_INT(ordered.size(), 10000);
+	FAIL_IF_NOT_EQUAL_INT(ordered[0], 1);
+	FAIL_IF_NOT_EQUAL_INT(ordered[9999], 10000);
+	FAIL_IF_NOT(std::is_sorted(ordered.begin(), ordered.end()));
+	
+	auto unordered=vector_of<int>(numbers).parallel_map([](int i){ return i; }, 3, false);
+	FAIL_IF_NOT_EQUAL_INT(unordered.sum<long>(), 49995000L);
+	
+	auto lines=file("/etc/services").async().parallel_map([](underscore::string &&l){ return l.strip(); }, 2).to_vector();
+	auto expected=file("/etc/services").map([](underscore::string &&l){ return l.strip(); }).to_vector();
+	FAIL_IF_NOT_EQUAL_INT(lines.size(), expected.size());
+	FAIL_IF_NOT(std::equal(lines.begin(), lines.end(), expected.begin()));
+	
+	FAIL_IF_NOT_EXCEPTION(vector_of<int>(numbers).parallel_map([](int i){ if (i==777) throw std::runtime_error("map failed"); return i; }, 2).count());
+	FAIL_IF_NOT_EXCEPTION(vector_of<int>(numbers).map([](int i){ if (i==777) throw std::runtime_error("map failed"); return i; }).async().count());
+	
+	{ // Not fully consumed: the threads stop at destruction
+		auto partial=vector_of<int>(numbers).parallel_map([](int i){ return i; }, 2);
+		int first;
+		FAIL_IF_NOT(partial.next(first));
+		FAIL_IF_NOT_EQUAL_INT(first, 0);
+	}
+	
+	// Results of bool: no two threads write the same word
+	std::vector<bool> even=vector_of<int>(numbers).parallel_map([](int i){ return i%2==0; }, 4, true, 64);
+	FAIL_IF_NOT_EQUAL_INT(std::count(even.begin(), even.end(), true), 5000);
+	FAIL_IF_NOT(even[0] && !even[1] && even[9998] && !even[9999]);
+	
+	// Destroyed while the previous stages wait for a pipe: they are not waited for
+	int fds[2], fds2[2];
+	FAIL_IF(pipe(fds)!=0 || pipe(fds2)!=0);
+	FAIL_IF(write(fds[1], "a\nb\n", 4)!=4);
+	FAIL_IF(write(fds2[1], "c\n", 2)!=2);
+	{
+		auto waiting=fd_file(fds[0], 64).map([](string_ref &&l){ return l.str(); }).async();
+		std::string line;
+		FAIL_IF_NOT(waiting.next(line));
+		FAIL_IF_NOT_EQUAL_STRING(line, "a");
+		FAIL_IF_NOT(waiting.next(line));
+		FAIL_IF_NOT_EQUAL_STRING(line, "b");
+	}
+	{
+		auto waiting=fd_file(fds2[0], 64).map([](string_ref &&l){ return l.str(); }).parallel_map([](std::string &&l){ return l.size(); }, 2);
+		size_t n=0;
+		FAIL_IF_NOT(waiting.next(n));
+		FAIL_IF_NOT_EQUAL_INT(n, 1);
+	}
+	close(fds[1]); // The threads left end now; the read ends are not closed, they may still be reading
+	close(fds2[1]);
+	
+	END_LOCAL();
+}
+
+void g14_next_batch(){
+	INIT_LOCAL();
+	
+	std::vector<int> numbers;
+	for (int i=0;i<1000;i++)
+		numbers.push_back(i);
+	auto pipeline=[&numbers](){
+		return vector_of<int>(numbers).filter([](int i){ return i%3==0; }).map([](int &&i){ return i*2; });
+	};
+	std::vector<int> expected=pipeline();
+	
+	auto gen=pipeline();
+	std::vector<int> batch(64), got;
+	size_t n;
+	while ((n=gen.next_batch(batch.data(), batch.size()))){
+		FAIL_IF(n>64);
+		got.insert(got.end(), batch.begin(), batch.begin()+n);
+	}
+	FAIL_IF_NOT_EQUAL_INT(got.size(), 334);
+	FAIL_IF_NOT(got==expected);
+	
+	// Old style generators go through the adapter
+	auto legacy=countdown(5);
+	std::vector<underscore::string> counted(3);
+	FAIL_IF_NOT_EQUAL_INT(legacy.next_batch(counted.data(), 3), 3);
+	FAIL_IF_NOT_EQUAL_STRING(counted[0], "5");
+	FAIL_IF_NOT_EQUAL_INT(legacy.next_batch(counted.data(), 3), 2);
+	FAIL_IF_NOT_EQUAL_INT(legacy.next_batch(counted.data(), 3), 0);
+	
+	// Views of a batch stay valid together, also from the read() source with a small buffer
+	auto mapped=mmap_file("/etc/services");
+	std::vector<string_ref> lines(100);
+	n=mmap_file(mapped).next_batch(lines.data(), lines.size());
+	FAIL_IF_NOT_EQUAL_INT(n, 100);
+	auto fd=fd_file("/etc/services", 512);
+	std::vector<string_ref> read_lines(100);
+	size_t total=0, first=fd.next_batch(read_lines.data(), read_lines.size());
+	FAIL_IF_NOT(first>0 && first<100);
+	FAIL_IF_NOT(std::equal(read_lines.begin(), read_lines.begin()+first, lines.begin()));
+	total=first;
+	while ((n=fd.next_batch(read_lines.data(), read_lines.size())))
+		total+=n;
+	FAIL_IF_NOT_EQUAL_INT(total, mmap_file(mapped).count());
+	
+	std::vector<underscore::string> strings(50);
+	auto services=file("/etc/services").filter([](const underscore::string &l){ return l.contains("/tcp"); });
+	total=0;
+	bool all_tcp=true;
+	while ((n=services.next_batch(strings.data(), strings.size()))){
+		for (size_t i=0;i<n;i++)
+			all_tcp=all_tcp && strings[i].contains("/tcp");
+		total+=n;
+	}
+	FAIL_IF_NOT(all_tcp);
+	FAIL_IF_NOT_EQUAL_INT(total, file("/etc/services").filter([](const underscore::string &l){ return l.contains("/tcp"); }).count());
+	
+	END_LOCAL();
+}
+
+void g15_take_skip(){
+	INIT_LOCAL();
+	
+	auto numbers=[](){ return vector_of<int>({1,2,3,4,5,6,7,8,9,10}); };
+	FAIL_IF_NOT_EQUAL_STRING(numbers().take(3).to_vector().join(","), "1,2,3");
+	FAIL_IF_NOT_EQUAL_STRING(numbers().skip(7).to_vector().join(","), "8,9,10");
+	FAIL_IF_NOT_EQUAL_STRING(numbers().slice(2,5).to_vector().join(","), "3,4,5");
+	FAIL_IF_NOT_EQUAL_INT(numbers().skip(20).count(), 0);
+	FAIL_IF_NOT_EQUAL_STRING(numbers().take_while([](int i){ return i<4; }).to_vector().join(","), "1,2,3");
+	FAIL_IF_NOT_EQUAL_STRING(numbers().drop_while([](int i){ return i<8; }).to_vector().join(","), "8,9,10");
+	FAIL_IF_NOT_EQUAL_STRING(numbers().drop_while([](int i){ return i<3; }).skip(5).to_vector().join(","), "8,9,10");
+	
+	int mapped=0, pulled=0;
+	auto counted=[&](){
+		return numbers().map([&pulled](int &&i){ pulled++; return i; }).map([&mapped](int &&i){ mapped++; return i*10; });
+	};
+	FAIL_IF_NOT_EQUAL_STRING(counted().skip(6).take(2).to_vector().join(","), "70,80");
+	FAIL_IF_NOT_EQUAL_INT(mapped, 2); // Skipped elements are not mapped, and it stops after 2
+	FAIL_IF_NOT_EQUAL_INT(pulled, 2);
+	pulled=0;
+	FAIL_IF_NOT_EQUAL_INT(counted().take_while([](int i){ return i<30; }).count(), 2);
+	FAIL_IF_NOT_EQUAL_INT(pulled, 3);
+	
+	auto mapped_file=mmap_file("/etc/services");
+	auto expected=mmap_file(mapped_file).slice(10, 15).to_vector();
+	auto lines=mmap_file(mapped_file).to_vector();
+	FAIL_IF_NOT_EQUAL_INT(expected.size(), 5);
+	FAIL_IF_NOT(expected[0]==lines[10]);
+	auto through_file=file("/etc/services").skip(10).take(5).to_vector();
+	FAIL_IF_NOT_EQUAL_INT(through_file.size(), 5);
+	FAIL_IF_NOT(through_file[0]==lines[10]);
+	auto through_fd=fd_file("/etc/services", 64).skip(10).take(5).map<underscore::string>([](string_ref &&l){ return underscore::string(l); }).to_vector();
+	FAIL_IF_NOT_EQUAL_INT(through_fd.size(), 5);
+	FAIL_IF_NOT(through_fd[4]==lines[14]);
+	FAIL_IF_NOT_EQUAL_INT(fd_file("/etc/services", 64).skip(lines.size()-1).count(), 1);
+	FAIL_IF_NOT_EQUAL_INT(fd_file("/etc/services", 64).advance(lines.size()+10), lines.size());
+	
+	END_LOCAL();
+}
+
+void g16_write_to(){
+	INIT_LOCAL();
+	
+	auto read=[](const std::string &path){
+		std::ifstream ifs(path);
+		return std::string((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+	};
+	std::string path="/tmp/underscore-test-sink";
+	
+	auto tcp=[](){ return file("/etc/services").filter([](const underscore::string &l){ return l.contains("/tcp"); }); };
+	std::string expected;
+	for (auto &l: tcp())
+		expected+=std::string(l)+"\n";
+	FAIL_IF_NOT_EQUAL_INT(tcp().write_to(path), tcp().count());
+	FAIL_IF_NOT(read(path)==expected);
+	
+	std::vector<int> numbers;
+	std::string numbers_text;
+	for (int i=0;i<100000;i++){
+		numbers.push_back(i);
+		numbers_text+=std::to_string(i)+",";
+	}
+	FAIL_IF_NOT_EQUAL_INT(vector_of<int>(numbers).write_to(path, ",", true), 100000);
+	FAIL_IF_NOT(read(path)==numbers_text);
+	
+	auto words=_({"ssh","sftp","dns"});
+	FAIL_IF_NOT_EQUAL_INT(words.write_to(path, " | "), 3);
+	FAIL_IF_NOT_EQUAL_STRING(read(path), "ssh | sftp | dns | ");
+	FAIL_IF_NOT_EQUAL_INT(write_to(std::vector<std::string>{"a","b"}, path, ""), 2);
+	FAIL_IF_NOT_EQUAL_STRING(read(path), "ab");
+	
+	{
+		sink out(path, "", true, 16);
+		for (int i=0;i<1000;i++)
+			out.write_ref(words[i%3]);
+		out.write(std::string("!"));
+		out.flush();
+		FAIL_IF_NOT_EQUAL_INT(read(path).size(), 3334);
+	}
+	{
+		sink out(path, ",", true, 64);
+		char buffer[8];
+		std::string text;
+		for (int i=0;i<1000;i++){ // Views are copied: the buffer changes after each write
+			int n=snprintf(buffer, sizeof(buffer), "%d", i);
+			out.write(string_ref(buffer, n));
+			text+=std::string(buffer, n)+",";
+		}
+		out.write(string_ref(std::string(100000, 'x'))); // Bigger than a chunk
+		out.close();
+		FAIL_IF_NOT(read(path)==text+std::string(100000, 'x')+",");
+	}
+	FAIL_IF_NOT_EQUAL_INT(mmap_file("/etc/services").write_to(path), file("/etc/services").count());
+	FAIL_IF_NOT(read(path)==read("/etc/services"));
+	unlink(path.c_str());
+	
+	FAIL_IF_NOT_EXCEPTION(_({"a"}).write_to("/nonexistent/dir/file"));
+	{
+		sink out(path);
+		out.write(std::string("a"));
+		out.close();
+		FAIL_IF_NOT_EXCEPTION(out.write(std::string("b")));
+		FAIL_IF_NOT_EXCEPTION(out.write_ref("b"));
+		FAIL_IF_NOT_EXCEPTION(out.flush());
+		out.close();
+	}
+	unlink(path.c_str());
+	
+	END_LOCAL();
+}
+
+void g17_files(){
+	INIT_LOCAL();
+	
+	std::string dir="/tmp/underscore-test-files";
+	mkdir(dir.c_str(), 0755);
+	std::vector<std::string> paths;
+	size_t total=0;
+	for (int f=0;f<5;f++){
+		paths.push_back(dir+"/app.log."+std::to_string(f));
+		std::ofstream out(paths.back());
+		for (int l=0;l<=f*100;l++, total++)
+			out<<"file "<<f<<" line "<<l<<"\n";
+	}
+	
+	auto all=files(dir+"/app.log.*");
+	FAIL_IF_NOT_EQUAL_INT(all.paths().size(), 5);
+	auto lines=all.to_vector();
+	FAIL_IF_NOT_EQUAL_INT(lines.size(), total);
+	FAIL_IF_NOT_EQUAL_STRING(lines[0], "file 0 line 0");
+	FAIL_IF_NOT_EQUAL_STRING(lines[2], "file 1 line 1");
+	FAIL_IF_NOT_EQUAL_INT(files(dir).count(), total);
+	FAIL_IF_NOT_EQUAL_INT(files({paths[4], paths[1]}).count(), 401+101);
+	
+	auto provenance=files(paths);
+	underscore::string line;
+	provenance.advance(3);
+	FAIL_IF_NOT(provenance.next(line));
+	FAIL_IF_NOT_EQUAL_STRING(line, "file 1 line 2");
+	FAIL_IF_NOT_EQUAL_STRING(provenance.source(), paths[1]);
+	FAIL_IF_NOT_EQUAL_INT(provenance.line(), 3);
+	
+	auto unordered=files(paths, files::unordered, 3);
+	size_t count=0;
+	bool consistent=true;
+	while (unordered.next(line)){
+		count++;
+		auto expected=underscore::string("file "+std::string(unordered.source()).substr(dir.size()+9)+" line "+std::to_string(unordered.line()-1));
+		consistent=consistent && line==expected;
+	}
+	FAIL_IF_NOT_EQUAL_INT(count, total);
+	FAIL_IF_NOT(consistent);
+	FAIL_IF_NOT_EQUAL_INT(files(paths, files::unordered, 2).take(10).count(), 10); // Stops the readers early
+	
+	auto errors=files(paths).with_source()
+		.filter([](const source_line &l){ return l.text.endswith(" line 7"); })
+		.to_vector();
+	FAIL_IF_NOT_EQUAL_INT(errors.size(), 4);
+	FAIL_IF_NOT_EQUAL_STRING(*errors[0].path, paths[1]);
+	FAIL_IF_NOT_EQUAL_INT(errors[0].line, 8);
+	FAIL_IF_NOT_EQUAL_STRING(errors[3].text, "file 4 line 7");
+	FAIL_IF_NOT_EQUAL_STRING(*errors[3].path, paths[4]);
+	auto skipped=files(paths).with_source();
+	source_line located;
+	skipped.advance(3);
+	FAIL_IF_NOT(skipped.next(located));
+	FAIL_IF_NOT_EQUAL_STRING(*located.path, paths[1]);
+	FAIL_IF_NOT_EQUAL_INT(located.line, 3);
+	
+	FAIL_IF_NOT_EQUAL_INT(files(dir+"/nothing*").count(), 0);
+	FAIL_IF_NOT_EQUAL_STRING(files(dir+"/nothing*").source(), "");
+	{
+		std::string odd=dir+"/logs [a-z]*?";
+		mkdir(odd.c_str(), 0755);
+		std::ofstream(odd+"/b")<<"1\n2\n";
+		std::ofstream(odd+"/a")<<"3\n";
+		FAIL_IF_NOT_EQUAL_STRING(files(odd).to_vector().join("|"), "3|1|2");
+		unlink((odd+"/a").c_str());
+		unlink((odd+"/b").c_str());
+		rmdir(odd.c_str());
+	}
+	size_t short_runs=0; // The last line is not lost when the readers end while it waits
+	for (int i=0;i<200;i++)
+		short_runs+=files(paths, files::unordered, 4).count()!=total;
+	FAIL_IF_NOT_EQUAL_INT(short_runs, 0);
+	for (auto &p: paths)
+		unlink(p.c_str());
+	rmdir(dir.c_str());
+	
+	END_LOCAL();
+}
+
+void g18_fields(){
+	INIT_LOCAL();
+	
+	auto rows=vector_of<std::string>({"a,b,c,d", "1,\"x,y\",3", "\"say \"\"hi\"\"\",,", "only"})
+		.fields(',', {3, 1})
+		.map<std::string>([](const row &r){ return r[0].str()+"|"+r[1].str(); })
+		.to_vector();
+	FAIL_IF_NOT_EQUAL_INT(rows.size(), 4);
+	FAIL_IF_NOT_EQUAL_STRING(rows[0], "d|b");
+	FAIL_IF_NOT_EQUAL_STRING(rows[1], "|x,y"); // Missing fields are empty
+	FAIL_IF_NOT_EQUAL_STRING(rows[2], "|");
+	FAIL_IF_NOT_EQUAL_STRING(rows[3], "|");
+	auto quoted=vector_of<std::string>({"\"say \"\"hi\"\"\",2\r"}).fields(','); // Views are valid while it is alive
+	row first;
+	FAIL_IF_NOT(quoted.next(first));
+	row copy=first;
+	FAIL_IF_NOT_EQUAL_INT(copy.size(), 2);
+	FAIL_IF_NOT_EQUAL_STRING(copy[0].str(), "say \"hi\"");
+	FAIL_IF_NOT_EQUAL_STRING(copy[1].str(), "2");
+	
+	std::string path="/tmp/underscore-test.csv";
+	{
+		std::ofstream out(path);
+		out<<"id,name,amount\n";
+		for (int i=0;i<20000;i++){
+			if (i%7==0)
+				out<<i<<",\"multi\nline, \"\"quoted\"\"\","<<i*2<<"\r\n";
+			else
+				out<<i<<",name "<<i<<","<<i*2<<"\n";
+		}
+		out<<"20000,last,40000"; // No final newline
+	}
+	long sum=csv(path, ',', {2}, true).map<long>([](const row &r){ return r[0].to_long(); }).sum();
+	FAIL_IF_NOT_EQUAL_INT(sum, 20001L*20000);
+	
+	auto by_name=csv(path, {"name", "id"});
+	FAIL_IF_NOT_EQUAL_INT(by_name.header().size(), 3);
+	row r;
+	bool consistent=true;
+	size_t count=0;
+	while (by_name.next(r)){
+		long id=r[1].to_long();
+		std::string expected=id%7==0 && id<20000 ? "multi\nline, \"quoted\"" : id==20000 ? "last" : "name "+std::to_string(id);
+		consistent=consistent && r.size()==2 && r[0].str()==expected && id==long(count);
+		count++;
+	}
+	FAIL_IF_NOT_EQUAL_INT(count, 20001);
+	FAIL_IF_NOT(consistent);
+	FAIL_IF_NOT_EQUAL_INT(csv(path).count(), 20002);
+	FAIL_IF_NOT_EXCEPTION(csv(path, {"nope"}));
+	FAIL_IF_NOT_EQUAL_INT(csv("/tmp/does-not-exist.csv").count(), 0);
+	unlink(path.c_str());
+	
+	END_LOCAL();
+}
+
+void g19_follow_file(){
+	INIT_LOCAL();
+	
+	std::string path="/tmp/underscore-test-follow.log", checkpoint=path+".offset";
+	unlink(checkpoint.c_str());
+	auto append=[&path](const std::string &data){
+		std::ofstream out(path, std::ios::app);
+		out<<data;
+	};
+	{
+		std::ofstream out(path);
+		out<<"one\ntwo\nthree\n";
+	}
+	FAIL_IF_NOT_EQUAL_INT(follow_file(path, follow_file::stop_at_end, checkpoint).count(), 3);
+	FAIL_IF_NOT_EQUAL_INT(follow_file(path, follow_file::stop_at_end, checkpoint).count(), 0);
+	append("four\nfive\nsix"); // The last line is not complete yet
+	FAIL_IF_NOT_EQUAL_STRING(follow_file(path, follow_file::stop_at_end, checkpoint).to_vector().join("|"), "four|five");
+	append(" and more\n");
+	FAIL_IF_NOT_EQUAL_STRING(follow_file(path, follow_file::stop_at_end, checkpoint).to_vector().join("|"), "six and more");
+	
+	// Explicit positions, and the same generator keeps reading what is appended
+	follow_file live(path, follow_file::stop_at_end);
+	FAIL_IF_NOT_EQUAL_INT(live.advance(2), 2);
+	auto pos=live.get_position();
+	FAIL_IF_NOT_EQUAL_INT(pos.offset, 8);
+	FAIL_IF_NOT_EQUAL_STRING(follow_file(path, pos, follow_file::stop_at_end).to_vector().join("|"), "three|four|five|six and more");
+	FAIL_IF_NOT_EQUAL_INT(live.advance(10), 4);
+	append("seven\n");
+	underscore::string line;
+	FAIL_IF_NOT(live.next(line));
+	FAIL_IF_NOT_EQUAL_STRING(line, "seven");
+	
+	// Rotation: the rest of the old file, then the new one from the start
+	append("eight\nnine");
+	rename(path.c_str(), (path+".1").c_str());
+	{
+		std::ofstream out(path);
+		out<<"new one\n";
+	}
+	FAIL_IF_NOT_EQUAL_STRING(live.to_vector().join("|"), "eight|nine|new one");
+	FAIL_IF_NOT_EQUAL_STRING(follow_file(path, follow_file::stop_at_end, checkpoint).to_vector().join("|"), "new one"); // Another inode
+	// Truncation
+	{
+		std::ofstream out(path);
+		out<<"again\n";
+	}
+	FAIL_IF_NOT_EQUAL_STRING(live.to_vector().join("|"), "again");
+	
+	// Waiting for new lines, and stop() from another thread
+	follow_file waiting(path);
+	std::thread writer([&](){
+		for (int i=0;i<5;i++){
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			append("waited "+std::to_string(i)+"\n");
+		}
+	});
+	FAIL_IF_NOT_EQUAL_STRING(waiting.take(6).to_vector().join("|"), "again|waited 0|waited 1|waited 2|waited 3|waited 4");
+	writer.join();
+	follow_file stopped(path);
+	std::thread stopper([&stopped](){
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		stopped.stop();
+	});
+	FAIL_IF_NOT_EQUAL_INT(stopped.count(), 6);
+	stopper.join();
+	
+	unlink(path.c_str());
+	unlink((path+".1").c_str());
+	unlink(checkpoint.c_str());
+	
+	END_LOCAL();
+}
+
+void g20_cache(){
+	INIT_LOCAL();
+	
+	std::string source="/tmp/underscore-test-services", dir="/tmp/underscore-test-cache";
+	{
+		std::ofstream out(source);
+		for (int i=0;i<1000;i++)
+			out<<"service"<<i<<"\t"<<i<<"/tcp\n";
+	}
+	auto first=file(source).cached(dir);
+	FAIL_IF(first.hit());
+	auto expected=file(source).to_vector();
+	auto lines=first.map<std::string>([](string_ref l){ return l.str(); }).to_vector();
+	FAIL_IF_NOT_EQUAL_INT(lines.size(), 1000);
+	FAIL_IF_NOT_EQUAL_STRING(lines.join("|"), expected.join("|"));
+	
+	auto second=file(source).cached(dir);
+	FAIL_IF_NOT(second.hit());
+	FAIL_IF_NOT_EQUAL_INT(second.list().size(), 1000);
+	FAIL_IF_NOT_EQUAL_STRING(second.list()[999].str(), "service999\t999/tcp");
+	FAIL_IF_NOT_EQUAL_INT(second.advance(998), 998);
+	FAIL_IF_NOT_EQUAL_INT(second.count(), 2);
+	
+	{
+		std::ofstream out(source, std::ios::app);
+		out<<"extra\t1/udp\n";
+	}
+	auto changed=file(source).cached(dir);
+	FAIL_IF(changed.hit());
+	FAIL_IF_NOT_EQUAL_INT(changed.count(), 1001);
+	FAIL_IF_NOT(file(source).cached(dir).hit());
+	FAIL_IF_NOT_EXCEPTION(file("/tmp/does-not-exist").cached(dir));
+	
+	// A partly read file still caches, and gets, all of its lines
+	unlink(cache_path(source, dir).c_str());
+	auto partial=file(source);
+	FAIL_IF_NOT_EQUAL_INT(partial.advance(10), 10);
+	auto whole=partial.cached(dir);
+	FAIL_IF(whole.hit());
+	FAIL_IF_NOT_EQUAL_INT(whole.count(), 1001);
+	FAIL_IF_NOT_EQUAL_INT(partial.cached(dir).count(), 1001);
+	FAIL_IF_NOT_EQUAL_INT(partial.count(), 991);
+	
+	// Lists by themselves
+	std::string path=dir+"/list";
+	save(path, sequence<std::vector<std::string>>(std::vector<std::string>{"ssh", "", "http"}));
+	mapped_string_list mapped(path);
+	FAIL_IF_NOT_EQUAL_INT(mapped.size(), 3);
+	FAIL_IF_NOT_EQUAL_INT(mapped.bytes(), 7);
+	FAIL_IF_NOT_EQUAL_STRING(mapped[2].str(), "http");
+	FAIL_IF_NOT(mapped.key().path.empty());
+	FAIL_IF_NOT_EQUAL_STRING(mapped.packed().join("|"), "ssh||http");
+	split_packed("c,b,a", ',').sort().save(path);
+	FAIL_IF_NOT_EQUAL_STRING(mapped_string_list(path).packed().join(), "a, b, c");
+	FAIL_IF_NOT_EQUAL_STRING(mapped.packed().join("|"), "ssh||http"); // Still mapped after the file was replaced
+	
+	{
+		std::ofstream out(path);
+		out<<"not a cache file at all, just some text that is long enough";
+	}
+	FAIL_IF_NOT_EXCEPTION(mapped_string_list(path).size());
+	split_packed("c,b,a", ',').save(path);
+	FAIL_IF(truncate(path.c_str(), 70)!=0);
+	FAIL_IF_NOT_EXCEPTION(mapped_string_list(path).size());
+	FAIL_IF_NOT_EXCEPTION(mapped_string_list(dir+"/nothing"));
+	split_packed("c,b,a", ',').save(path);
+	{
+		uint32_t bad=3; // Offsets 0, 3, 2, 3
+		int fd=open(path.c_str(), O_WRONLY);
+		FAIL_IF(pwrite(fd, &bad, sizeof(bad), sizeof(detail::cache_header)+sizeof(uint32_t))!=sizeof(bad));
+		close(fd);
+	}
+	FAIL_IF_NOT_EXCEPTION(mapped_string_list(path).size());
+	
+	unlink(path.c_str());
+	unlink(cache_path(cache_key::of(source).path, dir).c_str());
+	unlink(source.c_str());
+	rmdir(dir.c_str());
+	
 	END_LOCAL();
 }
 
@@ -370,6 +1309,269 @@ void st06_index(){
 	END_LOCAL();
 }
 
+void st07_case(){
+	INIT_LOCAL();
+	
+	FAIL_IF_NOT_EQUAL_STRING(_("Hello, WORLD of long strings, more than 32 bytes.").lower(), "hello, world of long strings, more than 32 bytes.");
+	FAIL_IF_NOT_EQUAL_STRING(_("Hello, world of long strings, more than 32 bytes.").upper(), "HELLO, WORLD OF LONG STRINGS, MORE THAN 32 BYTES.");
+	FAIL_IF_NOT_EQUAL_STRING(_("@[`{ Ñandú ÀZ az").lower(), "@[`{ Ñandú Àz az"); // Non ASCII and limits pass unchanged
+	FAIL_IF_NOT_EQUAL_STRING(_("@[`{ Ñandú ÀZ az").upper(), "@[`{ ÑANDú ÀZ AZ");
+	
+	auto a=_("Content-Type");
+	FAIL_IF_NOT_EQUAL_STRING(a.lower(), "content-type");
+	FAIL_IF_NOT_EQUAL_STRING(a, "Content-Type");
+	
+	FAIL_IF_NOT(a.iequals("content-TYPE"));
+	FAIL_IF(a.iequals("content-types"));
+	FAIL_IF_NOT(a.istartswith("CONTENT"));
+	FAIL_IF(a.istartswith("CONTENTS"));
+	FAIL_IF_NOT(a.icontains("t-t"));
+	FAIL_IF_NOT(a.icontains(""));
+	FAIL_IF(a.icontains("x-t"));
+	FAIL_IF_NOT(_("A very long header name, longer than 32 bytes, X-Forwarded-For").iequals("a very long header name, longer than 32 bytes, x-forwarded-for"));
+	
+	END_LOCAL();
+}
+
+void st08_searcher(){
+	INIT_LOCAL();
+	
+	auto world=searcher("world");
+	auto comma=searcher(",");
+	auto long_needle=searcher("a needle that is long enough to use horspool");
+	FAIL_IF_NOT_EQUAL_INT(world.get_strategy(), searcher::first_last);
+	FAIL_IF_NOT_EQUAL_INT(comma.get_strategy(), searcher::single_byte);
+	FAIL_IF_NOT_EQUAL_INT(long_needle.get_strategy(), searcher::horspool);
+	
+	auto a=_("Hello, world. Hello, world again, and more text so SIMD blocks are used.");
+	FAIL_IF_NOT(a.contains(world));
+	FAIL_IF(a.contains(long_needle));
+	FAIL_IF_NOT_EQUAL_INT(a.index(world), 7);
+	FAIL_IF_NOT_EQUAL_INT(a.index(world, 8), 21);
+	FAIL_IF_NOT_EQUAL_INT(a.index(world, 8, 25), -1);
+	FAIL_IF_NOT_EQUAL_INT(a.rindex(world), 21);
+	FAIL_IF_NOT_EQUAL_INT(a.rindex(world, 0, 25), 7);
+	FAIL_IF_NOT_EQUAL_INT(a.index(comma, 6), 19);
+	FAIL_IF_NOT_EQUAL_INT(a.index(',', 6, 10), -1);
+	FAIL_IF_NOT_EQUAL_INT(a.rindex(',', 0, 19), 5);
+	FAIL_IF_NOT_EQUAL_INT(a.index("world", 8, 26), 21);
+	
+	auto b=_("xx a needle that is long enough to use horspool, yes");
+	FAIL_IF_NOT_EQUAL_INT(b.index(long_needle), 3);
+	FAIL_IF_NOT_EQUAL_INT(b.rindex(long_needle), 3);
+	
+	// Backwards with the precompiled tables: a long needle near the start of a long haystack
+	std::string hay(1000000, 'n');
+	hay.replace(10, long_needle.size(), long_needle.needle());
+	hay.replace(500, 5, "world");
+	FAIL_IF_NOT_EQUAL_INT(long_needle.rfind(hay), 10);
+	FAIL_IF_NOT_EQUAL_INT(world.rfind(hay), 500);
+	FAIL_IF_NOT_EQUAL_INT(searcher("needle that is long enough to use horspool, but not there").rfind(hay), -1);
+	size_t mismatches=0;
+	for (int i=0;i<2000;i++){ // Same results as the naive search
+		std::string h, n;
+		for (int j=0;j<60;j++)
+			h+="ab"[(i*7+j*j*13+(j>>2))%3%2];
+		for (int j=0;j<2+i%40;j++)
+			n+="ab"[(i+j*5)%3%2];
+		if (i%2)
+			n=h.substr(i%19, n.size());
+		mismatches+=searcher(n).rfind(h)!=searcher::rfind_once(h.data(), h.size(), n.data(), n.size());
+	}
+	FAIL_IF_NOT_EQUAL_INT(mismatches, 0);
+	
+	FAIL_IF_NOT_EQUAL_STRING(_("web/tcp dns/udp ssh/tcp").split(' ').filter(searcher("/tcp")).join(), "web/tcp, ssh/tcp");
+	
+	END_LOCAL();
+}
+
+void st09_string_ref(){
+	INIT_LOCAL();
+	
+	std::string line="  ssh    22/tcp  # The Secure Shell";
+	string_ref r(line);
+	
+	auto parts=r.slice(0, r.index('#')).strip().split(' ');
+	FAIL_IF_NOT_EQUAL_INT(parts.size(), 2);
+	FAIL_IF_NOT_EQUAL_STRING(parts[0].str(), "ssh");
+	FAIL_IF_NOT(parts[1].data()>=line.data() && parts[1].data()<line.data()+line.size()); // A view, not a copy
+	FAIL_IF_NOT(parts[1].endswith("/tcp"));
+	FAIL_IF_NOT(parts[1].startswith("22"));
+	FAIL_IF_NOT_EQUAL_INT(parts[1].slice(0,-4).to_long(), 22);
+	FAIL_IF_NOT(r.contains("Secure"));
+	FAIL_IF_NOT(r.contains(searcher("Shell")));
+	FAIL_IF_NOT_EQUAL_INT(r.index("Shell"), line.find("Shell"));
+	FAIL_IF_NOT_EQUAL_INT(r.rindex('s'), line.rfind('s'));
+	FAIL_IF_NOT_EQUAL_STRING(string_ref("a, b, c").split(", ").join("|"), "a|b|c");
+	FAIL_IF_NOT(parts[0]==string_ref("ssh"));
+	FAIL_IF_NOT(parts[0]<string_ref("ssi"));
+	
+	FAIL_IF_NOT_EQUAL(string_ref("-9223372036854775808").to_long(), std::numeric_limits<long>::min());
+	FAIL_IF_NOT_EXCEPTION(string_ref("9223372036854775808").to_long());
+	FAIL_IF_NOT_EXCEPTION(string_ref("12a").to_long());
+	FAIL_IF_NOT_EXCEPTION(string_ref("-").to_long());
+	FAIL_IF_NOT_EQUAL(string_ref("123.5 trailing").slice(0,5).to_double(), 123.5);
+	
+	auto s=string(r.strip()); // Explicit owning copy
+	FAIL_IF_NOT_EQUAL_STRING(s, "ssh    22/tcp  # The Secure Shell");
+	FAIL_IF_NOT(s.ref().data()!=line.data());
+	
+	END_LOCAL();
+}
+
+void st10_intern(){
+	INIT_LOCAL();
+	
+	auto l=split_interned("tcp udp tcp ssh udp", ' ');
+	FAIL_IF_NOT_EQUAL_INT(l.size(), 5);
+	FAIL_IF_NOT(l[0]==l[2]);
+	FAIL_IF_NOT(l[0].data()==l[2].data()); // Same storage
+	FAIL_IF(l[0]==l[1]);
+	FAIL_IF_NOT(l[0]==interned_string("tcp"));
+	FAIL_IF_NOT_EQUAL_STRING(l.sort().unique(true).join(), "ssh, tcp, udp");
+	FAIL_IF_NOT(std::hash<interned_string>()(l[1])==std::hash<interned_string>()(l[4]));
+	
+	auto m=_("tcp udp").split(' ').map<interned_string>(interner());
+	FAIL_IF_NOT(m[1]==l[1]);
+	FAIL_IF_NOT(map_interned(_("ssh tcp").split(' '))[0]==l[3]);
+	FAIL_IF_NOT(interned_string()==interned_string(""));
+	
+	intern_pool pool(0); // Sweeps whenever possible
+	{
+		auto a=pool.intern("temporary");
+		FAIL_IF_NOT_EQUAL_INT(pool.size(), 1);
+		auto b=pool.intern("kept");
+		FAIL_IF_NOT_EQUAL_INT(pool.evict(), 0); // Both referenced
+	}
+	auto kept=pool.intern("kept");
+	FAIL_IF_NOT_EQUAL_INT(pool.evict(), 1);
+	FAIL_IF_NOT_EQUAL_INT(pool.size(), 1);
+	FAIL_IF_NOT_EQUAL_STRING(kept.str(), "kept");
+	
+	END_LOCAL();
+}
+
+void st11_packed(){
+	INIT_LOCAL();
+	
+	auto l=split_packed("ssh,http,,ftp,http", ',');
+	FAIL_IF_NOT_EQUAL_INT(l.size(), 4);
+	FAIL_IF_NOT_EQUAL_INT(l.bytes(), 14);
+	FAIL_IF_NOT_EQUAL_STRING(l[1].str(), "http");
+	FAIL_IF_NOT_EQUAL_STRING(l.join("|"), "ssh|http|ftp|http");
+	FAIL_IF_NOT_EQUAL_STRING(l.sort().join(), "ftp, http, http, ssh");
+	FAIL_IF_NOT_EQUAL_STRING(l.sort().unique(true).join(), "ftp, http, ssh");
+	FAIL_IF_NOT_EQUAL_STRING(l.unique().join(), "ssh, http, ftp");
+	FAIL_IF_NOT_EQUAL_STRING(l.filter([](const string_ref &s){ return s.contains('t'); }).join(), "http, ftp, http");
+	FAIL_IF_NOT_EQUAL_INT(split_packed("a,,b", ',', true).size(), 3);
+	FAIL_IF_NOT_EQUAL_STRING(split_packed("a, b, c", ", ").join("|"), "a|b|c");
+	
+	packed_string_list m{"zeta", "alpha", "alphabet", "alpha"};
+	m.append(l);
+	m.shrink_to_fit();
+	FAIL_IF_NOT_EQUAL_STRING(m.sort().join(), "alpha, alpha, alphabet, ftp, http, http, ssh, zeta");
+	FAIL_IF_NOT_EQUAL_STRING(m.refs().slice(0,2).join(), "zeta, alpha");
+	FAIL_IF_NOT_EQUAL_STRING(packed_string_list(_("x y").split(' ')).join(), "x, y");
+	
+	packed_string_list self{"ab", "c"};
+	self.append(self);
+	FAIL_IF_NOT_EQUAL_STRING(self.join("|"), "ab|c|ab|c");
+	for (int i=0;i<100;i++) // Views into itself, while the arena grows
+		self.push_back(self[i]);
+	FAIL_IF_NOT_EQUAL_INT(self.size(), 104);
+	FAIL_IF_NOT_EQUAL_STRING(self[103].str(), "c");
+	FAIL_IF_NOT_EQUAL_INT(self.bytes(), 52*3);
+	
+	END_LOCAL();
+}
+
+void st12_builder(){
+	INIT_LOCAL();
+	
+	auto a=_("Hello"), b=_("world");
+	FAIL_IF_NOT_EQUAL_STRING(a + ", " + b + "!", "Hello, world!");
+	FAIL_IF_NOT_EQUAL_STRING(a, "Hello");
+	
+	string_builder sb;
+	sb << a << ", " << std::string("big ") << b << '!';
+	FAIL_IF_NOT_EQUAL_INT(sb.size(), 17);
+	FAIL_IF_NOT_EQUAL_STRING(sb.str(), "Hello, big world!");
+	
+	rope r;
+	std::string expected;
+	for (int i=0;i<5000;i++){
+		auto piece=std::to_string(i)+(i%7 ? "," : std::string(600, 'x'));
+		r+=piece;
+		expected+=piece;
+	}
+	FAIL_IF_NOT_EQUAL_INT(r.size(), expected.size());
+	FAIL_IF_NOT(r.depth()<40);
+	FAIL_IF_NOT(r.str()==expected);
+	FAIL_IF_NOT(r.slice(1000, 91234).str()==expected.substr(1000, 90234));
+	FAIL_IF_NOT(r.slice(-10).str()==expected.substr(expected.size()-10));
+	FAIL_IF_NOT_EQUAL_INT(r[4321], expected[4321]);
+	auto both=r.slice(0,10)+rope("--")+r.slice(-5);
+	FAIL_IF_NOT_EQUAL_STRING(both.str(), expected.substr(0,10)+"--"+expected.substr(expected.size()-5));
+	
+	END_LOCAL();
+}
+
+void st13_pattern(){
+	INIT_LOCAL();
+	
+	auto logs=pattern::glob("*.log");
+	FAIL_IF_NOT(logs.match("error.log"));
+	FAIL_IF(logs.match("error.log.gz"));
+	FAIL_IF_NOT_EQUAL_STRING(logs.required_literal(), ".log");
+	FAIL_IF_NOT(_("access.log").match(logs));
+	FAIL_IF_NOT(pattern::glob("file?.[ch]").match("file1.h"));
+	FAIL_IF(pattern::glob("[!a]*").match("abc"));
+	// A leading ']' in a class is a literal, as in fnmatch
+	FAIL_IF_NOT(pattern::glob("[]]").match("]"));
+	FAIL_IF_NOT(pattern::glob("[]a]x").match("ax"));
+	FAIL_IF_NOT(pattern::glob("[!]]").match("a"));
+	FAIL_IF(pattern::glob("[!]]").match("]"));
+	FAIL_IF_NOT(pattern::glob("[!]").match("[!]"));
+	
+	// Long SPLIT chains near max_program do not recurse once per instruction
+	std::string optionals;
+	for (int i=0;i<40000;++i)
+		optionals+="a?";
+	auto om=pattern(optionals+"(b)").exec(std::string(100, 'a')+"b");
+	FAIL_IF_NOT(om.matched(1));
+	std::string alternatives="(";
+	for (int i=0;i<30000;++i)
+		alternatives+="c|";
+	alternatives+="d)";
+	auto am=pattern(alternatives).exec("xd");
+	FAIL_IF_NOT_EQUAL_STRING(am[1].str(), "d");
+	
+	FAIL_IF_NOT_EQUAL_INT(_("ssh 22/tcp,dns 53/udp,www 80/tcp,x y/tcp").split(',').filter(pattern("^\\w+ \\d+/tcp$")).size(), 2);
+	FAIL_IF_NOT(pattern("colou?r").match("my colour"));
+	FAIL_IF(pattern("^a{2,3}$").match("aaaa"));
+	FAIL_IF_NOT(pattern("^(ab|cd)+$").match("abcdab"));
+	
+	auto m=pattern("(\\w+)@(\\w+)\\.com").exec("mail to: dmoreno@coralbits.com.");
+	FAIL_IF_NOT(m);
+	FAIL_IF_NOT_EQUAL_STRING(m[0].str(), "dmoreno@coralbits.com");
+	FAIL_IF_NOT_EQUAL_STRING(m[1].str(), "dmoreno");
+	FAIL_IF_NOT_EQUAL_STRING(m[2].str(), "coralbits");
+	FAIL_IF_NOT_EQUAL_INT(m.position(), 9);
+	FAIL_IF(pattern("x(y)?").exec("x").matched(1));
+	
+	FAIL_IF_NOT_EXCEPTION(pattern("(ab"));
+	FAIL_IF_NOT_EXCEPTION(pattern("*a"));
+	FAIL_IF_NOT_EXCEPTION(pattern("\\bword\\b")); // Unsupported escapes are not literal letters
+	FAIL_IF_NOT_EXCEPTION(pattern("[\\B]"));
+	FAIL_IF_NOT(pattern("a\\.b\\\\").match("a.b\\"));
+	FAIL_IF_NOT(pattern("^a{2,1000}$").match(std::string(1000, 'a')));
+	FAIL_IF_NOT_EXCEPTION(pattern("a{1001}"));
+	FAIL_IF_NOT_EXCEPTION(pattern("a{99999999999}"));
+	FAIL_IF_NOT_EXCEPTION(pattern("((a{1000}){1000}){1000}"));
+	
+	END_LOCAL();
+}
+
 void f01_istream(){
 	INIT_LOCAL();
 	auto first_5_services_sorted=file("/etc/services")
@@ -398,6 +1600,23 @@ int main(int argc, char **argv){
 	g01_generator();
 	g02_gentest();
 	g03_slice();
+	g04_next();
+	g05_typed();
+	g06_mmap_file();
+	g07_fd_file();
+	g08_parallel_file();
+	g09_prefetch_file();
+	g10_terminals();
+	g11_external_sort();
+	g12_top_k();
+	g13_async();
+	g14_next_batch();
+	g15_take_skip();
+	g16_write_to();
+	g17_files();
+	g18_fields();
+	g19_follow_file();
+	g20_cache();
 	
 	st01_strings();
 	st02_strings_underscore();
@@ -405,6 +1624,13 @@ int main(int argc, char **argv){
 	st04_strip();
 	st05_format();
 	st06_index();
+	st07_case();
+	st08_searcher();
+	st09_string_ref();
+	st10_intern();
+	st11_packed();
+	st12_builder();
+	st13_pattern();
 
 	f01_istream();
 	
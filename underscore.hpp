@@ -151,3 +151,5 @@ namespace underscore{
 		return zip(a, b);
 	}
 };
+
+#include "sink.hpp"